@@ -0,0 +1,116 @@
+#!/bin/bash
+# Runs the benchmarks of bench/ in every mode and compares them against the stored baseline
+#     bench/bench.sh [-r runs] [-w warmup runs] [-m "modes"] [-b baseline file] [-t threshold %] [-s] [benchmarks...]
+# Every benchmark is run warmup times untimed, then runs times, and its median and 95th percentile are reported in ms
+# A run whose output differs from <benchmark>.out fails the benchmark
+# -s writes the results as the new baseline, otherwise a median more than threshold % above the baseline is a regression
+# and the script exits with 1
+# The baseline depends on the machine it was measured on, write one with -s (make bench_baseline) before comparing
+
+EXE=./lii
+RUNS=10
+WARMUP=2
+MODES="interp baseline jit"
+BASELINE=bench/baseline.txt
+THRESHOLD=10
+SAVE=0
+
+while getopts "r:w:m:b:t:s" option; do
+    case $option in
+        r) RUNS=$OPTARG ;;
+        w) WARMUP=$OPTARG ;;
+        m) MODES=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        t) THRESHOLD=$OPTARG ;;
+        s) SAVE=1 ;;
+        *) exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+BENCHMARKS=${@:-$(ls bench/*.cl)}
+
+# Command that runs the benchmark in the mode, new modes get a line here
+mode_command() {
+    case $1 in
+        interp) echo "$EXE $2" ;;
+        baseline) echo "$EXE $2 -jit=baseline" ;;
+        jit) echo "$EXE $2 -jit" ;;
+        llvm) echo "$EXE $2 -jit=llvm" ;;
+        aot) echo "./jit_functions/bench_aot" ;; # compiled by prepare_mode
+        *) echo "Unknown mode $1" >&2; exit 2 ;;
+    esac
+}
+
+# Work done before the benchmark is timed in the mode
+prepare_mode() {
+    case $1 in
+        aot) $EXE $2 -aot=./jit_functions/bench_aot > /dev/null ;;
+    esac
+}
+
+# Median and 95th percentile (nearest rank) of the times on stdin, one per line
+percentiles() {
+    sort -n | awk '{ times[NR] = $1 } END {
+        median = NR % 2 ? times[(NR + 1) / 2] : (times[NR / 2] + times[NR / 2 + 1]) / 2
+        rank = int(0.95 * NR + 0.999999)
+        printf "%.1f %.1f\n", median, times[rank]
+    }'
+}
+
+results=$(mktemp)
+trap 'rm -f "$results" "$results.out"' EXIT
+status=0
+
+printf "%-20s %-10s %12s %12s %12s %10s\n" benchmark mode median_ms p95_ms baseline_ms change
+for bench in $BENCHMARKS; do
+    name=$(basename "$bench" .cl)
+    for mode in $MODES; do
+        command=$(mode_command $mode "$bench") || exit 2
+        if ! prepare_mode $mode "$bench"; then
+            printf "%-20s %-10s %12s\n" "$name" "$mode" "FAILED"
+            status=1
+            continue
+        fi
+
+        for ((i = 0; i < WARMUP; i++)); do
+            $command > /dev/null
+        done
+        times=""
+        failed=0
+        for ((i = 0; i < RUNS; i++)); do
+            start=$(date +%s%N)
+            $command > "$results.out"
+            end=$(date +%s%N)
+            diff -q -b -w "$results.out" "$bench.out" > /dev/null || failed=1
+            times+="$(( (end - start) / 1000 ))"$'\n'
+        done
+        if [ $failed = 1 ]; then
+            printf "%-20s %-10s %12s\n" "$name" "$mode" "WRONG OUTPUT"
+            status=1
+            continue
+        fi
+
+        read median p95 <<< "$(printf "%s" "$times" | awk 'NF { print $1 / 1000 }' | percentiles)"
+        echo "$name $mode $median $p95" >> "$results"
+        previous=$(awk -v name="$name" -v mode="$mode" '$1 == name && $2 == mode { print $3 }' "$BASELINE" 2>/dev/null)
+        change=""
+        if [ -n "$previous" ]; then
+            change=$(awk -v now="$median" -v before="$previous" 'BEGIN { printf "%+.1f%%", (before > 0 ? 100 * (now - before) / before : 0) }')
+            if [ $SAVE = 0 ] && awk -v now="$median" -v before="$previous" -v limit="$THRESHOLD" 'BEGIN { exit !(now > before * (1 + limit / 100)) }'; then
+                change+=" REGRESSION"
+                status=1
+            fi
+        fi
+        printf "%-20s %-10s %12s %12s %12s %10s\n" "$name" "$mode" "$median" "$p95" "${previous:--}" "$change"
+    done
+done
+
+if [ $SAVE = 1 ]; then
+    # results of benchmarks and modes that weren't run are kept
+    if [ -f "$BASELINE" ]; then
+        awk 'NR == FNR { run[$1 " " $2] = 1; next } !run[$1 " " $2]' "$results" "$BASELINE" >> "$results"
+    fi
+    sort "$results" > "$BASELINE"
+    echo "Baseline written to $BASELINE"
+fi
+exit $status
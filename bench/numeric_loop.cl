@@ -0,0 +1,8 @@
+// nested arithmetic loops, the dispatch and number operations of the interpreter
+let sum = 0;
+for (let i = 0; i < 300; i = i + 1) {
+    for (let j = 0; j < 300; j = j + 1) {
+        sum = sum + (i * j) % 7 - j / 300;
+    }
+}
+print sum;
@@ -0,0 +1,18 @@
+// deep and wide recursion, function calls and returns
+let fib = func(n){
+    if (n < 2) {
+        return n;
+    }
+    return fib(n - 1) + fib(n - 2);
+};
+let ackermann = func(m, n){
+    if (m == 0) {
+        return n + 1;
+    }
+    if (n == 0) {
+        return ackermann(m - 1, 1);
+    }
+    return ackermann(m - 1, ackermann(m, n - 1));
+};
+print fib(22);
+print ackermann(2, 60);
@@ -0,0 +1,10 @@
+// calls into the standard library
+let words = $string_split("the quick brown fox jumps over the lazy dog", " ");
+let total = 0;
+for (let i = 0; i < 5000; i = i + 1) {
+    let word = words[i % $vector_len(words)];
+    total = total + $string_len($string_substr(word, 0, 2));
+    let letters = $string_to_vector(word);
+    total = total + $vector_len($vector_reverse(letters));
+}
+print total;
@@ -0,0 +1,15 @@
+// string concatenation, comparison and character access
+let text = "";
+for (let i = 0; i < 2000; i = i + 1) {
+    text = text + "ab";
+}
+let count = 0;
+for (let pass = 0; pass < 10; pass = pass + 1) {
+    for (let i = 0; i < 4000; i = i + 1) {
+        if ($char_at(text, i) == "a") {
+            count = count + 1;
+        }
+    }
+}
+print count;
+print $string_len(text);
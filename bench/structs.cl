@@ -0,0 +1,20 @@
+// struct creation and field access
+let Point = struct {
+    let x = 0;
+    let y = 0;
+};
+let points = [];
+for (let i = 0; i < 150; i = i + 1) {
+    let p = Point;
+    p["x"] = i;
+    p["y"] = i % 10;
+    points = $vector_push(points, p);
+}
+let total = 0;
+for (let pass = 0; pass < 10; pass = pass + 1) {
+    for (let i = 0; i < 150; i = i + 1) {
+        let p = points[i];
+        total = total + p["x"] * p["y"];
+    }
+}
+print total;
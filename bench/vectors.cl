@@ -0,0 +1,15 @@
+// building vectors and reading and writing their elements
+let vec = [];
+for (let i = 0; i < 400; i = i + 1) {
+    vec = $vector_push(vec, i % 100);
+}
+for (let pass = 0; pass < 3; pass = pass + 1) {
+    for (let i = 1; i < 400; i = i + 1) {
+        vec[i] = (vec[i] + vec[i - 1]) % 1000;
+    }
+}
+let total = 0;
+for (let i = 0; i < $vector_len(vec); i = i + 1) {
+    total = total + vec[i];
+}
+print total;
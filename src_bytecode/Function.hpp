@@ -14,6 +14,21 @@ std::string CODE_TO_NUMBER_STRING(CODE_SIZE code){
 
 struct function; // Forward declaration
 
+// The functions a call site called, recorded for the JIT
+struct call_feedback
+{
+    function* target = nullptr;
+    bool polymorphic = false; // more than one function was called
+};
+
+// A loop compiled for on stack replacement, entered from the interpreter at its backward jump
+struct osr_loop
+{
+    int back_edges = 0;    // iterations run by the interpreter
+    bool compiled = false; // compiled once, even when the backend can't compile it
+    int jit_index = -1;
+};
+
 struct function {
     CODE_SIZE* code; // Bytecode array
     int count;
@@ -27,9 +42,19 @@ struct function {
     //arguments
     std::vector<std::string> arguments;
 
+    int local_count = 0; // number of local variable slots the function frame needs
+
+    std::vector<int> lines; // source line of every instruction, empty when the .cl_exe has none
+
     //for jit compilation
     int times_called = 0;
+    int back_edges = 0; // backward jumps taken, counts loop iterations
+    int tier = 0;       // 0 interpreted, 1 quick JIT, 2 optimizing JIT
     int jit_index = -1;
+    std::map<int, osr_loop> osr_loops; // by index of the backward jump of the loop
+    std::vector<uint8_t> type_feedback; // by instruction index, bit 1 << Value_Type for every operand type seen there
+    std::vector<call_feedback> calls;   // by instruction index of the call
+    int deopts = 0;                     // times compiled code was thrown away because a type guard failed
 };
 
 #endif //FUNCTION_HPP
\ No newline at end of file
@@ -5,44 +5,133 @@
 #include <string>
 
 #include "Value.hpp"
+#include "opcodes.hpp"
 
 
 struct function_frame
 {
     function *func;
-    int current_scope;
+    std::shared_ptr<closure> func_closure; // Closure being run, holds the upvalues. nullptr for the main function
 
     CODE_SIZE *ip; // Pointer to the current instruction
     int end_of_function;
     int current_instruction;
 
-    std::vector<std::map<std::string, Value>> variables; // Variables in the current function
+    // Local variables of the function, one slot per variable
+    // Blocks reuse the slots of the blocks that came before them, so entering or leaving a block costs nothing
+    std::vector<Value> locals;
+};
+
+// Remembers the shape seen last at a struct access site, so the next access with the same shape skips the field lookup
+struct inline_cache
+{
+    shape* cached_shape = nullptr;
+    std::string key;            // field name, for sites where the field name is on the stack
+    int slot = -1;              // slot of the field in structs with cached_shape
+    shape* next_shape = nullptr; // for OP_UPDATE_STRUCT_ELEMENT, the shape after the field is added
 };
 
 struct VM; // Forward declaration
+struct vm_profile; // profiler.hpp
+struct bytecode_stats; // stats.hpp
+struct vm_sampler; // sampler.hpp
 
 typedef void (*JIT_FUNCTION)(VM* vm);
 
-#define CALLS_TO_JIT 1
+#define GC_INITIAL_THRESHOLD 1024 // closures and upvalues made before the first collection
+
+// Closures and upvalues the program made, for the cycle collector (gc.hpp)
+struct gc_heap
+{
+    std::vector<std::weak_ptr<closure>> closures;
+    std::vector<std::weak_ptr<upvalue>> upvalues;
+    int allocated = 0; // since the last collection
+    int threshold = GC_INITIAL_THRESHOLD;
+    uint32_t epoch = 0; // mark of the running collection
+
+    // pause statistics, for -mem and $vm_stats()
+    uint64_t collections = 0;
+    uint64_t pause_total_ns = 0;
+    uint64_t pause_max_ns = 0;
+    uint64_t freed_closures = 0;
+    uint64_t freed_upvalues = 0;
+};
+
+// How functions are compiled when the JIT is enabled
+enum Jit_Backend
+{
+    JIT_BACKEND_CLANG, // generates C++, compiles it with clang and loads the shared library
+    JIT_BACKEND_LLVM,  // lowers the bytecode to LLVM IR in process, needs a build with LII_LLVM_JIT
+    JIT_BACKEND_BASELINE, // copies and patches machine code stencils, no compiler needed
+};
+
+// Default thresholds of the JIT tiers, can be changed from the command line
+#define QUICK_JIT_CALLS 2
+#define QUICK_JIT_BACK_EDGES 100
+#define OPTIMIZING_JIT_CALLS 1000
+#define OPTIMIZING_JIT_BACK_EDGES 100000
+#define OSR_JIT_BACK_EDGES 10000
 #define JIT_OPTIMIZATION_LEVEL "-O3"
 
+// When a function moves up a tier: interpreter -> quick JIT (baseline) -> optimizing JIT (the selected backend)
+// A function moves up when it is called or loops (backward jumps) enough times, a threshold of 0 turns it off
+// A single loop that runs long enough in the interpreter is compiled with the selected backend and entered mid loop (OSR)
+struct jit_tiering
+{
+    int quick_calls = QUICK_JIT_CALLS;
+    int quick_back_edges = QUICK_JIT_BACK_EDGES;
+    int optimizing_calls = OPTIMIZING_JIT_CALLS;
+    int optimizing_back_edges = OPTIMIZING_JIT_BACK_EDGES;
+    int osr_back_edges = OSR_JIT_BACK_EDGES;
+    std::string optimization_level = JIT_OPTIMIZATION_LEVEL; // passed to clang by the clang backend
+};
+
 struct VM
 {
     Value *stack;
     int stack_count;
     int stack_capacity;
+    int stack_peak = 0; // most values the stack held, for -mem and $vm_stats()
 
     std::vector<Value> constants;
     std::vector<std::string> variable_names;
 
+    // Globals are the variables in the outermost scope of the main function, indexed at compile time
+    std::vector<Value> globals;
+    std::vector<bool> globals_defined; // false until the global is first assigned
+    std::vector<std::string> global_names;
+
     std::vector<function_frame *> function_frames;
 
+    std::vector<std::shared_ptr<upvalue>> open_upvalues; // Upvalues that still point into a function frame
+    gc_heap gc;
+
+    shape* empty_shape; // Shape of a struct without fields, every other shape is reached from it
+    std::vector<inline_cache> inline_caches; // One per struct access site, indexed at compile time
+
     bool jit;
+    Jit_Backend jit_backend;
+    jit_tiering tiering;
     std::vector<JIT_FUNCTION> jit_functions;
+    std::string jit_directory; // where the clang backend writes its files, empty until the first compile
+    bool jit_perf = false;     // export the compiled code to perf and gdb, see jit_perf_map_add
+    std::string source_path;   // .cl file the program was generated from, for the #line directives of the clang backend
+
+    vm_profile* profile = nullptr; // collects the -profile counters, nullptr when not profiling
+    bytecode_stats* stats = nullptr; // counts the instructions that run for -stats=dynamic, nullptr otherwise
+    vm_sampler* sampler = nullptr; // the frames published to the -sample profiler, nullptr when not sampling
+
+    // call_std_lib_function of the executable, code compiled by the clang backend is a library with its own std lib globals
+    void (*call_std_lib)(VM* vm, int function_index) = nullptr;
+    std::vector<std::string> string_builders; // the $string_builder_ functions, string_builder.hpp
+    std::vector<bool> string_builder_live;    // by builder, false once it was freed
+    std::vector<int> free_string_builders;    // freed builders, reused by the next ones created
 };
 
 VM vm; // Statically allocated because only one VM is needed
 
+void gc_collect(VM* vm); // gc.hpp
+
 void vm_error(const std::string &message)
 {
     std::cout << "ERROR: " << message << std::endl;
@@ -61,16 +150,21 @@ function_frame *get_function_frame(VM* vm, int index)
     return vm->function_frames[index];
 }
 
-function_frame *create_function_frame(function *func)
+function_frame *create_function_frame(function *func, std::shared_ptr<closure> func_closure = nullptr)
 {
     function_frame *frame = new function_frame();
     frame->func = func;
-    frame->current_scope = 0;
+    frame->func_closure = func_closure;
     frame->ip = func->code;
     frame->end_of_function = func->count;
     frame->current_instruction = 0;
-    frame->variables.push_back(std::map<std::string, Value>());
+    frame->locals = std::vector<Value>(func->local_count, Value(Value_Type::NULL_VALUE, nullptr));
 
+    if (value_memory != nullptr)
+    {
+        value_memory->frames++;
+        value_memory->frame_bytes += sizeof(function_frame) + func->local_count * sizeof(Value);
+    }
     return frame;
 }
 
@@ -123,11 +217,16 @@ CODE_SIZE *get_ip(VM* vm)
 void push(VM* vm, Value value)
 {
     vm->stack[vm->stack_count++] = value;
+    if (vm->stack_count > vm->stack_peak)
+    {
+        vm->stack_peak = vm->stack_count;
+    }
 }
 
+// The value is moved out, the slot above the top of the stack is left empty
 Value pop(VM* vm)
 {
-    return vm->stack[--vm->stack_count];
+    return std::move(vm->stack[--vm->stack_count]);
 }
 
 Value top(VM* vm)
@@ -135,6 +234,47 @@ Value top(VM* vm)
     return vm->stack[vm->stack_count - 1];
 }
 
+// Records the operand types seen at the current instruction, the JIT specializes the instruction for them
+// Only recorded with the JIT enabled, runs for the interpreter and for instructions run by lii_rt_execute
+void record_type_feedback(VM* vm, const Value &a, const Value &b)
+{
+    if (!vm->jit)
+    {
+        return;
+    }
+    function_frame *frame = get_current_function_frame(vm);
+    function *func = frame->func;
+    if (func->type_feedback.empty())
+    {
+        func->type_feedback.resize(func->count, 0);
+    }
+    func->type_feedback[frame->ip - func->code] |= (1 << a.type) | (1 << b.type);
+}
+
+// Records the function called by the call instruction at index of the current function, the JIT links or inlines
+// calls that always call the same function
+void record_call_feedback(VM* vm, int index, function *callee)
+{
+    if (!vm->jit)
+    {
+        return;
+    }
+    function *func = get_current_function_frame(vm)->func;
+    if (func->calls.empty())
+    {
+        func->calls.resize(func->count);
+    }
+    call_feedback &call = func->calls[index];
+    if (call.target == nullptr)
+    {
+        call.target = callee;
+    }
+    else if (call.target != callee)
+    {
+        call.polymorphic = true;
+    }
+}
+
 void print_stack(VM* vm)
 {
     for (int i = 0; i < vm->stack_count; i++)
@@ -147,61 +287,318 @@ void print_stack(VM* vm)
 
 // -------------------------------------------------------------------
 
-// Map operations -----------------------------------------------------
+// Variable operations ------------------------------------------------
 
-// Creates a new variable in the current scope
-void set_variable(VM* vm, const std::string &name, Value value)
+// Locals are stored by slot in the current function frame, slots are assigned when the bytecode is generated
+void set_local(VM* vm, int slot, Value value)
 {
-    function_frame *frame = get_current_function_frame(vm);
-    frame->variables[frame->current_scope][name] = value;
+    get_current_function_frame(vm)->locals[slot] = value;
 }
 
-// Updates a variable in the current function frame, does not look in the parent frames
-// Looks for the variable in the closest scope, so climbs out of ifs, loops, etc.
-void update_variable(VM* vm, const std::string &name, Value value)
+Value get_local(VM* vm, int slot)
 {
-    function_frame *frame = get_current_function_frame(vm);
-    for (int i = frame->current_scope; i >= 0; i--)
+    return get_current_function_frame(vm)->locals[slot];
+}
+
+Value get_global(VM* vm, int index)
+{
+    if (!vm->globals_defined[index])
+    {
+        vm_error("get_global: Variable " + vm->global_names[index] + " not found");
+    }
+    return vm->globals[index];
+}
+
+void set_global(VM* vm, int index, Value value)
+{
+    vm->globals[index] = value;
+    vm->globals_defined[index] = true;
+}
+
+// variable = variable + value, OP_ADD with a string variable appended to in place
+void append_to_variable(Value &variable, Value value)
+{
+    if (variable.type == Value_Type::STRING)
     {
-        if (frame->variables[i].find(name) != frame->variables[i].end())
+        std::string &str = std::get<std::string>(variable.data);
+        size_t capacity = str.capacity();
+        append_value_as_string(str, value);
+        if (str.capacity() != capacity && value_memory != nullptr)
         {
-            frame->variables[i][name] = value;
-            return;
+            count_value_memory(variable); // the string moved to a bigger buffer
         }
     }
-    vm_error("update variable: Variable " + name + " not found");
+    else if (variable.type == Value_Type::NUMBER && value.type == Value_Type::NUMBER)
+    {
+        std::get<double>(variable.data) += std::get<double>(value.data);
+    }
+    else if (value.type == Value_Type::STRING)
+    {
+        variable = Value(Value_Type::STRING, concat_values(std::move(variable), value));
+    }
+    else
+    {
+        vm_error("Invalid types for addition");
+    }
 }
 
-// Gets a variable in the current function frame, does not look in the parent frames
-// Looks for the variable in the closest scope, so climbs out of ifs, loops, etc.
-Value get_variable(VM* vm, const std::string &name)
+void append_local(VM* vm, int slot, Value value)
 {
-    function_frame *frame = get_current_function_frame(vm);
-    for (int i = frame->current_scope; i >= 0; i--)
+    append_to_variable(get_current_function_frame(vm)->locals[slot], std::move(value));
+}
+
+void append_global(VM* vm, int index, Value value)
+{
+    if (!vm->globals_defined[index])
+    {
+        vm_error("get_global: Variable " + vm->global_names[index] + " not found");
+    }
+    append_to_variable(vm->globals[index], std::move(value));
+}
+// -------------------------------------------------------------------
+
+// Struct operations --------------------------------------------------
+
+Value create_struct(VM* vm)
+{
+    return {Value_Type::STRUCT, struct_object{vm->empty_shape, {}}};
+}
+
+// Sets a field while the struct is being created, adding the field if the struct doesn't have it yet
+void set_struct_field(VM* vm, struct_object &obj, const std::string &name, Value value, int cache_index)
+{
+    inline_cache &cache = vm->inline_caches[cache_index];
+    if (cache.cached_shape != obj.layout)
+    {
+        cache.cached_shape = obj.layout;
+        cache.slot = shape_find_slot(obj.layout, name);
+        cache.next_shape = cache.slot == -1 ? shape_add_field(obj.layout, name) : obj.layout;
+    }
+
+    if (cache.slot == -1)
+    {
+        obj.layout = cache.next_shape;
+        obj.fields.push_back(value);
+    }
+    else
+    {
+        obj.fields[cache.slot] = value;
+    }
+}
+
+// returns the slot of the field in the struct, the cache is only checked against the shape because the site always uses the same name
+int find_struct_field(VM* vm, const struct_object &obj, const std::string &name, int cache_index)
+{
+    inline_cache &cache = vm->inline_caches[cache_index];
+    if (cache.cached_shape != obj.layout)
     {
-        if (frame->variables[i].find(name) != frame->variables[i].end())
+        int slot = shape_find_slot(obj.layout, name);
+        if (slot == -1)
         {
-            return frame->variables[i][name];
+            vm_error("Key does not exist in struct");
         }
+        cache.cached_shape = obj.layout;
+        cache.slot = slot;
     }
-    vm_error("get_variable: Variable " + name + " not found");
-    return Value(); // To avoid warning, but this line will never be reached because of vm_error
+    return cache.slot;
 }
 
-Value get_function_variable(VM* vm, const std::string &name)
+// Same as find_struct_field for sites where the field name is on the stack, so the cache also checks the name
+int find_struct_field_by_key(VM* vm, const struct_object &obj, const Value &key, int cache_index)
 {
-    for(int j = 0; j < (int)vm->function_frames.size(); j++){
-        function_frame *frame = vm->function_frames[j];
-        for (int i = frame->current_scope; i >= 0; i--)
+    std::string converted;
+    const std::string *name = &converted;
+    if (key.type == Value_Type::STRING)
+    {
+        name = &std::get<std::string>(key.data);
+    }
+    else
+    {
+        converted = VALUE_AS_STRING(key);
+    }
+
+    inline_cache &cache = vm->inline_caches[cache_index];
+    if (cache.cached_shape != obj.layout || cache.key != *name)
+    {
+        int slot = shape_find_slot(obj.layout, *name);
+        if (slot == -1)
+        {
+            vm_error("Key does not exist in struct");
+        }
+        cache.cached_shape = obj.layout;
+        cache.key = *name;
+        cache.slot = slot;
+    }
+    return cache.slot;
+}
+
+int vector_index(const std::vector<Value> &vec, const Value &index)
+{
+    if (index.type != Value_Type::NUMBER)
+    {
+        vm_error("Invalid index type for vector access");
+    }
+    if (VALUE_AS_NUMBER(index) < 0 || VALUE_AS_NUMBER(index) >= vec.size())
+    {
+        vm_error("Index out of bounds");
+    }
+    return (int)VALUE_AS_NUMBER(index);
+}
+
+// Returns obj[index] for a struct or vector
+Value access_element(VM* vm, const Value &obj, const Value &index, int cache_index)
+{
+    if (obj.type == Value_Type::STRUCT)
+    {
+        const struct_object &struct_ = std::get<struct_object>(obj.data);
+        return struct_.fields[find_struct_field_by_key(vm, struct_, index, cache_index)];
+    }
+    else if (obj.type == Value_Type::VECTOR)
+    {
+        const std::vector<Value> &vec = std::get<std::vector<Value>>(obj.data);
+        return vec[vector_index(vec, index)];
+    }
+    vm_error("Invalid type for access");
+    return Value(); // will never reach here
+}
+
+// Sets obj[index] for a struct or vector, the field has to exist already
+void update_element(VM* vm, Value &obj, const Value &index, Value value, int cache_index)
+{
+    if (obj.type == Value_Type::STRUCT)
+    {
+        struct_object &struct_ = std::get<struct_object>(obj.data);
+        struct_.fields[find_struct_field_by_key(vm, struct_, index, cache_index)] = value;
+    }
+    else if (obj.type == Value_Type::VECTOR)
+    {
+        std::vector<Value> &vec = std::get<std::vector<Value>>(obj.data);
+        vec[vector_index(vec, index)] = value;
+    }
+    else
+    {
+        vm_error("Invalid type for access");
+    }
+}
+
+// Pushes the field of the struct on top of the stack, the field name is a string constant
+void load_struct_field(VM* vm, int name_index, int cache_index)
+{
+    Value obj = pop(vm);
+    const Value &name = vm->constants[name_index];
+    if (obj.type != Value_Type::STRUCT)
+    {
+        push(vm, access_element(vm, obj, name, cache_index));
+        return;
+    }
+
+    const struct_object &struct_ = std::get<struct_object>(obj.data);
+    push(vm, struct_.fields[find_struct_field(vm, struct_, std::get<std::string>(name.data), cache_index)]);
+}
+// -------------------------------------------------------------------
+
+// Upvalue operations -------------------------------------------------
+
+// Returns the upvalue for a local of the frame, reusing the open upvalue if the local has already been captured
+// so closures that capture the same variable share it
+std::shared_ptr<upvalue> capture_upvalue(VM* vm, function_frame *frame, int slot)
+{
+    Value *location = &frame->locals[slot];
+    for (const std::shared_ptr<upvalue> &open : vm->open_upvalues)
+    {
+        if (open->location == location)
+        {
+            return open;
+        }
+    }
+
+    std::shared_ptr<upvalue> up = std::make_shared<upvalue>();
+    up->location = location;
+    up->frame = frame;
+    up->slot = slot;
+    vm->open_upvalues.push_back(up);
+    vm->gc.upvalues.push_back(up);
+    vm->gc.allocated++;
+    return up;
+}
+
+// Closes the upvalues that point into the frame at the given slot or any slot above it
+// Has to be called before the slots are reused or the frame is deleted
+void close_upvalues(VM* vm, function_frame *frame, int slot)
+{
+    for (int i = (int)vm->open_upvalues.size() - 1; i >= 0; i--)
+    {
+        std::shared_ptr<upvalue> &up = vm->open_upvalues[i];
+        if (up->frame == frame && up->slot >= slot)
+        {
+            up->closed = *up->location;
+            up->location = &up->closed;
+            vm->open_upvalues.erase(vm->open_upvalues.begin() + i);
+        }
+    }
+}
+
+// Creates a closure for func, captures holds the OP_CLOSURE operands after the constant index
+// captures[0] is the number of captured variables, followed by a (kind, index) pair for every variable
+// Collects first when enough closures and upvalues were made, every value in use is on the stack or in a frame then
+Value create_closure(VM* vm, function *func, const CODE_SIZE *captures)
+{
+    if (vm->gc.allocated >= vm->gc.threshold)
+    {
+        gc_collect(vm);
+    }
+    function_frame *frame = get_current_function_frame(vm);
+    std::shared_ptr<closure> cl = new_closure(func);
+    vm->gc.closures.push_back(cl);
+    vm->gc.allocated++;
+    int count = captures[0];
+    for (int i = 0; i < count; i++)
+    {
+        CODE_SIZE kind = captures[1 + i * 2];
+        CODE_SIZE index = captures[2 + i * 2];
+        if (kind == Capture_Kind::CAPTURE_UPVALUE)
         {
-            if (frame->variables[i].find(name) != frame->variables[i].end())
-            {
-                return frame->variables[i][name];
-            }
+            cl->upvalues.push_back(frame->func_closure->upvalues[index]);
         }
+        else
+        {
+            cl->upvalues.push_back(capture_upvalue(vm, frame, index));
+        }
+    }
+    return {Value_Type::FUNCTION, cl};
+}
+
+Value get_upvalue(VM* vm, int index)
+{
+    return *get_current_function_frame(vm)->func_closure->upvalues[index]->location;
+}
+
+void update_upvalue(VM* vm, int index, Value value)
+{
+    *get_current_function_frame(vm)->func_closure->upvalues[index]->location = value;
+}
+
+// Scope and frame operations ------------------------------------------
+
+// Leaving a block only has to close the upvalues that captured the block's variables
+void dec_scope(VM* vm, int first_slot)
+{
+    if (!vm->open_upvalues.empty())
+    {
+        close_upvalues(vm, get_current_function_frame(vm), first_slot);
+    }
+}
+
+// Removes the current function frame, closing any upvalues that point into it
+void pop_function_frame(VM* vm)
+{
+    function_frame *frame = get_current_function_frame(vm);
+    if (!vm->open_upvalues.empty())
+    {
+        close_upvalues(vm, frame, 0);
     }
-    vm_error("get_function_variable: Variable " + name + " not found");
-    return Value(); // To avoid warning, but this line will never be reached because of vm_error
+    delete frame;
+    vm->function_frames.pop_back();
 }
 // -------------------------------------------------------------------
 
@@ -5,7 +5,11 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <memory>
+#include <unordered_map>
 #include "Function.hpp"
+#include "numbers.hpp"
+#include "output.hpp"
 
 
 void display_bytecode(function* func);
@@ -22,17 +26,48 @@ enum Value_Type{
 
 // forward declare Value for the typedef
 struct Value;
+struct closure;
+struct shape;
+
+// Structs store their fields densely, the shape knows which slot holds which field
+// Copying a struct copies its fields, the shape is shared
+struct struct_object {
+    shape* layout;
+    std::vector<Value> fields;
+};
 
 typedef std::variant<
                     double, // NUMBER
                     bool, // BOOL
                     std::string, // STRING
                     std::vector<Value>, // VECTOR
-                    function*,
+                    std::shared_ptr<closure>, // FUNCTION
                     std::nullptr_t, // NULL_VALUE
-                    std::map<std::string, Value> // STRUCT
+                    struct_object // STRUCT
                     > Value_Content;
 
+// Heap memory taken by values, reported by -mem and $vm_stats() (memory.hpp)
+// Every value that is made or copied with a string, vector or struct in it counts the buffer it allocated for it
+// The elements of vectors and structs are values, so they count their own
+// value_memory is nullptr unless the program is measured, then copying a value costs a single branch
+// Code compiled by the clang JIT backend is a separate library, its value_memory is set to the executable's when loaded
+enum Memory_Kind{
+    MEMORY_STRING,
+    MEMORY_VECTOR,
+    MEMORY_STRUCT,
+};
+
+struct memory_counters{
+    uint64_t allocations[3] = {}; // by Memory_Kind
+    uint64_t bytes[3] = {};
+    uint64_t frames = 0; // function frames created
+    uint64_t frame_bytes = 0;
+};
+
+memory_counters* value_memory = nullptr;
+
+void count_value_memory(const Value& value);
+
 struct Value{
     Value_Type type;
     Value_Content data;
@@ -41,15 +76,133 @@ struct Value{
 
     Value(Value_Type t, Value_Content d){
         type = t;
-        data = d;
+        data = std::move(d);
+        if(value_memory != nullptr){
+            count_value_memory(*this);
+        }
     }
 
     Value(const Value& other){
         type = other.type;
         data = other.data; 
+        if(value_memory != nullptr){
+            count_value_memory(*this);
+        }
     }
+
+    // moving takes over the buffers of the other value, nothing is allocated so nothing is counted
+    Value(Value&& other) noexcept{
+        type = other.type;
+        data = std::move(other.data);
+    }
+
+    Value& operator=(const Value& other){
+        type = other.type;
+        data = other.data;
+        if(value_memory != nullptr){
+            count_value_memory(*this);
+        }
+        return *this;
+    }
+
+    Value& operator=(Value&& other) noexcept{
+        type = other.type;
+        data = std::move(other.data);
+        return *this;
+    }
+};
+
+const size_t SHORT_STRING_CAPACITY = std::string().capacity(); // strings up to this length are stored in the string itself
+
+void count_value_memory(const Value& value){
+    if(const std::string* str = std::get_if<std::string>(&value.data)){
+        if(str->capacity() > SHORT_STRING_CAPACITY){
+            value_memory->allocations[MEMORY_STRING]++;
+            value_memory->bytes[MEMORY_STRING] += str->capacity() + 1;
+        }
+    } else if(const std::vector<Value>* vec = std::get_if<std::vector<Value>>(&value.data)){
+        if(vec->capacity() != 0){
+            value_memory->allocations[MEMORY_VECTOR]++;
+            value_memory->bytes[MEMORY_VECTOR] += vec->capacity() * sizeof(Value);
+        }
+    } else if(const struct_object* obj = std::get_if<struct_object>(&value.data)){
+        if(obj->fields.capacity() != 0){
+            value_memory->allocations[MEMORY_STRUCT]++;
+            value_memory->bytes[MEMORY_STRUCT] += obj->fields.capacity() * sizeof(Value);
+        }
+    }
+}
+
+struct function_frame; // Forward declaration, defined in VM.hpp
+
+// A variable captured by a closure
+// While the variable is still alive in its function frame, location points at it
+// Once the block it lives in is left, the value is copied into closed and location points there instead
+struct upvalue {
+    Value* location;
+    Value closed;
+
+    function_frame* frame; // frame and slot the captured variable lives in, used to know when to close the upvalue
+    int slot;
+
+    uint32_t gc_mark = 0; // collection that last found it reachable, gc.hpp
+};
+
+// Function values are closures, the function and the variables it captured from the enclosing functions
+// Function constants are closures without upvalues
+struct closure {
+    function* func;
+    std::vector<std::shared_ptr<upvalue>> upvalues;
+
+    uint32_t gc_mark = 0; // collection that last found it reachable, gc.hpp
+};
+
+std::shared_ptr<closure> new_closure(function* func){
+    std::shared_ptr<closure> cl = std::make_shared<closure>();
+    cl->func = func;
+    return cl;
+}
+
+// Layout shared by every struct whose fields were added in the same order
+// Adding a field follows a transition to the next shape, so structs built the same way end up with the same shape
+// Shapes are created by the VM from its empty shape and are never freed
+struct shape {
+    std::vector<std::string> field_names; // name of the field in every slot
+    std::unordered_map<std::string, int> slots;
+    std::unordered_map<std::string, shape*> transitions;
+    std::vector<int> alphabetical_slots; // structs are printed with their fields in alphabetical order
 };
 
+// returns the slot of the field, -1 if structs with this shape don't have it
+int shape_find_slot(shape* s, const std::string& name){
+    auto it = s->slots.find(name);
+    if(it == s->slots.end()){
+        return -1;
+    }
+    return it->second;
+}
+
+// returns the shape of a struct with shape s after the field is added
+shape* shape_add_field(shape* s, const std::string& name){
+    auto it = s->transitions.find(name);
+    if(it != s->transitions.end()){
+        return it->second;
+    }
+
+    shape* next = new shape(*s);
+    next->transitions.clear();
+    next->slots[name] = next->field_names.size();
+    next->field_names.push_back(name);
+
+    next->alphabetical_slots.clear();
+    for(auto& field : std::map<std::string, int>(next->slots.begin(), next->slots.end())){
+        next->alphabetical_slots.push_back(field.second);
+    }
+
+    s->transitions[name] = next;
+    return next;
+}
+
 Value_Type get_value_type(Value value){
     return value.type;
 }
@@ -115,7 +268,14 @@ double VALUE_AS_NUMBER(Value value){
         case BOOL:
             return std::get<bool>(value.data);
         case STRING:
-            return std::stod(std::get<std::string>(value.data));
+        {
+            double number;
+            if(!parse_number(std::get<std::string>(value.data), number)){
+                std::cout << "ERROR: cannot convert \"" << std::get<std::string>(value.data) << "\" to a number" << std::endl;
+                exit(1);
+            }
+            return number;
+        }
         default:
             return 0; // Should never reach here, but to avoid warnings
     }
@@ -124,19 +284,8 @@ double VALUE_AS_NUMBER(Value value){
 std::string VALUE_AS_STRING(Value value){
     // std::cout << "VALUE AS STRING | Value_Type: " << get_value_type_string(value) << std::endl;
     switch(value.type){
-        case NUMBER: // TODO: Improve this to be faster, this is just a quick fix to remove trailing zeros
-                     // This is because the tests expect the output to not have trailing zeros
-                     // Could use some fancy math things to remove trailing zeros
-        {
-            std::string str = std::to_string(std::get<double>(value.data));
-            if(str.find('.') != std::string::npos){
-                str.erase(str.find_last_not_of('0') + 1, std::string::npos);
-                if(str[str.size() - 1] == '.'){
-                    str.pop_back();
-                }
-            }
-            return str;
-        }
+        case NUMBER:
+            return number_to_string(std::get<double>(value.data));
         case BOOL:
             return std::get<bool>(value.data) ? "true" : "false";
         case STRING:
@@ -161,7 +310,7 @@ std::string VALUE_AS_STRING(Value value){
         }
         case FUNCTION:
         {
-            function* func = std::get<function*>(value.data);
+            function* func = std::get<std::shared_ptr<closure>>(value.data)->func;
             std::string args = "(";
             for(int i = 0; i < (int)func->arguments.size(); i++){
                 args += func->arguments[i];
@@ -173,9 +322,10 @@ std::string VALUE_AS_STRING(Value value){
 
             std::string bc = "";
             for(int i = 0; i < func->count; i++){
-                bc += std::to_string(func->code[i]) + ", ";
+                append_int(bc, func->code[i]);
+                bc += ", ";
             }
-            return "function " + func->name + args + " {" + bc + "}";
+            return "function " + func->name + args + " " + std::to_string(func->local_count) + " {" + bc + "}";
         }
         case NULL_VALUE:
             return "null";
@@ -183,12 +333,12 @@ std::string VALUE_AS_STRING(Value value){
         {
             std::string str = "{";
 
-            std::map<std::string, Value> map = std::get<std::map<std::string, Value>>(value.data);
+            const struct_object& obj = std::get<struct_object>(value.data);
             // prints the keys in alphabetical order
-            // ig thats how c++ stores the keys internally
-            for(auto it = map.begin(); it != map.end(); it++){
-                str += it->first + " = " + VALUE_AS_STRING(it->second);
-                if(it != --map.end()){
+            const std::vector<int>& slots = obj.layout->alphabetical_slots;
+            for(int i = 0; i < (int)slots.size(); i++){
+                str += obj.layout->field_names[slots[i]] + " = " + VALUE_AS_STRING(obj.fields[slots[i]]);
+                if(i != (int)slots.size() - 1){
                     str += ", ";
                 }
             }
@@ -201,6 +351,32 @@ std::string VALUE_AS_STRING(Value value){
     }
 }
 
+// Appends the value as VALUE_AS_STRING shows it, numbers and strings without a temporary string
+void append_value_as_string(std::string &str, const Value &value){
+    if(value.type == Value_Type::NUMBER){
+        append_number(str, std::get<double>(value.data));
+    }
+    else if(value.type == Value_Type::STRING){
+        str += std::get<std::string>(value.data);
+    }
+    else{
+        str += VALUE_AS_STRING(value);
+    }
+}
+
+// a + b when one of them is a string, a string a is taken over and b appended to it
+std::string concat_values(Value a, const Value &b){
+    std::string str;
+    if(a.type == Value_Type::STRING){
+        str = std::move(std::get<std::string>(a.data));
+    }
+    else{
+        append_value_as_string(str, a);
+    }
+    append_value_as_string(str, b);
+    return str;
+}
+
 std::vector<Value> VALUE_AS_VECTOR(Value value){
     switch(value.type){
         case VECTOR:
@@ -210,9 +386,9 @@ std::vector<Value> VALUE_AS_VECTOR(Value value){
     }
 }
 
-function* VALUE_AS_FUNCTION(Value value){
+std::shared_ptr<closure> VALUE_AS_CLOSURE(Value value){
     if(value.type == Value_Type::FUNCTION){
-        return std::get<function*>(value.data);
+        return std::get<std::shared_ptr<closure>>(value.data);
     }
 
     std::cout << "ERROR: casting non function to function" << std::endl;
@@ -220,10 +396,14 @@ function* VALUE_AS_FUNCTION(Value value){
     return nullptr; // will never reach here
 }
 
-std::map<std::string, Value> VALUE_AS_STRUCT(Value value){
+function* VALUE_AS_FUNCTION(Value value){
+    return VALUE_AS_CLOSURE(value)->func;
+}
+
+struct_object VALUE_AS_STRUCT(Value value){
     switch(value.type){
         case STRUCT:
-            return std::get<std::map<std::string, Value>>(value.data);
+            return std::get<struct_object>(value.data);
         default:
             return {}; // Should never reach here, but to avoid warnings
     }
@@ -238,7 +418,15 @@ void print_value(Value value, bool verbose = false){
         display_bytecode(VALUE_AS_FUNCTION(value));
         return;
     }
-    std::cout << VALUE_AS_STRING(value);
+    if(value.type == Value_Type::NUMBER){
+        output_number(std::get<double>(value.data));
+    }
+    else if(value.type == Value_Type::STRING){
+        output_write(std::get<std::string>(value.data));
+    }
+    else{
+        output_write(VALUE_AS_STRING(value));
+    }
 }
 
 #endif // VALUE_HPP
\ No newline at end of file
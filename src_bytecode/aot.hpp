@@ -0,0 +1,119 @@
+#ifndef AOT_HPP
+#define AOT_HPP
+
+// Ahead of time compilation, selected with -aot=<output>
+// Every function of a .cl_exe, main included, is turned into C++ by the clang backend (clang_jit_source) and compiled
+// once into a native executable, or into a shared object with lii_aot_main when the output ends with .so
+// The .cl_exe is embedded in the output for the constants and the names, nothing is interpreted or compiled when it runs
+// There is no feedback when the program is compiled, so the code isn't specialized for types or call targets
+// The generated C++ is kept in jit_functions/aot_<output name>.cpp, it includes the VM headers relative to the working directory
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "VM.hpp"
+#include "Value.hpp"
+#include "cl_exe_file.hpp"
+#include "bytecode_generator.hpp" // display_bytecode, which printing a function needs, the compiled program links nothing else
+#include "virtual_machine.hpp"
+#include "jit.hpp"
+
+// Gives every function of the program its compiled code, in the order of the function constants with main last
+// Called by the compiled program before it runs jit_<index of main>
+void aot_link(VM* vm, cl_exe* exe, const std::vector<JIT_FUNCTION> &compiled)
+{
+    vm->jit_functions = compiled;
+    int index = 0;
+    for (Value &constant : vm->constants)
+    {
+        if (constant.type == Value_Type::FUNCTION)
+        {
+            function* func = VALUE_AS_CLOSURE(constant)->func;
+            func->jit_index = index++;
+            func->tier = 2;
+        }
+    }
+    exe->main->jit_index = index;
+}
+
+// Compiles the .cl_exe at exe_path into output, returns false when clang failed
+bool aot_compile(const std::string &exe_path, const std::string &output, const jit_tiering &tiering)
+{
+    std::ifstream file(exe_path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    if (contents.str().find(")lii_aot\"") != std::string::npos)
+    {
+        vm_error("AOT: the program can't be embedded in C++");
+    }
+
+    cl_exe* exe = read_cl_exe(exe_path);
+    init_vm(exe, false, Jit_Backend::JIT_BACKEND_CLANG, tiering);
+    vm.source_path = cl_source_path(exe_path);
+
+    // the functions are named after the index aot_link gives them
+    std::vector<function*> funcs;
+    for (Value &constant : vm.constants)
+    {
+        if (constant.type == Value_Type::FUNCTION)
+        {
+            funcs.push_back(VALUE_AS_CLOSURE(constant)->func);
+        }
+    }
+    funcs.push_back(exe->main);
+
+    std::string declarations;
+    std::string definitions;
+    std::string compiled;
+    for (int i = 0; i < (int)funcs.size(); i++)
+    {
+        std::string name = "jit_" + std::to_string(i);
+        declarations += "extern \"C\" void " + name + "(VM* vm);\n";
+        definitions += clang_jit_source(&vm, funcs[i], whole_function_region(funcs[i]), i);
+        compiled += name + ", ";
+    }
+
+    std::string program = CLANG_JIT_INCLUDES + "#include \"src_bytecode/aot.hpp\"\n" + declarations + definitions;
+    program += "\nconst char* LII_AOT_PROGRAM = R\"lii_aot(" + contents.str() + ")lii_aot\";\n";
+    program += R"(
+extern "C" int lii_aot_main()
+{
+    directory_path = R"lii_aot()" + directory_path + R"()lii_aot";
+    std::istringstream program(LII_AOT_PROGRAM);
+    cl_exe* exe = read_cl_exe(program);
+    if(program_calls_std_lib(exe, "vm_stats")){memory_start();}
+    init_vm(exe, false);
+    aot_link(&vm, exe, {)" + compiled + R"(});
+    jit_)" + std::to_string(funcs.size() - 1) + R"((&vm);
+    delete exe;
+    return 0;
+}
+
+#ifndef LII_AOT_SHARED
+int main()
+{
+    return lii_aot_main();
+}
+#endif
+)";
+
+    std::string name = output.substr(output.find_last_of("/") + 1);
+    std::string source = "./jit_functions/aot_" + name + ".cpp";
+    mkdir("./jit_functions", 0755); // fails when it already exists
+    std::ofstream out(source);
+    out << program;
+    out.close();
+    delete exe;
+
+    bool shared = output.size() > 3 && output.substr(output.size() - 3) == ".so";
+    std::string command = "clang++-16 ";
+    command += tiering.optimization_level;
+    command += " -I.";
+    command += shared ? " -shared -fPIC -DLII_AOT_SHARED" : "";
+    command += " -o " + output + " " + source;
+    return system(command.c_str()) == 0;
+}
+
+#endif // AOT_HPP
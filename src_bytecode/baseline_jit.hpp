@@ -0,0 +1,254 @@
+#ifndef BASELINE_JIT_HPP
+#define BASELINE_JIT_HPP
+
+// Copy and patch baseline JIT, selected with -jit=baseline
+// Needs no compiler at runtime: every instruction is compiled by copying a prebuilt machine code stencil into executable
+// memory and patching its holes with the operands, the addresses of the runtime functions and the jump targets
+// Compiling is a single pass over the bytecode, so it's near instant, and the compiled code has no dispatch loop
+// It is also the quick tier when -jit uses another backend
+// The stencils are x86-64 System V, on other targets functions are not compiled and keep running in the interpreter
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <sys/mman.h>
+
+#include "VM.hpp"
+#include "opcodes.hpp"
+#include "virtual_machine.hpp"
+#include "jit.hpp"
+#include "jit_runtime.hpp"
+
+// A piece of machine code with holes that are filled in when it is copied
+struct stencil
+{
+    std::vector<uint8_t> code;
+    int function_hole = -1; // 64 bit address of the runtime function that is called
+    int operand_hole = -1;  // 32 bit operand, passed as the second argument
+    int pointer_hole = -1;  // 64 bit pointer, passed as the second argument
+    int jump_hole = -1;     // 32 bit offset of the jump target, relative to the end of the hole
+};
+
+#if defined(__x86_64__)
+#define BASELINE_JIT_SUPPORTED 1
+
+// The compiled function keeps the VM pointer in rbx, pushing rbx also aligns the stack for the calls
+const stencil PROLOGUE_STENCIL = {{
+    0x53,             // push rbx
+    0x48, 0x89, 0xfb, // mov rbx, rdi
+}};
+
+// function(vm, operand)
+const stencil CALL_OPERAND_STENCIL = {{
+    0x48, 0x89, 0xdf,                                           // mov rdi, rbx
+    0xbe, 0, 0, 0, 0,                                           // mov esi, operand
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,                         // movabs rax, function
+    0xff, 0xd0,                                                 // call rax
+}, 10, 4};
+
+// function(vm, pointer)
+const stencil CALL_POINTER_STENCIL = {{
+    0x48, 0x89, 0xdf,                                           // mov rdi, rbx
+    0x48, 0xbe, 0, 0, 0, 0, 0, 0, 0, 0,                         // movabs rsi, pointer
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,                         // movabs rax, function
+    0xff, 0xd0,                                                 // call rax
+}, 15, -1, 5};
+
+// if (!function(vm)) goto target
+const stencil JUMP_IF_FALSE_STENCIL = {{
+    0x48, 0x89, 0xdf,                                           // mov rdi, rbx
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,                         // movabs rax, function
+    0xff, 0xd0,                                                 // call rax
+    0x84, 0xc0,                                                 // test al, al
+    0x0f, 0x84, 0, 0, 0, 0,                                     // jz target
+}, 5, -1, -1, 19};
+
+// goto target
+const stencil JUMP_STENCIL = {{
+    0xe9, 0, 0, 0, 0, // jmp target
+}, -1, -1, -1, 1};
+
+// function(vm, operand); return
+const stencil EXIT_STENCIL = {{
+    0x48, 0x89, 0xdf,                                           // mov rdi, rbx
+    0xbe, 0, 0, 0, 0,                                           // mov esi, operand
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,                         // movabs rax, function
+    0xff, 0xd0,                                                 // call rax
+    0x5b,                                                       // pop rbx
+    0xc3,                                                       // ret
+}, 10, 4};
+
+// function(vm); return
+const stencil RETURN_STENCIL = {{
+    0x48, 0x89, 0xdf,                                           // mov rdi, rbx
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,                         // movabs rax, function
+    0xff, 0xd0,                                                 // call rax
+    0x5b,                                                       // pop rbx
+    0xc3,                                                       // ret
+}, 5};
+#else
+#define BASELINE_JIT_SUPPORTED 0
+#endif
+
+// Runtime function for the instructions with one operand that have their own
+void* baseline_operand_function(CODE_SIZE op)
+{
+    switch (op)
+    {
+    case OpCode::OP_LOAD:
+        return (void*)&lii_rt_load_constant;
+    case OpCode::OP_LOAD_VAR:
+        return (void*)&lii_rt_load_var;
+    case OpCode::OP_STORE_VAR:
+        return (void*)&lii_rt_store_var;
+    case OpCode::OP_LOAD_GLOBAL:
+        return (void*)&lii_rt_load_global;
+    case OpCode::OP_STORE_GLOBAL:
+        return (void*)&lii_rt_store_global;
+    case OpCode::OP_LOAD_UPVALUE:
+        return (void*)&lii_rt_load_upvalue;
+    case OpCode::OP_UPDATE_UPVALUE:
+        return (void*)&lii_rt_update_upvalue;
+    case OpCode::OP_APPEND_VAR:
+        return (void*)&lii_rt_append_var;
+    case OpCode::OP_APPEND_GLOBAL:
+        return (void*)&lii_rt_append_global;
+    case OpCode::OP_DEC_SCOPE:
+        return (void*)&lii_rt_dec_scope;
+    default:
+        return nullptr;
+    }
+}
+
+// Machine code of a function while it is being compiled
+struct baseline_code
+{
+    std::vector<uint8_t> code;
+    std::vector<std::pair<int, int>> jumps; // (offset of the jump hole, index of the target instruction)
+};
+
+// Copies the stencil to the end of the code and fills in its holes, returns the offset of the jump hole
+int copy_stencil(baseline_code &out, const stencil &st, void* function = nullptr, int32_t operand = 0, void* pointer = nullptr)
+{
+    int start = out.code.size();
+    out.code.insert(out.code.end(), st.code.begin(), st.code.end());
+
+    uint8_t* code = out.code.data() + start;
+    if (st.function_hole != -1)
+    {
+        std::memcpy(code + st.function_hole, &function, sizeof(function));
+    }
+    if (st.operand_hole != -1)
+    {
+        std::memcpy(code + st.operand_hole, &operand, sizeof(operand));
+    }
+    if (st.pointer_hole != -1)
+    {
+        std::memcpy(code + st.pointer_hole, &pointer, sizeof(pointer));
+    }
+    return st.jump_hole == -1 ? -1 : start + st.jump_hole;
+}
+
+int baseline_jit_compile(VM* vm, function* func, const jit_region &region)
+{
+#if BASELINE_JIT_SUPPORTED
+    baseline_code out;
+    std::vector<int> offsets(func->count + 1, -1); // offset of the machine code of every instruction
+
+    copy_stencil(out, PROLOGUE_STENCIL);
+    for (int i = region.start; i < region.end; i += instruction_size(&func->code[i]))
+    {
+        offsets[i] = out.code.size();
+        CODE_SIZE op = func->code[i];
+        switch (op)
+        {
+        case OpCode::OP_JUMP:
+            if (func->code[i + 1] < i)
+            {
+                // backward jump, count the loop iteration so the function can move up to the optimizing tier
+                copy_stencil(out, CALL_POINTER_STENCIL, (void*)&lii_rt_back_edge, 0, func);
+            }
+            // jump targets are stored as the index before the target, because the interpreter increases the ip after the jump
+            out.jumps.push_back({copy_stencil(out, JUMP_STENCIL), func->code[i + 1] + 1});
+            break;
+        case OpCode::OP_JUMP_IF_FALSE:
+            out.jumps.push_back({copy_stencil(out, JUMP_IF_FALSE_STENCIL, (void*)&lii_rt_pop_condition), func->code[i + 1] + 1});
+            break;
+        case OpCode::OP_RETURN:
+            if (region.osr)
+            {
+                copy_stencil(out, EXIT_STENCIL, (void*)&lii_rt_osr_exit, i); // the interpreter returns from the function
+                break;
+            }
+            copy_stencil(out, RETURN_STENCIL, (void*)&lii_rt_return);
+            break;
+        case OpCode::OP_FUNCTION_CALL:
+            copy_stencil(out, CALL_OPERAND_STENCIL, (void*)&lii_rt_call_site, i);
+            break;
+        default:
+            if (baseline_operand_function(op) != nullptr)
+            {
+                copy_stencil(out, CALL_OPERAND_STENCIL, baseline_operand_function(op), func->code[i + 1]);
+            }
+            else
+            {
+                copy_stencil(out, CALL_POINTER_STENCIL, (void*)&lii_rt_execute, 0, &func->code[i]);
+            }
+            break;
+        }
+    }
+    if (region.osr)
+    {
+        // every jump out of the loop gets an exit that hands the frame back to the interpreter at the jump target
+        for (const std::pair<int, int> &jump : out.jumps)
+        {
+            if (!jit_region_contains(region, jump.second) && jump.second >= 0 && jump.second <= func->count && offsets[jump.second] == -1)
+            {
+                offsets[jump.second] = out.code.size();
+                copy_stencil(out, EXIT_STENCIL, (void*)&lii_rt_osr_exit, jump.second);
+            }
+        }
+        if (offsets[region.end] == -1)
+        {
+            offsets[region.end] = out.code.size();
+            copy_stencil(out, EXIT_STENCIL, (void*)&lii_rt_osr_exit, region.end);
+        }
+    }
+    else
+    {
+        offsets[func->count] = out.code.size();
+        copy_stencil(out, RETURN_STENCIL, (void*)&lii_rt_end_of_function);
+    }
+
+    // patch the jumps now that the offset of every instruction is known
+    for (const std::pair<int, int> &jump : out.jumps)
+    {
+        if (jump.second < 0 || jump.second > func->count || offsets[jump.second] == -1)
+        {
+            vm_error("Invalid jump index " + std::to_string(jump.second - 1));
+        }
+        int32_t relative = offsets[jump.second] - (jump.first + 4);
+        std::memcpy(out.code.data() + jump.first, &relative, sizeof(relative));
+    }
+
+    // copy the code into executable memory
+    void* memory = mmap(nullptr, out.code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        vm_error("Baseline JIT: unable to allocate memory for function " + func->name);
+    }
+    std::memcpy(memory, out.code.data(), out.code.size());
+    if (mprotect(memory, out.code.size(), PROT_READ | PROT_EXEC) != 0)
+    {
+        vm_error("Baseline JIT: unable to make the code of function " + func->name + " executable");
+    }
+
+    jit_add_function(vm, (JIT_FUNCTION)memory);
+    jit_perf_map_add(vm, memory, out.code.size(), jit_code_name(func, region) + "[baseline]");
+    return vm->jit_functions.size() - 1;
+#else
+    return -1;
+#endif
+}
+
+#endif // BASELINE_JIT_HPP
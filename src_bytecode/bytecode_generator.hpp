@@ -1,6 +1,7 @@
 #ifndef BYTECODE_GENERATOR_HPP
 #define BYTECODE_GENERATOR_HPP
 
+#include <algorithm> // std::max
 #include <cstdint> // int8_t
 #include <limits>  // std::numeric_limits
 #include <iostream>
@@ -42,6 +43,13 @@ std::vector<Value> constants; // Statically allocated because only one constants
 
 std::vector<std::string> variable_names; // Statically allocated because only one variable names array is needed
                                          // This array stores the names of the variables, functions are included in this array
+
+std::vector<std::string> global_names; // Names of the globals, the index of a name is the index of the global in the VM globals table
+
+// Number of arguments of every function call, by function and instruction index of the call, for -stats
+std::map<std::pair<function*, int>, int> call_arguments;
+
+int inline_cache_count = 0; // Number of struct access sites, every site gets its own inline cache in the VM
 // -------------------------------------------------------------------
 
 // Visual Representation for debugging -------------------------------
@@ -114,31 +122,53 @@ void display_bytecode(function *func)
         case OpCode::OP_STORE_VAR:
             std::cout << "OP_STORE_VAR";
             std::cout << "          ";
-            std::cout << "Index: " << (int)func->code[++i];
+            std::cout << "Slot: " << (int)func->code[++i] << std::endl;
+            break;
+        case OpCode::OP_LOAD_VAR:
+            std::cout << "OP_LOAD_VAR";
             std::cout << "          ";
-            std::cout << "Name: " << variable_names[(int)func->code[i]] << std::endl;
+            std::cout << "Slot: " << (int)func->code[++i] << std::endl;
             break;
-        case OpCode::OP_UPDATE_VAR:
-            std::cout << "OP_UPDATE_VAR";
+        case OpCode::OP_LOAD_GLOBAL:
+            std::cout << "OP_LOAD_GLOBAL";
             std::cout << "          ";
             std::cout << "Index: " << (int)func->code[++i];
             std::cout << "          ";
-            std::cout << "Name: " << variable_names[(int)func->code[i]] << std::endl;
+            std::cout << "Name: " << global_names[(int)func->code[i]] << std::endl;
             break;
-        case OpCode::OP_LOAD_VAR:
-            std::cout << "OP_LOAD_VAR";
+        case OpCode::OP_STORE_GLOBAL:
+            std::cout << "OP_STORE_GLOBAL";
             std::cout << "          ";
             std::cout << "Index: " << (int)func->code[++i];
             std::cout << "          ";
-            std::cout << "Name: " << variable_names[(int)func->code[i]] << std::endl;
+            std::cout << "Name: " << global_names[(int)func->code[i]] << std::endl;
+            break;
+        case OpCode::OP_LOAD_UPVALUE:
+            std::cout << "OP_LOAD_UPVALUE";
+            std::cout << "          ";
+            std::cout << "Upvalue: " << (int)func->code[++i] << std::endl;
             break;
-        case OpCode::OP_LOAD_FUNCTION_VAR:
-            std::cout << "OP_LOAD_FUNCTION_VAR";
+        case OpCode::OP_UPDATE_UPVALUE:
+            std::cout << "OP_UPDATE_UPVALUE";
+            std::cout << "          ";
+            std::cout << "Upvalue: " << (int)func->code[++i] << std::endl;
+            break;
+        case OpCode::OP_CLOSURE:
+        {
+            std::cout << "OP_CLOSURE";
             std::cout << "          ";
             std::cout << "Index: " << (int)func->code[++i];
+            int capture_count = func->code[++i];
             std::cout << "          ";
-            std::cout << "Name: " << variable_names[(int)func->code[i]] << std::endl;
+            std::cout << "Captures: " << capture_count << std::endl;
+            for (int j = 0; j < capture_count; j++)
+            {
+                int kind = func->code[++i];
+                int index = func->code[++i];
+                std::cout << "        " << (kind == Capture_Kind::CAPTURE_UPVALUE ? "Upvalue: " + std::to_string(index) : "Slot: " + std::to_string(index)) << std::endl;
+            }
             break;
+        }
 
         // Arrays
         case OpCode::OP_CREATE_VECTOR:
@@ -156,7 +186,7 @@ void display_bytecode(function *func)
         case OpCode::OP_UPDATE_VECTOR_ELEMENT:
             std::cout << "OP_UPDATE_VECTOR_ELEMENT";
             std::cout << "          ";
-            std::cout << "Vector Name: " << variable_names[(int)func->code[++i]];
+            std::cout << "Vector Slot: " << (int)func->code[++i];
             std::cout << std::endl;
             break;
 
@@ -164,30 +194,34 @@ void display_bytecode(function *func)
         case OpCode::OP_CREATE_STRUCT:
             std::cout << "OP_CREATE_STRUCT" << std::endl;
             break;
-        // case OpCode::OP_LOAD_STRUCT_ELEMENT:
-        //     std::cout << "OP_LOAD_STRUCT_ELEMENT";
-        //     std::cout << "          ";
-        //     std::cout << "Struct Name: " << variable_names[(int)func->code[++i]];
-        //     std::cout << "          ";
-        //     std::cout << "Element Name: " << variable_names[(int)func->code[++i]];
-        //     std::cout << std::endl;
-        //     break;
         case OpCode::OP_UPDATE_STRUCT_ELEMENT:
             std::cout << "OP_UPDATE_STRUCT_ELEMENT";
             std::cout << "          ";
-            std::cout << "Struct Name: " << variable_names[(int)func->code[++i]];
-            std::cout << "          ";
             std::cout << "Element Name: " << variable_names[(int)func->code[++i]];
-            std::cout << std::endl;
+            std::cout << "          ";
+            std::cout << "Cache: " << (int)func->code[++i] << std::endl;
+            break;
+        case OpCode::OP_LOAD_STRUCT_ELEMENT:
+            std::cout << "OP_LOAD_STRUCT_ELEMENT";
+            std::cout << "          ";
+            std::cout << "Element Name: " << VALUE_AS_STRING(constants[(int)func->code[++i]]);
+            std::cout << "          ";
+            std::cout << "Cache: " << (int)func->code[++i] << std::endl;
             break;
         case OpCode::OP_ACCESS:
-            std::cout << "OP_ACCESS" << std::endl;
+            std::cout << "OP_ACCESS";
+            std::cout << "          ";
+            std::cout << "Cache: " << (int)func->code[++i] << std::endl;
             break;
         case OpCode::OP_ACCESS_FOR_UPDATE:
-            std::cout << "OP_ACCESS_FOR_UPDATE" << std::endl;
+            std::cout << "OP_ACCESS_FOR_UPDATE";
+            std::cout << "          ";
+            std::cout << "Cache: " << (int)func->code[++i] << std::endl;
             break;
         case OpCode::OP_UPDATE_STACK_ELEMENT:
-            std::cout << "OP_UPDATE_STACK_ELEMENT" << std::endl;
+            std::cout << "OP_UPDATE_STACK_ELEMENT";
+            std::cout << "          ";
+            std::cout << "Cache: " << (int)func->code[++i] << std::endl;
             break;
 
         // Control flow
@@ -206,11 +240,10 @@ void display_bytecode(function *func)
             break;
 
         // Scope
-        case OpCode::OP_INC_SCOPE:
-            std::cout << "OP_INC_SCOPE" << std::endl;
-            break;
         case OpCode::OP_DEC_SCOPE:
-            std::cout << "OP_DEC_SCOPE" << std::endl;
+            std::cout << "OP_DEC_SCOPE";
+            std::cout << "          ";
+            std::cout << "First Slot: " << (int)func->code[++i] << std::endl;
             break;
 
         // Output
@@ -227,6 +260,18 @@ void display_bytecode(function *func)
             std::cout << "Name: " << STD_LIB_FUNCTIONS_DEFINITIONS[(int)func->code[i]].name << std::endl;
             break;
 
+        // Strings
+        case OpCode::OP_APPEND_VAR:
+            std::cout << "OP_APPEND_VAR";
+            std::cout << "          ";
+            std::cout << "Slot: " << (int)func->code[++i] << std::endl;
+            break;
+        case OpCode::OP_APPEND_GLOBAL:
+            std::cout << "OP_APPEND_GLOBAL";
+            std::cout << "          ";
+            std::cout << "Index: " << (int)func->code[++i] << std::endl;
+            break;
+
         default:
             std::cout << "Unknown opcode" << std::endl;
             break;
@@ -252,11 +297,22 @@ void display_variables()
         std::cout << i << ": " << variable_names[i] << std::endl;
     }
 }
+
+void display_globals()
+{
+    for (int i = 0; i < (int)global_names.size(); i++)
+    {
+        std::cout << i << ": " << global_names[i] << std::endl;
+    }
+}
 // -------------------------------------------------------------------
 
 // Helper functions --------------------------------------------------
+int generating_line = 0; // source line of the statement being generated
+
 inline void WRITE_BYTE(CODE_SIZE byte, function *func)
 {
+    func->lines.push_back(generating_line);
     func->code[func->count++] = byte;
 }
 
@@ -292,7 +348,7 @@ inline void WRITE_VALUE(const std::string &value)
 
 inline void WRITE_VALUE(function *value)
 {
-    constants.push_back({Value_Type::FUNCTION, value});
+    constants.push_back({Value_Type::FUNCTION, new_closure(value)});
 }
 
 inline void WRITE_VALUE(Value value)
@@ -330,6 +386,25 @@ std::string get_variable_name(int index)
     return variable_names[index];
 }
 
+// Every struct access site gets its own inline cache, written as the operand after the opcode
+inline void WRITE_INLINE_CACHE(function *func)
+{
+    WRITE_BYTE(inline_cache_count++, func);
+}
+
+int get_global_index(const std::string &name)
+{ // returns the index of the global in the global names array, adds the global if it isn't there yet
+    for (int i = 0; i < (int)global_names.size(); i++)
+    {
+        if (global_names[i] == name)
+        {
+            return i;
+        }
+    }
+    global_names.push_back(name);
+    return global_names.size() - 1;
+}
+
 // Constructor for the function struct
 function *create_function(int capacity, function *parent = nullptr)
 {
@@ -347,6 +422,244 @@ inline Value get_constant(int index)
 }
 // -------------------------------------------------------------------
 
+// Name resolution ---------------------------------------------------
+// Variables are resolved lexically while generating the bytecode
+// A name is a local of the function being generated, a variable captured from an enclosing function (upvalue),
+// or a global, which is a variable in the outermost scope of the main function
+
+struct local_variable
+{
+    std::string name;
+    int depth;             // scope depth the variable was declared in
+    int slot;              // slot of the variable in the function frame
+    bool captured = false; // true once a closure captures the variable
+};
+
+struct upvalue_info
+{
+    CODE_SIZE kind;  // Capture_Kind
+    CODE_SIZE index; // index of the upvalue in the enclosing closure, or slot of the variable in the enclosing function
+};
+
+// Generation state of a function, one for every function that is currently being generated
+struct function_state
+{
+    function *func;
+    function_state *enclosing; // nullptr for the main function
+
+    std::vector<local_variable> locals; // locals that are in scope, the slot of a local is its index
+    std::vector<upvalue_info> upvalues;
+    int depth = 0;
+
+    // one entry per open block, true if the block or a block inside it has to close upvalues when it is left
+    std::vector<bool> scope_closes_upvalues;
+};
+
+function_state *current_function_state = nullptr;
+
+enum Variable_Location
+{
+    LOCAL_VARIABLE,
+    UPVALUE_VARIABLE,
+    GLOBAL_VARIABLE,
+};
+
+struct resolved_variable
+{
+    Variable_Location location;
+    int index; // slot of the variable for locals, index of the upvalue for upvalues, index of the global for globals
+};
+
+// true if a variable declared now is a global
+bool is_global_scope()
+{
+    return current_function_state->enclosing == nullptr && current_function_state->depth == 0;
+}
+
+// Declares a local in the current scope and returns its slot
+// Declaring a name again in the same scope reuses the slot of the first declaration
+int declare_variable(const std::string &name)
+{
+    std::vector<local_variable> &locals = current_function_state->locals;
+    for (int i = (int)locals.size() - 1; i >= 0 && locals[i].depth == current_function_state->depth; i--)
+    {
+        if (locals[i].name == name)
+        {
+            return locals[i].slot;
+        }
+    }
+
+    int slot = locals.size();
+    locals.push_back({name, current_function_state->depth, slot});
+
+    function *func = current_function_state->func;
+    func->local_count = std::max(func->local_count, (int)locals.size());
+    return slot;
+}
+
+// returns the local with the given name, searching from the innermost scope out, nullptr if there isn't one
+local_variable *find_local(function_state *state, const std::string &name)
+{
+    for (int i = (int)state->locals.size() - 1; i >= 0; i--)
+    {
+        if (state->locals[i].name == name)
+        {
+            return &state->locals[i];
+        }
+    }
+    return nullptr;
+}
+
+int add_upvalue(function_state *state, CODE_SIZE kind, CODE_SIZE index)
+{
+    for (int i = 0; i < (int)state->upvalues.size(); i++)
+    {
+        if (state->upvalues[i].kind == kind && state->upvalues[i].index == index)
+        {
+            return i;
+        }
+    }
+    state->upvalues.push_back({kind, index});
+    return state->upvalues.size() - 1;
+}
+
+// returns the index of the upvalue for name in state, -1 if name is not a variable of an enclosing function
+int resolve_upvalue(function_state *state, const std::string &name)
+{
+    function_state *enclosing = state->enclosing;
+    if (enclosing == nullptr)
+    {
+        return -1;
+    }
+
+    local_variable *local = find_local(enclosing, name);
+    if (local != nullptr)
+    {
+        local->captured = true;
+        return add_upvalue(state, Capture_Kind::CAPTURE_LOCAL, local->slot);
+    }
+
+    int index = resolve_upvalue(enclosing, name);
+    if (index != -1)
+    {
+        return add_upvalue(state, Capture_Kind::CAPTURE_UPVALUE, index);
+    }
+    return -1;
+}
+
+resolved_variable resolve_variable(const std::string &name)
+{
+    local_variable *local = find_local(current_function_state, name);
+    if (local != nullptr)
+    {
+        return {Variable_Location::LOCAL_VARIABLE, local->slot};
+    }
+
+    int upvalue_index = resolve_upvalue(current_function_state, name);
+    if (upvalue_index != -1)
+    {
+        return {Variable_Location::UPVALUE_VARIABLE, upvalue_index};
+    }
+
+    // Globals aren't locals of the main function, names that aren't declared anywhere are also globals, they may be declared later
+    // Reading a global before it has been assigned is a runtime error
+    return {Variable_Location::GLOBAL_VARIABLE, get_global_index(name)};
+}
+
+// Writes the bytecode to push the variable onto the stack
+void WRITE_LOAD_VARIABLE(const std::string &name, function *func)
+{
+    resolved_variable var = resolve_variable(name);
+    switch (var.location)
+    {
+    case Variable_Location::LOCAL_VARIABLE:
+        WRITE_BYTE(OpCode::OP_LOAD_VAR, func);
+        break;
+    case Variable_Location::UPVALUE_VARIABLE:
+        WRITE_BYTE(OpCode::OP_LOAD_UPVALUE, func);
+        break;
+    case Variable_Location::GLOBAL_VARIABLE:
+        WRITE_BYTE(OpCode::OP_LOAD_GLOBAL, func);
+        break;
+    }
+    WRITE_BYTE(var.index, func);
+}
+
+// Writes the bytecode to update the variable with the value on the stack
+void WRITE_UPDATE_VARIABLE(const std::string &name, function *func)
+{
+    resolved_variable var = resolve_variable(name);
+    switch (var.location)
+    {
+    case Variable_Location::LOCAL_VARIABLE:
+        WRITE_BYTE(OpCode::OP_STORE_VAR, func);
+        break;
+    case Variable_Location::UPVALUE_VARIABLE:
+        WRITE_BYTE(OpCode::OP_UPDATE_UPVALUE, func);
+        break;
+    case Variable_Location::GLOBAL_VARIABLE:
+        WRITE_BYTE(OpCode::OP_STORE_GLOBAL, func);
+        break;
+    }
+    WRITE_BYTE(var.index, func);
+}
+
+// Writes the bytecode to store the value on the stack in a newly declared variable
+// The variable is declared after its value is generated, so let x = x + 1; still reads the outer x
+void WRITE_STORE_VARIABLE(const std::string &name, function *func)
+{
+    WRITE_VAR_NAME_IF_NOT_EXISTS(name);
+    if (is_global_scope())
+    {
+        WRITE_BYTE(OpCode::OP_STORE_GLOBAL, func);
+        WRITE_BYTE(get_global_index(name), func);
+    }
+    else
+    {
+        WRITE_BYTE(OpCode::OP_STORE_VAR, func);
+        WRITE_BYTE(declare_variable(name), func);
+    }
+}
+
+// Blocks only exist at compile time, a block's variables get the slots after the variables that are in scope
+// and the slots are reused by the next block once the block ends
+// The body of a for loop is a block that ends on every iteration, its slots are reused by the next iteration, so the
+// upvalues of the slots are closed at the end of the body, where continue jumps to as well
+void begin_scope(function *func)
+{
+    current_function_state->depth++;
+    current_function_state->scope_closes_upvalues.push_back(false);
+}
+
+void end_scope(function *func)
+{
+    function_state *state = current_function_state;
+    state->depth--;
+
+    bool closes_upvalues = state->scope_closes_upvalues.back();
+    state->scope_closes_upvalues.pop_back();
+
+    int first_slot = state->locals.size();
+    while (!state->locals.empty() && state->locals.back().depth > state->depth)
+    {
+        closes_upvalues = closes_upvalues || state->locals.back().captured;
+        first_slot = state->locals.back().slot;
+        state->locals.pop_back();
+    }
+
+    // break and continue can jump over the end of an inner block, so the enclosing blocks close the upvalues too
+    if (closes_upvalues)
+    {
+        WRITE_BYTE(OpCode::OP_DEC_SCOPE, func);
+        WRITE_BYTE(first_slot, func);
+        if (!state->scope_closes_upvalues.empty())
+        {
+            state->scope_closes_upvalues.back() = true;
+        }
+    }
+}
+// -------------------------------------------------------------------
+
 // Interpretation ----------------------------------------------------
 void interpret(Node *node, function *func);
 void interpret_stmt_list(Node *node, function *func);
@@ -392,14 +705,14 @@ void interpret_function_call(Node *node, function *func)
     }
 
     // Push the function onto the stack
-    WRITE_BYTE(OpCode::OP_LOAD_FUNCTION_VAR, func);
     if (get_variable_index(name) == -1)
     {
         interpretation_error("Function not found", node, func);
     }
-    WRITE_BYTE(get_variable_index(name), func);
+    WRITE_LOAD_VARIABLE(name, func);
 
     // call the function
+    call_arguments[{func, func->count}] = arg_list->get_children().size();
     WRITE_BYTE(OpCode::OP_FUNCTION_CALL, func);
 }
 
@@ -441,10 +754,14 @@ void choose_expr_operand(Node *node, function *func)
         interpret_op(node, func);
         break;
     case NodeType::NUM_NODE:
-        WRITE_VALUE(std::stod(opStr));
+    {
+        double number = 0;
+        parse_number(opStr, number);
+        WRITE_VALUE(number);
         WRITE_BYTE(OpCode::OP_LOAD, func);
         WRITE_BYTE(constants.size() - 1, func);
         break;
+    }
     case NodeType::BOOL_NODE:
         WRITE_VALUE(opStr == "true"); // Convert the string to a bool
         WRITE_BYTE(OpCode::OP_LOAD, func);
@@ -453,12 +770,11 @@ void choose_expr_operand(Node *node, function *func)
     case NodeType::VAR_NODE:
         if (node->get_children().size() == 0)
         { // Variable access
-            WRITE_BYTE(OpCode::OP_LOAD_VAR, func);
             if (get_variable_index(opStr) == -1)
             {
                 interpretation_error("Variable not found", node, func);
             }
-            WRITE_BYTE(get_variable_index(node->get_value()), func);
+            WRITE_LOAD_VARIABLE(opStr, func);
         }
         // else if(node->get_children().size() == 1){ // Vector access or struct access
         //     Node* child = node->get_child(0);
@@ -546,6 +862,14 @@ void interpret_op(Node *node, function *func)
             choose_expr_operand(l_child, func);
 
             Node *r_child = node->get_child(1);
+            if (r_child->get_type() == NodeType::EXPR_NODE && r_child->get_child(0)->get_type() == NodeType::STRING_NODE)
+            { // The field name is known, so the site only has to check the shape of the struct
+                WRITE_VALUE(r_child->get_child(0)->get_value());
+                WRITE_BYTE(OpCode::OP_LOAD_STRUCT_ELEMENT, func);
+                WRITE_BYTE(constants.size() - 1, func);
+                WRITE_INLINE_CACHE(func);
+                return;
+            }
             choose_expr_operand(r_child, func);
         }
         else
@@ -554,6 +878,10 @@ void interpret_op(Node *node, function *func)
         }
 
         WRITE_BYTE(opCodeMap[opStr], func);
+        if (opCodeMap[opStr] == OpCode::OP_ACCESS)
+        {
+            WRITE_INLINE_CACHE(func);
+        }
     }
     else
     {
@@ -597,11 +925,11 @@ void interpret_if(Node *node, function *func)
     WRITE_BYTE(0, func); // Placeholder for the jump index
     int jump_if_false_byte = func->count - 1;
 
-    WRITE_BYTE(OpCode::OP_INC_SCOPE, func); // Increase the scope for the if block
+    begin_scope(func); // Increase the scope for the if block
 
     interpret_stmt_list(node->get_child(1), func);
 
-    WRITE_BYTE(OpCode::OP_DEC_SCOPE, func); // Decrease the scope for the if block
+    end_scope(func); // Decrease the scope for the if block
 
     CHANGE_BYTE(jump_if_false_byte, func->count - 1, func); // Jump to the end of the if block
 
@@ -614,11 +942,11 @@ void interpret_if(Node *node, function *func)
 
         CHANGE_BYTE(jump_if_false_byte, func->count - 1, func); // Jump to the else block
 
-        WRITE_BYTE(OpCode::OP_INC_SCOPE, func); // Increase the scope for the else block
+        begin_scope(func); // Increase the scope for the else block
 
         interpret_stmt_list(node->get_child(2), func);
 
-        WRITE_BYTE(OpCode::OP_DEC_SCOPE, func); // Decrease the scope for the else block
+        end_scope(func); // Decrease the scope for the else block
 
         CHANGE_BYTE(jump_byte, func->count - 1, func); // Jump to the end of the else block
     }
@@ -632,16 +960,22 @@ void interpret_function(Node *node, function *func, std::string name)
     }
 
     function *new_func = create_function(1000, func);
+    new_func->name = name;
     WRITE_VALUE(new_func); // Add the function to the constants array
+    int constant_index = constants.size() - 1;
 
-    WRITE_BYTE(OpCode::OP_LOAD, func); // push function pointer to stack
-    WRITE_BYTE(constants.size() - 1, func);
+    function_state state;
+    state.func = new_func;
+    state.enclosing = current_function_state;
+    current_function_state = &state;
 
-    // add the arguments to the variables map
+    // the arguments are the first locals of the function
+    std::vector<int> argument_slots;
     for (int i = 0; i < (int)node->get_child(0)->get_children().size(); i++)
     {
         std::string arg_name = node->get_child(0)->get_child(i)->get_value();
         WRITE_VAR_NAME_IF_NOT_EXISTS(arg_name);
+        argument_slots.push_back(declare_variable(arg_name));
 
         new_func->arguments.push_back(arg_name);
     }
@@ -650,7 +984,7 @@ void interpret_function(Node *node, function *func, std::string name)
     for (int i = new_func->arguments.size() - 1; i >= 0; i--)
     { // reverse loop to keep the order of the arguments
         WRITE_BYTE(OpCode::OP_STORE_VAR, new_func);
-        WRITE_BYTE(get_variable_index(new_func->arguments[i]), new_func);
+        WRITE_BYTE(argument_slots[i], new_func);
     }
 
     // make sure the function isn't empty
@@ -659,6 +993,25 @@ void interpret_function(Node *node, function *func, std::string name)
         interpretation_error("Function is empty", node, func);
     }
     interpret_stmt_list(node->get_child(1), new_func);
+
+    current_function_state = state.enclosing;
+
+    // The captured variables are only known once the body has been generated
+    if (state.upvalues.size() == 0)
+    {
+        WRITE_BYTE(OpCode::OP_LOAD, func); // push function pointer to stack
+        WRITE_BYTE(constant_index, func);
+        return;
+    }
+
+    WRITE_BYTE(OpCode::OP_CLOSURE, func); // create a closure capturing the variables and push it to the stack
+    WRITE_BYTE(constant_index, func);
+    WRITE_BYTE(state.upvalues.size(), func);
+    for (const upvalue_info &up : state.upvalues)
+    {
+        WRITE_BYTE(up.kind, func);
+        WRITE_BYTE(up.index, func);
+    }
 }
 
 void interpret_list(Node *node, function *func)
@@ -686,7 +1039,7 @@ void interpret_list(Node *node, function *func)
     }
 }
 
-void interpret_struct_assign(Node *node, function *func, std::string struct_name)
+void interpret_struct_assign(Node *node, function *func)
 {
     if (node->get_type() != NodeType::ASSIGN_NODE)
     {
@@ -710,10 +1063,10 @@ void interpret_struct_assign(Node *node, function *func, std::string struct_name
     {
         interpret_expr(value, func);
 
-        WRITE_BYTE(OpCode::OP_UPDATE_STRUCT_ELEMENT, func); // Update the value in the struct
-        WRITE_BYTE(get_variable_index(struct_name), func);  // index of the struct in the variables names array
+        WRITE_BYTE(OpCode::OP_UPDATE_STRUCT_ELEMENT, func); // Update the value in the struct that is on the stack
         WRITE_VAR_NAME_IF_NOT_EXISTS(var_name);
         WRITE_BYTE(get_variable_index(var_name), func); // index of the struct element in the struct still in the variables names array
+        WRITE_INLINE_CACHE(func);
     }
     break;
     default:
@@ -738,15 +1091,18 @@ void interpret_assign(Node *node, function *func)
         interpretation_error("Assign doesn't have a VAR Node as the first child", node, func);
     }
 
+    if (value->get_type() == NodeType::FUNCTION_NODE && !is_global_scope())
+    {
+        declare_variable(var_name); // declared before the function is generated so the function can call itself
+    }
+
     switch (value->get_type())
     {
     case NodeType::EXPR_NODE:
     {
         interpret_expr(value, func);
 
-        WRITE_BYTE(OpCode::OP_STORE_VAR, func); // takes the value from the stack and stores it in the variables map
-        WRITE_VAR_NAME_IF_NOT_EXISTS(var_name);
-        WRITE_BYTE(get_variable_index(var_name), func);
+        WRITE_STORE_VARIABLE(var_name, func); // takes the value from the stack and stores it in the variable
     }
     break;
     case NodeType::FUNCTION_NODE:
@@ -756,8 +1112,7 @@ void interpret_assign(Node *node, function *func)
 
         interpret_function(value, func, std::string(var_name));
 
-        WRITE_BYTE(OpCode::OP_STORE_VAR, func); // takes the value from the stack and stores it in the variables map
-        WRITE_BYTE(get_variable_index(var_name), func);
+        WRITE_STORE_VARIABLE(var_name, func); // takes the value from the stack and stores it in the variable
     }
     break;
     case NodeType::LIST_NODE:
@@ -768,8 +1123,7 @@ void interpret_assign(Node *node, function *func)
         interpret_list(value, func); // interpret the list and leave the vector on the stack
 
         // Store var
-        WRITE_BYTE(OpCode::OP_STORE_VAR, func); // takes the value from the stack and stores it in the variables map
-        WRITE_BYTE(get_variable_index(var_name), func);
+        WRITE_STORE_VARIABLE(var_name, func); // takes the value from the stack and stores it in the variable
     }
     break;
     case NodeType::NULL_NODE:
@@ -777,19 +1131,13 @@ void interpret_assign(Node *node, function *func)
         WRITE_BYTE(OpCode::OP_LOAD, func);
         WRITE_BYTE(constants.size(), func);
         WRITE_VALUE({Value_Type::NULL_VALUE, nullptr});
-        WRITE_BYTE(OpCode::OP_STORE_VAR, func); // takes the value from the stack and stores it in the variables map
-        WRITE_VAR_NAME_IF_NOT_EXISTS(var_name);
-        WRITE_BYTE(get_variable_index(var_name), func);
+        WRITE_STORE_VARIABLE(var_name, func); // takes the value from the stack and stores it in the variable
     }
     break;
     case NodeType::STRUCT_NODE:
     {
         // Create the struct
-        WRITE_BYTE(OpCode::OP_CREATE_STRUCT, func); // Create an empty struct
-        WRITE_VAR_NAME_IF_NOT_EXISTS(var_name);
-
-        WRITE_BYTE(OpCode::OP_STORE_VAR, func); // takes the value from the stack and stores it in the variables map
-        WRITE_BYTE(get_variable_index(var_name), func);
+        WRITE_BYTE(OpCode::OP_CREATE_STRUCT, func); // Create an empty struct and push it to the stack
 
         // Assign the values to the struct
         Node *list = value->get_child(0);
@@ -802,14 +1150,88 @@ void interpret_assign(Node *node, function *func)
                 interpretation_error("Struct assignment doesn't start with ASSIGN Node", assign, func);
             }
 
-            interpret_struct_assign(assign, func, var_name);
+            interpret_struct_assign(assign, func);
         }
+
+        WRITE_STORE_VARIABLE(var_name, func); // takes the struct from the stack and stores it in the variable
     }
     break;
     default:
         interpretation_error("Invalid child type for ASSIGN Node", node, func);
         break;
     }
+
+}
+
+// True when evaluating the expression can't run other code or see the variable, so when it is evaluated doesn't matter
+// Sets has_string when the expression has a string literal in it
+bool expression_is_independent(Node *node, const std::string &variable, bool &has_string)
+{
+    switch (node->get_type())
+    {
+    case NodeType::NUM_NODE:
+    case NodeType::BOOL_NODE:
+        return true;
+    case NodeType::STRING_NODE:
+        has_string = true;
+        return true;
+    case NodeType::VAR_NODE:
+        return node->get_children().size() == 0 && node->get_value() != variable;
+    case NodeType::OP_NODE:
+    case NodeType::EXPR_NODE:
+        for (Node *child : node->get_children())
+        {
+            if (!expression_is_independent(child, variable, has_string))
+            {
+                return false;
+            }
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Matches variable = variable + a + b + ... where a, b, ... are independent of the variable and one of them has a string
+// in it, and returns a, b, ... in order. The variable is then built with an OP_APPEND per piece, in place when it is a
+// string, instead of being copied into a new string by every + (quadratic when a string is built in a loop)
+// Numbers keep their OP_ADD, which the JIT specializes
+std::vector<Node *> append_pieces(Node *variable, Node *expression)
+{
+    std::string name = variable->get_value();
+    resolved_variable var = resolve_variable(name);
+    if (var.location == Variable_Location::UPVALUE_VARIABLE)
+    {
+        return {};
+    }
+
+    // + is left associative, the leftmost operand of the chain has to be the variable
+    std::vector<Node *> pieces;
+    bool has_string = false;
+    Node *current = expression;
+    while (current->get_type() == NodeType::EXPR_NODE && current->get_children().size() == 1)
+    {
+        current = current->get_child(0);
+    }
+    while (current->get_type() == NodeType::OP_NODE && current->get_value() == "+")
+    {
+        // the right operand is the first child
+        if (!expression_is_independent(current->get_child(0), name, has_string))
+        {
+            return {};
+        }
+        pieces.insert(pieces.begin(), current->get_child(0));
+        current = current->get_child(1);
+        while (current->get_type() == NodeType::EXPR_NODE && current->get_children().size() == 1)
+        {
+            current = current->get_child(0);
+        }
+    }
+    if (current->get_type() != NodeType::VAR_NODE || current->get_children().size() != 0 || current->get_value() != name || !has_string)
+    {
+        return {};
+    }
+    return pieces;
 }
 
 void interpret_update(Node *node, function *func)
@@ -836,33 +1258,43 @@ void interpret_update(Node *node, function *func)
 
     if (variable_children.size() == 0)
     {                                           // Normal update
-        interpret_expr(node_children[1], func); // Expression to update variable with
-
-        WRITE_BYTE(OpCode::OP_UPDATE_VAR, func); // takes the value from the stack and updates the value in the variables map
-        int index = get_variable_index(variable->get_value());
-        if (index == -1)
+        if (get_variable_index(variable->get_value()) == -1)
         {
             interpretation_error("Trying to update a variable that hasn't been defined", node, func);
         }
-        WRITE_BYTE(index, func);
+
+        std::vector<Node *> pieces = append_pieces(variable, node_children[1]);
+        if (!pieces.empty())
+        {
+            resolved_variable var = resolve_variable(variable->get_value());
+            for (Node *piece : pieces)
+            {
+                choose_expr_operand(piece, func);
+                WRITE_BYTE(var.location == Variable_Location::LOCAL_VARIABLE ? OpCode::OP_APPEND_VAR : OpCode::OP_APPEND_GLOBAL, func);
+                WRITE_BYTE(var.index, func);
+            }
+            return;
+        }
+
+        interpret_expr(node_children[1], func); // Expression to update variable with
+        WRITE_UPDATE_VARIABLE(variable->get_value(), func); // takes the value from the stack and updates the variable
     }
     else
     {                                           // Struct or vector update
         // std::cout << "Object update" << std::endl;
         std::vector<Node *> variable_children = variable->get_children();
 
-        WRITE_BYTE(OpCode::OP_LOAD_VAR, func);
-        int index = get_variable_index(variable->get_value());
-        if (index == -1)
+        if (get_variable_index(variable->get_value()) == -1)
         {
             interpretation_error("Trying to access a variable that hasn't been defined", node, func);
         }
-        WRITE_BYTE(index, func);
+        WRITE_LOAD_VARIABLE(variable->get_value(), func);
 
         int num_accesses = variable_children.size();
         for(int i = 0; i < num_accesses - 1; i++){ // reverse loop to keep the order of the accesses (want to access the elements closer to the varibale first)
             interpret_expr(variable_children[i], func);
             WRITE_BYTE(OpCode::OP_ACCESS_FOR_UPDATE, func);
+            WRITE_INLINE_CACHE(func);
         }
 
         interpret_expr(variable_children[num_accesses - 1], func); // Index to update
@@ -870,10 +1302,10 @@ void interpret_update(Node *node, function *func)
 
         for(int i = 0; i < num_accesses; i++){
             WRITE_BYTE(OpCode::OP_UPDATE_STACK_ELEMENT, func);
+            WRITE_INLINE_CACHE(func);
         }
 
-        WRITE_BYTE(OpCode::OP_UPDATE_VAR, func); // takes the value from the stack and updates the value in the variables map
-        WRITE_BYTE(index, func);
+        WRITE_UPDATE_VARIABLE(variable->get_value(), func); // takes the value from the stack and updates the variable
     }
 }
 
@@ -896,7 +1328,7 @@ void interpret_for(Node *node, function *func)
         interpretation_error("For doesn't start with FOR Node", node, func);
     }
 
-    WRITE_BYTE(OpCode::OP_INC_SCOPE, func); // Increase the scope for the for loop
+    begin_scope(func); // Increase the scope for the for loop
 
     std::vector<Node *> children = node->get_children();
     std::vector<NodeType> child_types;
@@ -956,10 +1388,14 @@ void interpret_for(Node *node, function *func)
             break;
         }
     }
+    // the body is a block of its own that ends on every iteration, so the closures of an iteration keep its values
+    begin_scope(func);
     if (stmt_list_index != -1)
     {
         interpret_stmt_list(node->get_child(stmt_list_index), func); // Interpret the body of the for loop
     }
+    int body_end_byte = func->count - 1;
+    end_scope(func);
 
     // find the index of the update node
     int update_index = -1;
@@ -971,7 +1407,6 @@ void interpret_for(Node *node, function *func)
             break;
         }
     }
-    int update_byte = func->count - 1;
     if (update_index != -1)
     {
         interpret_update(node->get_child(update_index), func); // Update the for loop
@@ -994,7 +1429,7 @@ void interpret_for(Node *node, function *func)
             {
                 if (std::get<1>(func->flags[j]) == "continue")
                 {
-                    CHANGE_BYTE(i, update_byte, func); // jump to the update part of the for loop
+                    CHANGE_BYTE(i, body_end_byte, func); // jump to the end of the body, which closes its upvalues
                     func->flags.erase(func->flags.begin() + j);
                 }
                 else if (std::get<1>(func->flags[j]) == "break")
@@ -1013,11 +1448,15 @@ void interpret_for(Node *node, function *func)
         CHANGE_BYTE(jump_to_end_byte, func->count - 1, func);
     }
 
-    WRITE_BYTE(OpCode::OP_DEC_SCOPE, func); // Decrease the scope for the for loop
+    end_scope(func); // Decrease the scope for the for loop
 }
 
 void interpret_stmt(Node *node, function *func)
 {
+    // the instructions of a statement get its line, the rest of an enclosing statement (the jump back of a loop) keeps its own
+    int enclosing_line = generating_line;
+    generating_line = node->get_line();
+
     if (node->get_type() == NodeType::STMT_NODE)
     {
         Node *child = node->get_child(0);
@@ -1068,6 +1507,8 @@ void interpret_stmt(Node *node, function *func)
     {
         interpretation_error("Statement doesn't start with STMT Node", node, func);
     }
+
+    generating_line = enclosing_line;
 }
 
 void interpret_stmt_list(Node *node, function *func)
@@ -1103,9 +1544,16 @@ function *generate_bytecode(Node *ast, std::string name)
 {
     function *func = create_function(1000);
 
+    function_state state;
+    state.func = func;
+    state.enclosing = nullptr;
+    current_function_state = &state;
+
     interpret(ast, func);
 
-    write_cl_exe(name, "./", func, variable_names, constants);
+    current_function_state = nullptr;
+
+    write_cl_exe(name, "./", func, variable_names, global_names, inline_cache_count, constants);
 
     return func;
 }
@@ -4,14 +4,20 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <climits>
+#include <cstdlib>
+#include <string_view>
 
 #include "Value.hpp"
 #include "Function.hpp"
+#include "numbers.hpp"
 
 struct cl_exe{
     std::string name;
     
     std::vector<std::string> variable_names;
+    std::vector<std::string> global_names;
+    int inline_cache_count;
     std::vector<Value> constants;
 
     function* main;
@@ -19,31 +25,82 @@ struct cl_exe{
 
 
 cl_exe* read_cl_exe(std::string path);
-void write_cl_exe(std::string name, std::string path, function* main, std::vector<std::string> variable_names, std::vector<Value> constants);
+cl_exe* read_cl_exe(std::istream &file);
+void write_cl_exe(std::string name, std::string path, function* main, std::vector<std::string> variable_names, std::vector<std::string> global_names, int inline_cache_count, std::vector<Value> constants);
+
+// Path of the .cl file a .cl_exe was generated from, absolute when it exists so tools find it from any directory
+std::string cl_source_path(const std::string &exe_path){
+    std::string source = exe_path.substr(0, exe_path.find_last_of(".")) + ".cl";
+    char resolved[PATH_MAX];
+    if(realpath(source.c_str(), resolved) == nullptr){
+        return source;
+    }
+    return resolved;
+}
 
 cl_exe* read_cl_exe(std::string path){
-    cl_exe* exe = new cl_exe;
-
     //open the file
     std::ifstream file;
     file.open(path);
 
+    return read_cl_exe(file);
+}
+
+// Integer on a line of its own, a count or an index
+int read_int_line(std::istream &file){
+    std::string line;
+    std::getline(file, line);
+    int number = 0;
+    parse_int(line, number);
+    return number;
+}
+
+// Reads the "1, 2, 3, }" list that starts at pos into numbers, returns the position after the closing brace
+template<typename T>
+size_t read_number_list(const std::string &text, size_t pos, std::vector<T> &numbers){
+    size_t close = text.find('}', pos);
+    while(pos < close){
+        size_t comma = text.find(',', pos);
+        if(comma == std::string::npos || comma > close){
+            break;
+        }
+        int number = 0;
+        parse_int(std::string_view(text).substr(pos, comma - pos), number);
+        numbers.push_back(number);
+        pos = comma + 2;
+    }
+    return close == std::string::npos ? text.size() : close + 1;
+}
+
+// Reads a .cl_exe from any stream, ahead of time compiled programs read the one they embed from a string
+cl_exe* read_cl_exe(std::istream &file){
+    cl_exe* exe = new cl_exe;
+
     //read the file name
     std::getline(file, exe->name);
 
     //read the variable names vector
-    std::string variable_names_size;
-    std::getline(file, variable_names_size);
-    for(int i = 0; i < std::stoi(variable_names_size); i++){
+    int variable_names_size = read_int_line(file);
+    for(int i = 0; i < variable_names_size; i++){
         std::string name;
         std::getline(file, name);
         exe->variable_names.push_back(name);
     }
 
+    //read the global names vector
+    int global_names_size = read_int_line(file);
+    for(int i = 0; i < global_names_size; i++){
+        std::string name;
+        std::getline(file, name);
+        exe->global_names.push_back(name);
+    }
+
+    //read the number of inline caches
+    exe->inline_cache_count = read_int_line(file);
+
     //read the constants vector
-    std::string constants_size;
-    std::getline(file, constants_size);
-    for(int i = 0; i < std::stoi(constants_size); i++){
+    int constants_size = read_int_line(file);
+    for(int i = 0; i < constants_size; i++){
         std::string type_and_value;
         // read the whole line
         std::getline(file, type_and_value);
@@ -53,28 +110,32 @@ cl_exe* read_cl_exe(std::string path){
         Value constant;
 
         if(type == "number"){
-            constant = Value(Value_Type::NUMBER, std::stod(value));
+            double number = 0;
+            parse_number(value, number);
+            constant = Value(Value_Type::NUMBER, number);
         } else if(type == "bool"){
             constant = Value(Value_Type::BOOL, value == "true");
         } else if(type == "string"){
             constant = Value(Value_Type::STRING, value);
         } else if(type == "function"){ // PROBLEM
-            value = value.substr(value.find("(") + 1);
             function* func = new function;
+            func->name = value.substr(std::string("function ").size(), value.find("(") - std::string("function ").size());
+            size_t pos = value.find("(") + 1;
+            size_t close = value.find(")", pos);
             std::vector<std::string> arguments;
-            while(value.find(",") != std::string::npos && value.find(")") > value.find(",")){
-                arguments.push_back(value.substr(0, value.find(",")));
-                value = value.substr(value.find(",") + 2);
+            while(value.find(",", pos) < close){
+                arguments.push_back(value.substr(pos, value.find(",", pos) - pos));
+                pos = value.find(",", pos) + 2;
             }
-            arguments.push_back(value.substr(0, value.find(")")));
+            arguments.push_back(value.substr(pos, close - pos));
             func->arguments = arguments;
 
+            // number of local variable slots is between the arguments and the bytecode
+            size_t open = value.find("{", close);
+            parse_int(std::string_view(value).substr(close + 1, open - close - 1), func->local_count);
+
             std::vector<CODE_SIZE> code;
-            value = value.substr(value.find("{") + 1);
-            while(value.find(",") != std::string::npos && value.find("}") > value.find(",")){
-                code.push_back(std::stoi(value.substr(0, value.find(","))));
-                value = value.substr(value.find(",") + 2);
-            }
+            pos = read_number_list(value, open + 1, code);
 
             func->count = code.size();
             func->capacity = code.size();
@@ -83,7 +144,13 @@ cl_exe* read_cl_exe(std::string path){
                 func->code[i] = code[i];
             }
 
-            constant = Value(Value_Type::FUNCTION, func);
+            // source line of every instruction, after the bytecode
+            size_t lines = value.find("lines{", pos);
+            if(lines != std::string::npos){
+                read_number_list(value, lines + 6, func->lines);
+            }
+
+            constant = Value(Value_Type::FUNCTION, new_closure(func));
 
         } else if(type == "null"){
             constant = Value(Value_Type::NULL_VALUE, nullptr);
@@ -95,21 +162,24 @@ cl_exe* read_cl_exe(std::string path){
 
     //read the main bytecode array
     exe->main = new function;
+    file >> exe->main->local_count;
     file >> exe->main->count;
     exe->main->capacity = exe->main->count;
     exe->main->code = new CODE_SIZE[exe->main->count];
     for(int i = 0; i < exe->main->count; i++){
-        std::string code;
+        int code;
         file >> code;
-        exe->main->code[i] = std::stoi(code);
+        exe->main->code[i] = code;
+    }
+    int line;
+    for(int i = 0; i < exe->main->count && file >> line; i++){
+        exe->main->lines.push_back(line);
     }
-
-    file.close();
 
     return exe;
 }
 
-void write_cl_exe(std::string name, std::string path, function* main, std::vector<std::string> variable_names, std::vector<Value> constants){
+void write_cl_exe(std::string name, std::string path, function* main, std::vector<std::string> variable_names, std::vector<std::string> global_names, int inline_cache_count, std::vector<Value> constants){
     //create a text file with the name of the program
     std::ofstream file;
     name = name.substr(0, name.find_last_of("."));
@@ -124,18 +194,44 @@ void write_cl_exe(std::string name, std::string path, function* main, std::vecto
         file << name << std::endl;
     }
 
+    //write the global names vector
+    file << global_names.size() << std::endl;
+    for(auto name : global_names){
+        file << name << std::endl;
+    }
+
+    //write the number of inline caches
+    file << inline_cache_count << std::endl;
+
     //write the constants vector
     file << constants.size() << std::endl;
     for(Value constant : constants){
-        file << get_value_type_string(constant) << "|" << VALUE_AS_STRING(constant) << std::endl;
+        // numbers are stored exactly, VALUE_AS_STRING rounds them to 6 decimals
+        file << get_value_type_string(constant) << "|"
+             << (constant.type == Value_Type::NUMBER ? number_to_exact_string(VALUE_AS_NUMBER(constant)) : VALUE_AS_STRING(constant));
+        if(constant.type == Value_Type::FUNCTION){
+            file << " lines{";
+            for(int line : VALUE_AS_FUNCTION(constant)->lines){
+                file << line << ", ";
+            }
+            file << "}";
+        }
+        file << std::endl;
     }
 
     //write the main bytecode array
+    file << main->local_count << std::endl;
     file << main->count << std::endl;
     for(int i = 0; i < main->count; i++){
         file << CODE_TO_NUMBER_STRING(main->code[i]) << std::endl;
     }
 
+    //write the source line of every main instruction
+    for(int line : main->lines){
+        file << line << " ";
+    }
+    file << std::endl;
+
     file.close();
 }
 
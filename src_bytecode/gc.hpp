@@ -0,0 +1,176 @@
+#ifndef GC_HPP
+#define GC_HPP
+
+// Cycle collector of closures and upvalues
+// Strings, vectors and structs are copied by value, so the only objects shared by reference are closures and the upvalues
+// they captured, and reference counting frees those as soon as the program drops them. Except for cycles: a closure
+// that captures a variable holding itself, like a recursive local function, keeps its upvalue alive and the upvalue the
+// closure, so neither is freed when the function that made them returns
+// Every closure and upvalue the program makes is registered in vm->gc. When GC_INITIAL_THRESHOLD of them were made since
+// the last collection, the next OP_CLOSURE first marks everything reachable from the roots: the stack, the frames with
+// their closures and locals, the globals, the constants and the open upvalues. The registered objects left unmarked are
+// garbage, their references are cleared, which breaks the cycles and lets reference counting free them
+// Collections only start at OP_CLOSURE, where the interpreter and the compiled code keep every value they use on the stack
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Value.hpp"
+#include "VM.hpp"
+
+// Marks the values and what they reference, the worklist keeps deep nesting off the C++ stack
+void gc_mark_values(VM* vm, std::vector<const Value*> &work)
+{
+    uint32_t epoch = vm->gc.epoch;
+    while (!work.empty())
+    {
+        const Value* value = work.back();
+        work.pop_back();
+        if (const std::vector<Value>* vec = std::get_if<std::vector<Value>>(&value->data))
+        {
+            for (const Value &element : *vec)
+            {
+                work.push_back(&element);
+            }
+        }
+        else if (const struct_object* obj = std::get_if<struct_object>(&value->data))
+        {
+            for (const Value &field : obj->fields)
+            {
+                work.push_back(&field);
+            }
+        }
+        else if (const std::shared_ptr<closure>* cl = std::get_if<std::shared_ptr<closure>>(&value->data))
+        {
+            if (*cl == nullptr || (*cl)->gc_mark == epoch)
+            {
+                continue;
+            }
+            (*cl)->gc_mark = epoch;
+            for (const std::shared_ptr<upvalue> &up : (*cl)->upvalues)
+            {
+                if (up->gc_mark != epoch)
+                {
+                    up->gc_mark = epoch;
+                    work.push_back(up->location);
+                }
+            }
+        }
+    }
+}
+
+// Marks everything the program can still reach
+void gc_mark_roots(VM* vm)
+{
+    std::vector<const Value*> work;
+    for (int i = 0; i < vm->stack_count; i++)
+    {
+        work.push_back(&vm->stack[i]);
+    }
+    for (function_frame* frame : vm->function_frames)
+    {
+        if (frame->func_closure != nullptr && frame->func_closure->gc_mark != vm->gc.epoch)
+        {
+            frame->func_closure->gc_mark = vm->gc.epoch;
+            for (const std::shared_ptr<upvalue> &up : frame->func_closure->upvalues)
+            {
+                up->gc_mark = vm->gc.epoch;
+                work.push_back(up->location);
+            }
+        }
+        for (const Value &local : frame->locals)
+        {
+            work.push_back(&local);
+        }
+    }
+    for (const Value &global : vm->globals)
+    {
+        work.push_back(&global);
+    }
+    for (const Value &constant : vm->constants)
+    {
+        work.push_back(&constant);
+    }
+    for (const std::shared_ptr<upvalue> &up : vm->open_upvalues)
+    {
+        up->gc_mark = vm->gc.epoch;
+    }
+    gc_mark_values(vm, work);
+}
+
+// Clears the references of the unmarked objects and forgets the freed ones, returns how many objects are still alive
+size_t gc_sweep(VM* vm)
+{
+    uint32_t epoch = vm->gc.epoch;
+
+    // the closed values are cleared last, clearing one may free the closures still being looked at
+    std::vector<std::shared_ptr<upvalue>> garbage_upvalues;
+    size_t kept = 0;
+    for (std::weak_ptr<upvalue> &entry : vm->gc.upvalues)
+    {
+        std::shared_ptr<upvalue> up = entry.lock();
+        if (up == nullptr)
+        {
+            continue;
+        }
+        if (up->gc_mark != epoch)
+        {
+            garbage_upvalues.push_back(up);
+            continue;
+        }
+        vm->gc.upvalues[kept++] = entry;
+    }
+    vm->gc.upvalues.resize(kept);
+
+    std::vector<std::shared_ptr<closure>> garbage_closures;
+    kept = 0;
+    for (std::weak_ptr<closure> &entry : vm->gc.closures)
+    {
+        std::shared_ptr<closure> cl = entry.lock();
+        if (cl == nullptr)
+        {
+            continue;
+        }
+        if (cl->gc_mark != epoch)
+        {
+            garbage_closures.push_back(cl);
+            continue;
+        }
+        vm->gc.closures[kept++] = entry;
+    }
+    vm->gc.closures.resize(kept);
+
+    vm->gc.freed_closures += garbage_closures.size();
+    vm->gc.freed_upvalues += garbage_upvalues.size();
+    for (const std::shared_ptr<closure> &cl : garbage_closures)
+    {
+        cl->upvalues.clear();
+    }
+    for (const std::shared_ptr<upvalue> &up : garbage_upvalues)
+    {
+        up->closed = Value(Value_Type::NULL_VALUE, nullptr);
+    }
+    return vm->gc.closures.size() + vm->gc.upvalues.size();
+}
+
+// Frees the closures and upvalues only kept alive by cycles
+// The next collection is after as many new objects as survived this one, at least GC_INITIAL_THRESHOLD
+void gc_collect(VM* vm)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    vm->gc.epoch++;
+    gc_mark_roots(vm);
+    size_t alive = gc_sweep(vm);
+    vm->gc.allocated = 0;
+    vm->gc.threshold = alive > GC_INITIAL_THRESHOLD ? (int)alive : GC_INITIAL_THRESHOLD;
+
+    uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    vm->gc.collections++;
+    vm->gc.pause_total_ns += pause;
+    vm->gc.pause_max_ns = pause > vm->gc.pause_max_ns ? pause : vm->gc.pause_max_ns;
+}
+
+#endif // GC_HPP
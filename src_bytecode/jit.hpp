@@ -1,11 +1,19 @@
 #ifndef JIT_HPP
 #define JIT_HPP
 
+#include <algorithm>
+#include <map>
+#include <cstdio>
 #include <vector>
 #include <iostream>
 #include <dlfcn.h> // For dlopen, dlsym, dlclose
+#include <link.h>  // For ElfW, the symbols dladdr1 returns
 #include <unistd.h>
 #include <limits.h>
+#include <filesystem>
+#include <sys/stat.h>
+#include <sys/file.h> // flock
+#include <fcntl.h>
 
 #include "VM.hpp"
 #include "virtual_machine.hpp"
@@ -22,23 +30,590 @@ void jit_run_function(VM* vm, int index)
     vm->jit_functions[index](vm);
 }
 
-void jit_compile_function(VM* vm, function* func)
+// The instructions that are compiled, the whole function or one loop for on stack replacement (OSR)
+struct jit_region
+{
+    int start; // first instruction, the compiled code starts running here
+    int end;   // one past the last instruction
+    bool osr;  // jumping out of the region or returning hands the frame back to the interpreter, which continues from there
+    int back_edge = -1; // for OSR, the backward jump the loop is entered from
+};
+
+jit_region whole_function_region(function* func)
+{
+    return {0, func->count, false};
+}
+
+bool jit_region_contains(const jit_region &region, int index)
+{
+    return index >= region.start && index < region.end;
+}
+
+// Name of the compiled code of the region in profilers and debuggers, lii::<function>, with the loop for OSR
+std::string jit_code_name(function* func, const jit_region &region)
+{
+    std::string name = "lii::" + (func->name.empty() ? std::string("main") : func->name);
+    if(region.osr){
+        name += "[loop " + std::to_string(region.back_edge) + "]";
+    }
+    return name;
+}
+
+// With -jit-perf, adds the compiled code to /tmp/perf-<pid>.map, where perf looks up the names of code it has no symbols for
+void jit_perf_map_add(VM* vm, const void* start, size_t size, const std::string &name)
+{
+    if(!vm->jit_perf){
+        return;
+    }
+    FILE* map = fopen(("/tmp/perf-" + std::to_string(getpid()) + ".map").c_str(), "a");
+    if(map == nullptr){
+        return;
+    }
+    fprintf(map, "%lx %zx %s\n", (unsigned long)(uintptr_t)start, size, name.c_str());
+    fclose(map);
+}
+
+#ifdef LII_LLVM_JIT
+int llvm_jit_compile(VM* vm, function* func, const jit_region &region); // llvm_jit.hpp
+#endif
+int baseline_jit_compile(VM* vm, function* func, const jit_region &region); // baseline_jit.hpp
+
+#define JIT_MAX_DEOPTS 5 // after this many failed guards the function is only compiled with generic code
+
+// True when the interpreter only saw numbers at the instruction, so the JIT can specialize it
+bool jit_number_site(function* func, int index)
+{
+    return func->deopts < JIT_MAX_DEOPTS && !func->type_feedback.empty() && func->type_feedback[index] == (1 << Value_Type::NUMBER);
+}
+
+// Operand stack of the generated code, abstractly interpreted while the code is generated
+// The values at the top of the stack are kept in C++ locals, so the compiler can keep them in registers, the values
+// below them are in vm->stack. The locals are named by their position: v<k> holds a Value, n<k> a number and b<k> a bool
+// They are spilled to vm->stack before every instruction that works on vm->stack itself (calls, returns, vectors, ...)
+// and before jump targets, so control flow always joins with every value in vm->stack
+struct jit_stack
+{
+    std::vector<char> kinds; // 'v', 'n' or 'b' for every value in a local, the top of the stack is last
+    int max_size = 0;
+
+    int size() const
+    {
+        return kinds.size();
+    }
+
+    // name of the local holding the value at position k
+    std::string local(int k) const
+    {
+        return kinds[k] + std::to_string(k);
+    }
+
+    // local of the value depth values below the top
+    std::string top(int depth = 0) const
+    {
+        return local(size() - 1 - depth);
+    }
+
+    char top_kind(int depth = 0) const
+    {
+        return kinds[size() - 1 - depth];
+    }
+
+    // the value at position k as a Value
+    std::string value(int k) const
+    {
+        switch (kinds[k])
+        {
+        case 'n': return "Value(Value_Type::NUMBER, " + local(k) + ")";
+        case 'b': return "Value(Value_Type::BOOL, " + local(k) + ")";
+        default: return "std::move(" + local(k) + ")";
+        }
+    }
+
+    std::string top_value() const
+    {
+        return value(size() - 1);
+    }
+
+    // pushes a value of the kind, returns the local it is kept in
+    std::string push(char kind)
+    {
+        kinds.push_back(kind);
+        max_size = std::max(max_size, size());
+        return top();
+    }
+
+    void pop(int count = 1)
+    {
+        kinds.resize(size() - count);
+    }
+
+    // code that moves every local to vm->stack, without changing the stack that is being generated
+    std::string spill_code() const
+    {
+        std::string code;
+        for (int k = 0; k < size(); k++)
+        {
+            code += "\n            push(vm, " + value(k) + ");";
+        }
+        return code;
+    }
+
+    std::string spill()
+    {
+        std::string code = spill_code();
+        kinds.clear();
+        return code;
+    }
+
+    // code that loads the top count values from vm->stack when they aren't all in locals
+    std::string ensure(int count)
+    {
+        if (size() >= count)
+        {
+            return "";
+        }
+        std::string code = spill();
+        for (int k = count - 1; k >= 0; k--)
+        {
+            code += "\n            v" + std::to_string(k) + " = pop(vm);";
+        }
+        kinds.assign(count, 'v');
+        max_size = std::max(max_size, size());
+        return code;
+    }
+
+    std::string declarations() const
+    {
+        std::string code;
+        for (int k = 0; k < max_size; k++)
+        {
+            code += "\n    Value v" + std::to_string(k) + "; double n" + std::to_string(k) + " = 0; bool b" + std::to_string(k) + " = false;";
+        }
+        return code;
+    }
+};
+
+// Instructions the generated code runs on the locals of the jit_stack, every other instruction is run on vm->stack
+bool jit_keeps_stack_in_locals(CODE_SIZE op)
+{
+    switch (op)
+    {
+    case OpCode::OP_LOAD:
+    case OpCode::OP_LOAD_VAR:
+    case OpCode::OP_STORE_VAR:
+    case OpCode::OP_LOAD_GLOBAL:
+    case OpCode::OP_STORE_GLOBAL:
+    case OpCode::OP_LOAD_UPVALUE:
+    case OpCode::OP_UPDATE_UPVALUE:
+    case OpCode::OP_JUMP:
+    case OpCode::OP_JUMP_IF_FALSE:
+    case OpCode::OP_DEC_SCOPE:
+    case OpCode::OP_PRINT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Exact C++ literal of a number constant
+std::string jit_number_literal(double number)
+{
+    char literal[64];
+    std::snprintf(literal, sizeof(literal), "%a", number);
+    return literal;
+}
+
+// C++ for an arithmetic or comparison instruction on two numbers, the operands and the result stay in locals
+// Operands that aren't known to be numbers are guarded, a failed guard spills the stack and runs deopt_code
+// Returns "" for instructions that aren't specialized
+std::string jit_number_operation(CODE_SIZE op, jit_stack &stack, const std::string &deopt_code)
+{
+    char result_kind = 'n';
+    std::string expression;
+    std::string zero_error;
+    switch (op)
+    {
+    case OpCode::OP_ADD: expression = "a + b"; break;
+    case OpCode::OP_SUB: expression = "a - b"; break;
+    case OpCode::OP_MUL: expression = "a * b"; break;
+    case OpCode::OP_DIV: expression = "a / b"; zero_error = "Division by zero"; break;
+    case OpCode::OP_MOD: expression = "std::fmod(a, b)"; zero_error = "Modulus by zero"; break;
+    case OpCode::OP_EQ: expression = "a == b"; result_kind = 'b'; break;
+    case OpCode::OP_NEQ: expression = "a != b"; result_kind = 'b'; break;
+    case OpCode::OP_GT: expression = "a > b"; result_kind = 'b'; break;
+    case OpCode::OP_GTEQ: expression = "a >= b"; result_kind = 'b'; break;
+    case OpCode::OP_LT: expression = "a < b"; result_kind = 'b'; break;
+    case OpCode::OP_LTEQ: expression = "a <= b"; result_kind = 'b'; break;
+    default:
+        return "";
+    }
+
+    std::string code = stack.ensure(2);
+    if (stack.top_kind(0) == 'b' || stack.top_kind(1) == 'b')
+    {
+        return ""; // a bool operand would always fail the guard
+    }
+
+    // a is the left operand, on the top of the stack
+    std::string operands[2];
+    std::string guard;
+    for (int depth = 0; depth < 2; depth++)
+    {
+        if (stack.top_kind(depth) == 'n')
+        {
+            operands[depth] = stack.top(depth);
+            continue;
+        }
+        operands[depth] = "std::get<double>(" + stack.top(depth) + ".data)";
+        guard += std::string(guard.empty() ? "" : " || ") + stack.top(depth) + ".type != Value_Type::NUMBER";
+    }
+    if (!guard.empty())
+    {
+        code += R"(
+            if ()" + guard + R"()
+            {)" + stack.spill_code() + R"(
+                )" + deopt_code + R"(
+            })";
+    }
+    code += R"(
+            double a = )" + operands[0] + R"(;
+            double b = )" + operands[1] + ";";
+    if (!zero_error.empty())
+    {
+        code += R"(
+            if (b == 0)
+            {
+                vm_error(")" + zero_error + R"(");
+            })";
+    }
+    stack.pop(2);
+    code += "\n            " + stack.push(result_kind) + " = " + expression + ";";
+    return code;
+}
+
+// Loads a constant, number and bool constants are known while compiling so they become literals
+std::string jit_load_constant(VM* vm, int index, jit_stack &stack)
+{
+    Value constant = get_vm_constant(vm, index);
+    if (constant.type == Value_Type::NUMBER)
+    {
+        return "\n            " + stack.push('n') + " = " + jit_number_literal(std::get<double>(constant.data)) + ";";
+    }
+    if (constant.type == Value_Type::BOOL)
+    {
+        return "\n            " + stack.push('b') + " = " + (std::get<bool>(constant.data) ? "true;" : "false;");
+    }
+    return "\n            " + stack.push('v') + " = get_vm_constant(vm, " + std::to_string(index) + ");";
+}
+
+// C++ expression for a pointer of the running VM, the generated code is loaded into the same process
+std::string jit_pointer_literal(const std::string &type, const void* pointer)
+{
+    return "((" + type + ")" + std::to_string((uintptr_t)pointer) + "ULL)";
+}
+
+#define JIT_INLINE_MAX_SIZE 64 // callees with at most this much bytecode can be inlined
+
+// The function the call site always called in the interpreter, nullptr when it called none or more than one
+function* jit_monomorphic_callee(function* func, int index)
+{
+    if (func->calls.empty() || func->calls[index].polymorphic)
+    {
+        return nullptr;
+    }
+    return func->calls[index].target;
+}
+
+// Small leaf functions that only load, store, jump and do arithmetic the interpreter only saw numbers for are inlined
+bool jit_can_inline(function* callee)
+{
+    if (callee->count > JIT_INLINE_MAX_SIZE || callee->deopts >= JIT_MAX_DEOPTS)
+    {
+        return false;
+    }
+    for (int j = 0; j < callee->count; j += instruction_size(&callee->code[j]))
+    {
+        switch (callee->code[j])
+        {
+        case OpCode::OP_LOAD:
+        case OpCode::OP_LOAD_VAR:
+        case OpCode::OP_STORE_VAR:
+        case OpCode::OP_LOAD_GLOBAL:
+        case OpCode::OP_JUMP:
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_RETURN:
+            break;
+        default:
+            jit_stack probe;
+            probe.kinds = {'v', 'v'};
+            if (!jit_number_site(callee, j) || jit_number_operation(callee->code[j], probe, "").empty())
+            {
+                return false;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+// Inlines the call at index site of a callee accepted by jit_can_inline, the arguments are on the stack and the closure on its top
+// The callee's locals become C++ locals, its returns jump to the end of the inlined code with the result
+// When the closure isn't the callee the function is called normally. When a guard in the inlined code fails, the frame of the
+// callee is created from the C++ locals and the interpreter runs the rest of the callee
+// The end of the inlined code joins with the whole stack in vm->stack and the result in a local
+std::string jit_inline_call(VM* vm, function* callee, int site, jit_stack &stack, std::string &declarations)
 {
-    std::string jit_name = "jit_" + std::to_string(vm->jit_functions.size());
-    std::string program = R"(
+    std::string prefix = "inline_" + std::to_string(site) + "_";
+    std::string result = prefix + "result";
+    std::string end_label = prefix + "end";
+    auto callee_local = [&](int slot)
+    {
+        return prefix + std::to_string(slot);
+    };
+
+    declarations += "\n    Value " + result + ";";
+    for (int slot = 0; slot < callee->local_count; slot++)
+    {
+        declarations += "\n    Value " + callee_local(slot) + ";";
+    }
+
+    std::string code = stack.ensure(1);
+    code += R"(
+            // inlined )" + callee->name + R"(
+            if ()" + stack.top() + R"(.type != Value_Type::FUNCTION || std::get<std::shared_ptr<closure>>()" + stack.top() + R"(.data)->func != )" + jit_pointer_literal("function*", callee) + R"()
+            {)" + stack.spill_code() + R"(
+                lii_rt_call(vm);
+                )" + result + R"( = pop(vm);
+                goto )" + end_label + R"(;
+            })";
+    stack.pop();
+
+    // the arguments are stored by the first instructions of the callee, every other local starts as null
+    for (int slot = 0; slot < callee->local_count; slot++)
+    {
+        code += "\n            " + callee_local(slot) + " = Value(Value_Type::NULL_VALUE, nullptr);";
+    }
+
+    std::vector<bool> jump_targets(callee->count + 1, false);
+    for (int j = 0; j < callee->count; j += instruction_size(&callee->code[j]))
+    {
+        if (callee->code[j] == OpCode::OP_JUMP || callee->code[j] == OpCode::OP_JUMP_IF_FALSE)
+        {
+            jump_targets[callee->code[j + 1] + 1] = true;
+        }
+    }
+
+    auto deopt_code = [&](int index)
+    {
+        std::string locals;
+        for (int slot = 0; slot < callee->local_count; slot++)
+        {
+            locals += "std::move(" + callee_local(slot) + "), ";
+        }
+        return "std::vector<Value> locals = {" + locals + "};\n                lii_rt_inline_deopt(vm, " +
+               jit_pointer_literal("function*", callee) + ", locals.data(), " + std::to_string(index) + ");\n                " +
+               result + " = pop(vm);\n                goto " + end_label + ";";
+    };
+
+    for (int j = 0; j < callee->count; j += instruction_size(&callee->code[j]))
+    {
+        if (jump_targets[j])
+        {
+            code += stack.spill();
+        }
+        // every instruction gets its own block, like in clang_jit_compile, so jumps don't cross declarations
+        code += "\n" + prefix + "label_" + std::to_string(j) + ": ;\n            {";
+        switch (callee->code[j])
+        {
+        case OpCode::OP_LOAD:
+            code += jit_load_constant(vm, callee->code[j + 1], stack);
+            break;
+        case OpCode::OP_LOAD_VAR:
+            code += "\n            " + stack.push('v') + " = " + callee_local(callee->code[j + 1]) + ";";
+            break;
+        case OpCode::OP_STORE_VAR:
+            code += stack.ensure(1);
+            code += "\n            " + callee_local(callee->code[j + 1]) + " = " + stack.top_value() + ";";
+            stack.pop();
+            break;
+        case OpCode::OP_LOAD_GLOBAL:
+            code += "\n            " + stack.push('v') + " = get_global(vm, " + std::to_string(callee->code[j + 1]) + ");";
+            break;
+        case OpCode::OP_JUMP:
+            code += stack.spill();
+            code += "\n            goto " + prefix + "label_" + std::to_string(callee->code[j + 1] + 1) + ";";
+            break;
+        case OpCode::OP_JUMP_IF_FALSE:
+        {
+            code += stack.ensure(1);
+            std::string condition = stack.top_kind() == 'b' ? stack.top() : "VALUE_AS_BOOL(" + stack.top_value() + ")";
+            stack.pop();
+            code += "\n            if (!(" + condition + "))\n            {" + stack.spill_code();
+            code += "\n                goto " + prefix + "label_" + std::to_string(callee->code[j + 1] + 1) + ";\n            }";
+            code += stack.spill();
+            break;
+        }
+        case OpCode::OP_RETURN:
+            code += stack.ensure(1);
+            code += "\n            " + result + " = " + stack.top_value() + ";";
+            stack.pop();
+            code += stack.spill();
+            code += "\n            goto " + end_label + ";";
+            break;
+        default:
+        {
+            jit_stack specialized_stack = stack;
+            std::string specialized = jit_number_operation(callee->code[j], specialized_stack, deopt_code(j));
+            if (specialized.empty())
+            {
+                // an operand is a bool, the interpreter runs the callee from here
+                code += "\n            {" + stack.spill_code() + "\n                " + deopt_code(j) + "\n            }";
+            }
+            else
+            {
+                stack = specialized_stack;
+                code += specialized;
+            }
+            break;
+        }
+        }
+        code += "\n            }";
+    }
+
+    code += "\n" + end_label + ": ;";
+    stack.kinds.clear();
+    code += "\n            " + stack.push('v') + " = std::move(" + result + ");";
+    return code;
+}
+
+// Puts a #line directive before every line of the generated code, so compilers, debuggers and profilers attribute it
+// to the line of the .cl source its instruction came from
+std::string jit_line_directives(const std::string &program, const std::vector<std::pair<size_t, int>> &source_lines, const std::string &source_path)
+{
+    if(source_lines.empty() || source_path.empty()){
+        return program;
+    }
+    std::string file = "\"";
+    for(char c : source_path){
+        if(c == '\\' || c == '"'){
+            file += '\\';
+        }
+        file += c;
+    }
+    file += "\"";
+
+    std::string result;
+    size_t next = 0; // next entry of source_lines
+    int line = source_lines[0].second;
+    size_t start = 0;
+    while(start < program.size()){
+        size_t end = program.find('\n', start);
+        end = end == std::string::npos ? program.size() : end + 1;
+        while(next < source_lines.size() && source_lines[next].first <= start){
+            line = source_lines[next++].second;
+        }
+        result += "#line " + std::to_string(line) + " " + file + "\n" + program.substr(start, end - start);
+        start = end;
+    }
+    return result;
+}
+
+// Functions compiled together into one shared library, with the index their compiled code gets
+typedef std::map<function*, int> jit_batch;
+
+// Start of every translation unit the clang backend generates
+const std::string CLANG_JIT_INCLUDES = R"(
                         #include <iostream>
-                        #include "../src_bytecode/VM.hpp"
-                        #include "../src_bytecode/Value.hpp"
-                        #include "../src_bytecode/std_lib/std_lib.hpp"
-                        #include "../src_bytecode/virtual_machine.hpp"
-                        #include "../src_bytecode/jit.hpp"
+                        #include "src_bytecode/VM.hpp"
+                        #include "src_bytecode/Value.hpp"
+                        #include "src_bytecode/std_lib/std_lib.hpp"
+                        #include "src_bytecode/virtual_machine.hpp"
+                        #include "src_bytecode/jit.hpp"
+)";
+
+// Generates the C++ function jit_<jit_index> for the region
+// Calls to functions in the batch call their generated function by name, so clang can inline them
+std::string clang_jit_source(VM* vm, function* func, const jit_region &region, int jit_index, const jit_batch &batch = jit_batch())
+{
+    std::string jit_name = "jit_" + std::to_string(jit_index);
+    std::string header = R"(
                         extern "C" void )" + jit_name + R"((VM* vm){)";
 
-    for(int i = 0; i < func->count; i++){
+    // hands the frame back to the interpreter, which continues at the instruction
+    auto exit_code = [](int index)
+    {
+        return "lii_rt_osr_exit(vm, " + std::to_string(index) + "); return;";
+    };
+    // jumps out of an OSR region return to the interpreter, which continues at the target
+    auto jump_code = [&](int target)
+    {
+        if(region.osr && !jit_region_contains(region, target)){
+            return exit_code(target);
+        }
+        return "goto label_" + std::to_string(target) + ";";
+    };
+
+    // a failed type guard throws the compiled code away and continues the frame in the interpreter at the instruction
+    auto deopt_code = [&](int index)
+    {
+        if(region.osr){
+            return "lii_rt_osr_deopt(vm, " + std::to_string(index) + ", " + std::to_string(region.back_edge) + "); return;";
+        }
+        return "lii_rt_deopt(vm, " + std::to_string(index) + "); return;";
+    };
+
+    // every jump arrives with the whole stack in vm->stack
+    std::vector<bool> jump_targets(func->count + 1, false);
+    for(int i = region.start; i < region.end; i += instruction_size(&func->code[i])){
+        if(func->code[i] == OpCode::OP_JUMP || func->code[i] == OpCode::OP_JUMP_IF_FALSE){
+            int target = func->code[i + 1] + 1;
+            if(target >= 0 && target <= func->count){
+                jump_targets[target] = true;
+            }
+        }
+    }
+
+    jit_stack stack;
+    std::string program;
+    std::string inline_declarations;
+    std::vector<std::pair<size_t, int>> source_lines; // (offset in program, source line) where the code of an instruction starts
+    for(int i = region.start; i < region.end; i++){
+        if(i < (int)func->lines.size()){
+            source_lines.push_back({program.size(), func->lines[i]});
+        }
+        if(jump_targets[i]){
+            program += stack.spill();
+        }
         program += "\nlabel_" + std::to_string(i) + ": \n";
         // Add a comment with the Opcode name
         program += "// " + opcode_to_string(func->code[i]) + "\n";
         program += "{\n";
+
+        // instructions that only saw numbers in the interpreter get code specialized for numbers
+        if(jit_number_site(func, i)){
+            jit_stack specialized_stack = stack;
+            std::string specialized = jit_number_operation(func->code[i], specialized_stack, deopt_code(i));
+            if(!specialized.empty()){
+                stack = specialized_stack;
+                program += specialized + "\n}\n";
+                continue;
+            }
+        }
+
+        // calls to small leaf functions are inlined, the arguments stay in locals
+        if(func->code[i] == OpCode::OP_FUNCTION_CALL){
+            function* callee = jit_monomorphic_callee(func, i);
+            if(callee != nullptr && jit_can_inline(callee) && (stack.size() == 0 || stack.top_kind() == 'v')){
+                program += jit_inline_call(vm, callee, i, stack, inline_declarations) + "\n}\n";
+                continue;
+            }
+        }
+
+        // the other instructions work on vm->stack
+        if(!jit_keeps_stack_in_locals(func->code[i])){
+            program += stack.spill();
+        }
+
         switch (func->code[i])
         {
         // Arithmetic operations
@@ -53,7 +628,7 @@ void jit_compile_function(VM* vm, function* func)
             }
             else if (a.type == Value_Type::STRING || b.type == Value_Type::STRING)
             {
-                push(vm, {Value_Type::STRING, VALUE_AS_STRING(a) + VALUE_AS_STRING(b)});
+                push(vm, {Value_Type::STRING, concat_values(std::move(a), b)});
             }
             else
             {
@@ -268,32 +843,68 @@ void jit_compile_function(VM* vm, function* func)
         // Memory operations
         case OpCode::OP_LOAD:
         {
-            program += R"(
-            push(vm, get_vm_constant(vm, )" + std::to_string(func->code[++i]) + R"());)";
+            program += jit_load_constant(vm, func->code[++i], stack);
             break;
         }
         case OpCode::OP_STORE_VAR:
         {
-            program += R"(
-            set_variable(vm, vm->variable_names[)" + std::to_string(func->code[++i]) + R"(], pop(vm));)";
+            program += stack.ensure(1);
+            program += "\n            set_local(vm, " + std::to_string(func->code[++i]) + ", " + stack.top_value() + ");";
+            stack.pop();
             break;
         }
-        case OpCode::OP_UPDATE_VAR:
+        case OpCode::OP_LOAD_VAR:
         {
-            program += R"(
-            update_variable(vm, vm->variable_names[)" + std::to_string(func->code[++i]) + R"(], pop(vm));)";
+            program += "\n            " + stack.push('v') + " = get_local(vm, " + std::to_string(func->code[++i]) + ");";
             break;
         }
-        case OpCode::OP_LOAD_VAR:
+        case OpCode::OP_LOAD_GLOBAL:
         {
-            program += R"(
-            push(vm, get_variable(vm, vm->variable_names[)" + std::to_string(func->code[++i]) + R"(]));)";
+            program += "\n            " + stack.push('v') + " = get_global(vm, " + std::to_string(func->code[++i]) + ");";
+            break;
+        }
+        case OpCode::OP_STORE_GLOBAL:
+        {
+            program += stack.ensure(1);
+            program += "\n            set_global(vm, " + std::to_string(func->code[++i]) + ", " + stack.top_value() + ");";
+            stack.pop();
+            break;
+        }
+        case OpCode::OP_LOAD_UPVALUE:
+        {
+            program += "\n            " + stack.push('v') + " = get_upvalue(vm, " + std::to_string(func->code[++i]) + ");";
+            break;
+        }
+        case OpCode::OP_UPDATE_UPVALUE:
+        {
+            program += stack.ensure(1);
+            program += "\n            update_upvalue(vm, " + std::to_string(func->code[++i]) + ", " + stack.top_value() + ");";
+            stack.pop();
+            break;
+        }
+        case OpCode::OP_APPEND_VAR:
+        {
+            program += "\n            append_local(vm, " + std::to_string(func->code[++i]) + ", pop(vm));";
             break;
         }
-        case OpCode::OP_LOAD_FUNCTION_VAR:
+        case OpCode::OP_APPEND_GLOBAL:
         {
+            program += "\n            append_global(vm, " + std::to_string(func->code[++i]) + ", pop(vm));";
+            break;
+        }
+        case OpCode::OP_CLOSURE:
+        {
+            // the captures are copied into the generated code, the same layout create_closure reads from the bytecode
+            int constant_index = func->code[++i];
+            int capture_count = func->code[i + 1];
+            std::string captures = "";
+            for(int j = 0; j <= capture_count * 2; j++){
+                captures += std::to_string(func->code[i + 1 + j]) + ", ";
+            }
+            i += capture_count * 2 + 1;
             program += R"(
-            push(vm, get_function_variable(vm, vm->variable_names[)" + std::to_string(func->code[++i]) + R"(]));)";
+            static const CODE_SIZE captures[] = {)" + captures + R"(};
+            push(vm, create_closure(vm, VALUE_AS_FUNCTION(get_vm_constant(vm, )" + std::to_string(constant_index) + R"()), captures));)";
             break;
         }
 
@@ -324,7 +935,7 @@ void jit_compile_function(VM* vm, function* func)
             program += R"(
             Value index = pop(vm);                                                                    
             Value value = pop(vm);                                                                    
-            Value vector = get_variable(vm, vm->variable_names[)" + std::to_string(func->code[++i]) + R"(]);)";
+            Value vector = get_local(vm, )" + std::to_string(func->code[++i]) + R"();)";
             program += R"(
             if (vector.type != Value_Type::VECTOR || index.type != Value_Type::NUMBER)                
             {                                                                                      
@@ -336,14 +947,14 @@ void jit_compile_function(VM* vm, function* func)
                 vm_error("Index out of bounds - Vector element update");                                                    
             }                                                                                      
             vec[(int)VALUE_AS_NUMBER(index)] = value;                                               
-            update_variable(vm, vm->variable_names[)" + std::to_string(func->code[i]) + R"(], {Value_Type::VECTOR, vec});)";
+            set_local(vm, )" + std::to_string(func->code[i]) + R"(, {Value_Type::VECTOR, vec});)";
             break;
         }
         case OpCode::OP_LOAD_VECTOR_ELEMENT:
         {
             program += R"(
             Value index = pop(vm);                                                                    
-            Value vector = get_variable(vm, vm->variable_names[)" + std::to_string(func->code[++i]) + R"(]);)";
+            Value vector = get_local(vm, )" + std::to_string(func->code[++i]) + R"();)";
             program += R"(
             if (vector.type != Value_Type::VECTOR || index.type != Value_Type::NUMBER)                
             {                                                                                      
@@ -364,36 +975,28 @@ void jit_compile_function(VM* vm, function* func)
         case OpCode::OP_CREATE_STRUCT:
         {
             program += R"(
-            push(vm, {Value_Type::STRUCT, std::map<std::string, Value>()});)";
+            push(vm, create_struct(vm));)";
             break;
         }
         case OpCode::OP_UPDATE_STRUCT_ELEMENT:
         {
             program += R"(
-            Value value = pop(vm);                                                                    
-            Value struct_ = get_variable(vm, vm->variable_names[)" + std::to_string(func->code[i + 1]) + R"(]);)";
-            program += R"(
-            if (struct_.type != Value_Type::STRUCT)                                                  
-            {                                                                                      
-                vm_error("Not a struct");                                                           
-            }                                                                                      
-            std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(struct_);                     
-            struct_map[vm->variable_names[)" + std::to_string(func->code[i + 2]) + R"(]] = value;        
-            update_variable(vm, vm->variable_names[)" + std::to_string(func->code[i + 1]) + R"(], {Value_Type::STRUCT, struct_map});)";
+            Value value = pop(vm);
+            Value struct_ = pop(vm);
+            if (struct_.type != Value_Type::STRUCT)
+            {
+                vm_error("Not a struct");
+            }
+            set_struct_field(vm, std::get<struct_object>(struct_.data), vm->variable_names[)" + std::to_string(func->code[i + 1]) + R"(], value, )" + std::to_string(func->code[i + 2]) + R"();
+            push(vm, struct_);)";
             i += 2;
             break;
         }
         case OpCode::OP_LOAD_STRUCT_ELEMENT:
         {
             program += R"(
-            Value struct_ = get_variable(vm, vm->variable_names[)" + std::to_string(func->code[++i]) + R"(]);)";
-            program += R"(
-            if (struct_.type != Value_Type::STRUCT)                                                  
-            {                                                                                      
-                vm_error("Not a struct");                                                           
-            }                                                                                      
-            std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(struct_);                     
-            push(vm, struct_map[vm->variable_names[)" + std::to_string(func->code[++i]) + R"(]]);)";
+            load_struct_field(vm, )" + std::to_string(func->code[i + 1]) + ", " + std::to_string(func->code[i + 2]) + R"();)";
+            i += 2;
             break;
         }
 
@@ -403,34 +1006,7 @@ void jit_compile_function(VM* vm, function* func)
             program += R"(
             Value index = pop(vm);
             Value obj = pop(vm);
-            if (obj.type == Value_Type::STRUCT)
-            {
-                std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(obj);
-                //check if the key exists
-                if (struct_map.find(VALUE_AS_STRING(index)) == struct_map.end())
-                {
-                    vm_error("Key does not exist in struct");
-                }
-                push(vm, struct_map[VALUE_AS_STRING(index)]);
-            }
-            else if (obj.type == Value_Type::VECTOR)
-            {
-                std::vector<Value> vec = VALUE_AS_VECTOR(obj);
-                if (index.type != Value_Type::NUMBER)
-                {
-                    vm_error("Invalid index type for vector access");
-                }
-                if (VALUE_AS_NUMBER(index) < 0 || VALUE_AS_NUMBER(index) >= vec.size())
-                {
-                    vm_error("Index out of bounds");
-                }
-                push(vm, vec[(int)VALUE_AS_NUMBER(index)]);
-            }
-            else
-            {
-                vm_error("Invalid type for access");
-            }
-            )";
+            push(vm, access_element(vm, obj, index, )" + std::to_string(func->code[++i]) + R"());)";
             break;
         }
         case OpCode::OP_ACCESS_FOR_UPDATE:
@@ -440,35 +1016,7 @@ void jit_compile_function(VM* vm, function* func)
             Value obj = pop(vm);
             push(vm, obj);
             push(vm, index);
-
-            if (obj.type == Value_Type::STRUCT)
-            {
-                std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(obj);
-                //check if the key exists
-                if (struct_map.find(VALUE_AS_STRING(index)) == struct_map.end())
-                {
-                    vm_error("Key does not exist in struct");
-                }
-                push(vm, struct_map[VALUE_AS_STRING(index)]);
-            }
-            else if (obj.type == Value_Type::VECTOR)
-            {
-                std::vector<Value> vec = VALUE_AS_VECTOR(obj);
-                if (index.type != Value_Type::NUMBER)
-                {
-                    vm_error("Invalid index type for vector access");
-                }
-                if (VALUE_AS_NUMBER(index) < 0 || VALUE_AS_NUMBER(index) >= vec.size())
-                {
-                    vm_error("Index out of bounds");
-                }
-                push(vm, vec[(int)VALUE_AS_NUMBER(index)]);
-            }
-            else
-            {
-                vm_error("Invalid type for access");
-            }
-            )";
+            push(vm, access_element(vm, obj, index, )" + std::to_string(func->code[++i]) + R"());)";
             break;
         }
         case OpCode::OP_UPDATE_STACK_ELEMENT:
@@ -477,168 +1025,95 @@ void jit_compile_function(VM* vm, function* func)
             Value value = pop(vm);
             Value index = pop(vm);
             Value obj = pop(vm);
-        
-            if (obj.type == Value_Type::STRUCT)
-            {
-                std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(obj);
-                //check if the key exists
-                if (struct_map.find(VALUE_AS_STRING(index)) == struct_map.end())
-                {
-                    vm_error("Key does not exist in struct");
-                }
-                struct_map[VALUE_AS_STRING(index)] = value;
-                push(vm, {Value_Type::STRUCT, struct_map});
-            }
-            else if (obj.type == Value_Type::VECTOR)
-            {
-                std::vector<Value> vec = VALUE_AS_VECTOR(obj);
-                if (index.type != Value_Type::NUMBER)
-                {
-                    vm_error("Invalid index type for vector access");
-                }
-                if (VALUE_AS_NUMBER(index) < 0 || VALUE_AS_NUMBER(index) >= vec.size())
-                {
-                    vm_error("Index out of bounds");
-                }
-                vec[(int)VALUE_AS_NUMBER(index)] = value;
-                push(vm, {Value_Type::VECTOR, vec});
-            }
-            else
-            {
-                vm_error("Invalid type for access");
-            }
-            )";
+            update_element(vm, obj, index, value, )" + std::to_string(func->code[++i]) + R"();
+            push(vm, obj);)";
             break;
         }
 
         // Control flow operations
         case OpCode::OP_RETURN:
         {
+            if(region.osr){
+                program += "\n" + exit_code(i); // the interpreter returns from the function
+                break;
+            }
             program += R"(
-            delete get_current_function_frame(vm);
-            vm->function_frames.pop_back(); // return value is already on the stack
+            pop_function_frame(vm); // return value is already on the stack
             return;)";
             break;
         }
         case OpCode::OP_JUMP:
         {
-            program += R"(
-            goto label_)" + std::to_string(func->code[++i] + 1) + R"(;)";
+            program += stack.spill();
+            program += "\n" + jump_code(func->code[++i] + 1);
             break;
         }
         case OpCode::OP_JUMP_IF_FALSE:
         {
+            program += stack.ensure(1);
+            std::string condition = stack.top_kind() == 'b' ? stack.top() : "VALUE_AS_BOOL(" + stack.top_value() + ")";
+            stack.pop();
+            program += "\n            bool condition = " + condition + ";";
+            program += stack.spill();
             program += R"(
-            Value val = pop(vm);                                                                     
-            if (!VALUE_AS_BOOL(val))                                                                
-            {                                                                                      
-                goto label_)" + std::to_string(func->code[++i] + 1) + R"(;                         
+            if (!condition)
+            {
+                )" + jump_code(func->code[++i] + 1) + R"(
             })";
             break;
         }
         case OpCode::OP_FUNCTION_CALL:
         {
-            program += R"(
-            function* func = VALUE_AS_FUNCTION(pop(vm));)";
-            program += R"(
-            func->times_called++;)";
-            program += R"(
-            if(vm->jit && func->times_called == CALLS_TO_JIT){ 
-                jit_compile_function(vm, func);
-            }
-
-            if(vm->jit && func->jit_index != -1){
-                vm->function_frames.push_back(create_function_frame(func));
-                jit_run_function(vm, func->jit_index);
+            // calls to a function that is already optimized, or to the function itself, call its compiled code directly
+            // guarded by the callee and by its code still being current, otherwise the runtime makes the call
+            function* callee = jit_monomorphic_callee(func, i);
+            bool self_call = callee == func && !region.osr;
+            bool batched = callee != nullptr && batch.count(callee);
+            if(callee != nullptr && (self_call || batched || (callee->tier == 2 && callee->jit_index != -1))){
+                int callee_index = self_call ? jit_index : batched ? batch.at(callee) : callee->jit_index;
+                std::string target = self_call || batched ? "jit_" + std::to_string(callee_index)
+                                                          : jit_pointer_literal("JIT_FUNCTION", (void*)vm->jit_functions[callee_index]);
+                std::string callee_literal = jit_pointer_literal("function*", callee);
+                program += R"(
+            Value &callee = vm->stack[vm->stack_count - 1];
+            if (callee.type == Value_Type::FUNCTION && std::get<std::shared_ptr<closure>>(callee.data)->func == )" + callee_literal + R"( &&
+                )" + callee_literal + R"(->jit_index == )" + std::to_string(callee_index) + R"()
+            {
+                std::shared_ptr<closure> func_closure = VALUE_AS_CLOSURE(pop(vm));
+                vm->function_frames.push_back(create_function_frame(func_closure->func, func_closure));
+                )" + target + R"((vm);
             }
-            else{
-                vm->function_frames.push_back(create_function_frame(func));
-
-                get_current_function_frame(vm)->ip = func->code - 1; // -1 because the ip will be increased by 1
-
-                run_vm();
+            else
+            {
+                lii_rt_call(vm);
             })";
-
+                break;
+            }
+            program += R"(
+            lii_rt_call(vm);)";
             break;
         }
         case OpCode::OP_STD_LIB_CALL:
         {
-            program += R"(
-            STD_LIB_FUNCTION_INFO func = STD_LIB_FUNCTIONS_DEFINITIONS[)" + std::to_string(func->code[++i]) + R"(];)";
-            program += R"(
-            std::vector<std::any> args;
-            for (int i = 0; i < (int)func.arg_types.size(); i++)                                      
-            {                                                                                      
-                int index = (int)func.arg_types.size() - i - 1;                                      
-                if (!LII_type_matches_cpp_type(top(vm), func.arg_types[index]))                      
-                {                                                                                  
-                    vm_error("Invalid argument type. Expected: " + func.arg_types[index] + ", Got: " + get_value_type_string(top(vm))); 
-                }                                                                                  
-                args.push_back(cast_LII_type_to_cpp_type(pop(vm), func.arg_types[index]));          
-            }
-            std::reverse(args.begin(), args.end());)";
-            program += R"(
-            auto result = func.function(args, func.arg_types);)";
-            program += R"(
-            if (func.return_type != "void")
-            {
-                // check if the return value is the correct type
-                if (!any_type_check(result, func.return_type))
-                {
-                    vm_error("Invalid return type");
-                }
-
-                // cast the any type to the LII type
-                if (func.return_type == "int")
-                {
-                    push(vm, {Value_Type::NUMBER, (double)std::any_cast<int>(result)});
-                }
-                else if (func.return_type == "double")
-                {
-                    push(vm, {Value_Type::NUMBER, std::any_cast<double>(result)});
-                }
-                else if (func.return_type == "bool")
-                {
-                    push(vm, {Value_Type::BOOL, std::any_cast<bool>(result)});
-                }
-                else if (func.return_type == "std::string")
-                {
-                    push(vm, {Value_Type::STRING, std::any_cast<std::string>(result)});
-                }
-                else if (func.return_type == "std::vector<Value>")
-                {
-                    push(vm, {Value_Type::VECTOR, std::any_cast<std::vector<Value>>(result)});
-                }
-                else if (func.return_type == "Value")
-                {
-                    push(vm, std::any_cast<Value>(result));
-                }
-            })";
+            program += "\n            vm->call_std_lib(vm, " + std::to_string(func->code[++i]) + ");";
             break;
         }
 
         // Scope operations
-        case OpCode::OP_INC_SCOPE:
-        {
-            program += R"(
-            get_current_function_frame(vm)->current_scope++;                                          
-            get_current_function_frame(vm)->variables.push_back(std::map<std::string, Value>());)";
-            break;
-        }
         case OpCode::OP_DEC_SCOPE:
         {
             program += R"(
-            get_current_function_frame(vm)->current_scope--;
-            get_current_function_frame(vm)->variables.pop_back();)";
+            dec_scope(vm, )" + std::to_string(func->code[++i]) + R"();)";
             break;
         }
 
         // Output
         case OpCode::OP_PRINT:
         {
-            program += R"(
-            print_value(pop(vm));
-            std::cout << std::endl;)";
+            program += stack.ensure(1);
+            program += "\n            print_value(" + stack.top_value() + ");";
+            program += "\n            output_write(\"\\n\", 1);";
+            stack.pop();
             break;
         }
 
@@ -649,35 +1124,276 @@ void jit_compile_function(VM* vm, function* func)
 
         program += "\n}\n";
     }
-    program += "}\n";
+    if(region.osr){
+        program += "\n" + exit_code(region.end) + "\n";
+    }
+    else{
+        // main can jump to its end, which stops the program
+        program += stack.spill() + "\nlabel_" + std::to_string(region.end) + ": ;\n";
+    }
+    return header + stack.declarations() + inline_declarations + "\n" + jit_line_directives(program, source_lines, vm->source_path) + "}\n";
+}
 
-    std::ofstream out("./jit_functions/" + jit_name + ".cpp");
+std::string jit_cleanup_directory; // the artifact directory this copy of the runtime created, removed at exit
+
+void jit_remove_artifacts()
+{
+    std::error_code error;
+    std::filesystem::remove_all(jit_cleanup_directory, error);
+}
+
+#define JIT_LOCK_FILE "lock" // in every artifact directory, locked by its process for as long as it runs
+
+// Locks the lock file of the directory, returns its descriptor or -1 when another process holds the lock
+// The lock goes away with the process however it ends, so a directory whose lock can be taken is no one's
+int jit_lock_directory(const std::string &directory, bool create)
+{
+    int fd = open((directory + "/" + JIT_LOCK_FILE).c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if(fd < 0){
+        return -1;
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Removes the lii_* directories left behind by processes that were killed before their exit handler ran
+// Only directories whose lock can be taken are removed, a directory without a lock file may be one that is being created
+// The lii_perf_* directories of -jit-perf are kept on purpose and never swept
+void jit_remove_stale_artifacts()
+{
+    std::error_code error;
+    for(const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator("./jit_functions", error)){
+        std::string name = entry.path().filename().string();
+        if(name.rfind("lii_", 0) != 0 || name.rfind("lii_perf_", 0) == 0 || !entry.is_directory(error)){
+            continue;
+        }
+        int fd = jit_lock_directory(entry.path().string(), false);
+        if(fd >= 0){
+            std::filesystem::remove_all(entry.path(), error);
+            close(fd);
+        }
+    }
+}
+
+// Returns the directory the JIT artifacts of this process are written to, created on the first compile
+// Every process gets its own directory in jit_functions, so processes running in the same working directory never
+// overwrite each other's files, and the directory is removed when the process exits. The process keeps the directory's
+// lock file locked, so the directories of killed processes are found and removed by the next process that creates one
+std::string jit_artifact_directory(VM* vm)
+{
+    if(vm->jit_directory.empty()){
+        mkdir("./jit_functions", 0755); // fails when it already exists
+        jit_remove_stale_artifacts();
+        std::string pattern = std::string("./jit_functions/") + (vm->jit_perf ? "lii_perf_" : "lii_") + std::to_string(getpid()) + "_XXXXXX";
+        if(mkdtemp(pattern.data()) == nullptr){
+            vm_error("JIT: unable to create a directory for the compiled code in ./jit_functions");
+        }
+        vm->jit_directory = pattern;
+        if(jit_lock_directory(pattern, true) < 0){ // the descriptor stays open, and the lock held, until the process exits
+            vm_error("JIT: unable to lock " + pattern);
+        }
+        if(!vm->jit_perf){ // perf reads the shared libraries and their debug info after the process exited
+            jit_cleanup_directory = pattern;
+            atexit(jit_remove_artifacts);
+        }
+    }
+    return vm->jit_directory;
+}
+
+// Writes the program to <name>.cpp in the artifact directory, compiles it with clang and loads the shared library
+// Every symbol becomes compiled code in order, named in profilers by code_names, returns the index of the first one
+int clang_jit_build(VM* vm, const std::string &name, const std::string &program, const std::vector<std::string> &symbols,
+                    const std::vector<std::string> &code_names)
+{
+    std::string path = jit_artifact_directory(vm) + "/" + name;
+    std::ofstream out(path + ".cpp");
     out << program;
     out.close();
 
-    // Compile the program
+    // Compile the program, the includes are relative to the working directory
+    // clang writes a temporary file that is renamed into place, so a shared library is never loaded half written
     std::string command = "clang++-16 ";
-    command += JIT_OPTIMIZATION_LEVEL;
-    command += " -shared -fPIC -o ./jit_functions/" + jit_name + ".so " + "./jit_functions/" + jit_name + ".cpp";
-    system(command.c_str());
+    command += vm->tiering.optimization_level;
+    command += vm->jit_perf ? " -g" : "";
+    command += " -I. -shared -fPIC -o " + path + ".so.tmp " + path + ".cpp";
+    if(system(command.c_str()) != 0 || rename((path + ".so.tmp").c_str(), (path + ".so").c_str()) != 0){
+        vm_error("JIT: unable to compile " + path + ".cpp");
+    }
 
     // Load the shared library
-    void* handle = dlopen(("./jit_functions/" + jit_name + ".so").c_str(), RTLD_LAZY);
+    void* handle = dlopen((path + ".so").c_str(), RTLD_LAZY);
     if(!handle){
         std::cout << "Failed to load shared library: " << dlerror() << std::endl;
         exit(1);
     }
 
-    // Get the function pointer
-    JIT_FUNCTION jit_func = (JIT_FUNCTION)dlsym(handle, jit_name.c_str());
-    if(!jit_func){
-        std::cout << "Failed to get function pointer: " << dlerror() << std::endl;
-        exit(1);
+    // the library has its own copy of the globals, its memory counters are pointed at the executable's so -mem counts
+    // the values compiled code makes
+    memory_counters** library_memory = (memory_counters**)dlsym(handle, "value_memory");
+    if(library_memory != nullptr){
+        *library_memory = value_memory;
     }
 
-    jit_add_function(vm, jit_func);
-    func->jit_index = vm->jit_functions.size() - 1;
+    // Get the function pointers
+    int first = vm->jit_functions.size();
+    for(int i = 0; i < (int)symbols.size(); i++){
+        JIT_FUNCTION jit_func = (JIT_FUNCTION)dlsym(handle, symbols[i].c_str());
+        if(!jit_func){
+            std::cout << "Failed to get function pointer: " << dlerror() << std::endl;
+            exit(1);
+        }
+        jit_add_function(vm, jit_func);
+
+        Dl_info info;
+        const ElfW(Sym)* symbol = nullptr;
+        if(vm->jit_perf && dladdr1((void*)jit_func, &info, (void**)&symbol, RTLD_DL_SYMENT) != 0 && symbol != nullptr){
+            jit_perf_map_add(vm, (void*)jit_func, symbol->st_size, code_names[i]);
+        }
+    }
+    return first;
+}
+
+// Generates C++ for the region, compiles it with clang and loads the shared library, returns the index of the compiled code
+int clang_jit_compile(VM* vm, function* func, const jit_region &region)
+{
+    int jit_index = vm->jit_functions.size();
+    std::string jit_name = "jit_" + std::to_string(jit_index);
+    return clang_jit_build(vm, jit_name, CLANG_JIT_INCLUDES + clang_jit_source(vm, func, region, jit_index), {jit_name},
+                           {jit_code_name(func, region)});
+}
+
+// Compiles the whole functions together, into one translation unit with one clang run and one shared library
+// The headers are parsed once instead of once per function, and calls between the functions are direct calls
+// clang can optimize across. The functions go straight to the optimizing tier
+void clang_jit_compile_batch(VM* vm, const std::vector<function*> &funcs)
+{
+    jit_batch batch;
+    std::vector<function*> batched; // in index order
+    std::vector<std::string> symbols;
+    std::vector<std::string> code_names;
+    std::string declarations;
+    for(function* func : funcs){
+        if(batch.count(func)){
+            continue;
+        }
+        batch[func] = vm->jit_functions.size() + batched.size();
+        batched.push_back(func);
+        symbols.push_back("jit_" + std::to_string(batch[func]));
+        code_names.push_back(jit_code_name(func, whole_function_region(func)));
+        declarations += "extern \"C\" void " + symbols.back() + "(VM* vm);\n";
+    }
+    if(batched.empty()){
+        return;
+    }
+
+    std::string program = CLANG_JIT_INCLUDES + declarations;
+    for(function* func : batched){
+        program += clang_jit_source(vm, func, whole_function_region(func), batch[func], batch);
+    }
+    clang_jit_build(vm, "jit_batch_" + std::to_string(vm->jit_functions.size()), program, symbols, code_names);
+
+    for(function* func : batched){
+        func->jit_index = batch[func];
+        func->tier = 2;
+    }
+}
+
+// Compiles the region with the backend, returns the index of the compiled code or -1 when the backend can't compile it
+int jit_compile(VM* vm, function* func, const jit_region &region, Jit_Backend backend)
+{
+    if(backend == Jit_Backend::JIT_BACKEND_BASELINE){
+        return baseline_jit_compile(vm, func, region);
+    }
+#ifdef LII_LLVM_JIT
+    if(backend == Jit_Backend::JIT_BACKEND_LLVM){
+        return llvm_jit_compile(vm, func, region);
+    }
+#endif
+    return clang_jit_compile(vm, func, region);
+}
+
+// Compiles the whole function with the selected backend
+void jit_compile_function(VM* vm, function* func)
+{
+    func->jit_index = jit_compile(vm, func, whole_function_region(func), vm->jit_backend);
+}
+
+// Returns true when the threshold is turned on and the counter reached it
+bool jit_threshold_reached(int counter, int threshold)
+{
+    return threshold > 0 && counter >= threshold;
+}
+
+// Throws the compiled code of the function away after a failed type guard, it moves up the tiers again and the
+// next compile uses the type feedback the interpreter collected since
+void jit_invalidate_function(function* func)
+{
+    func->deopts++;
+    func->jit_index = -1;
+    func->tier = 0;
+    func->times_called = 0;
+    func->back_edges = 0;
+}
+
+// Moves the function up a tier when its call or back edge counter reached the threshold of the next tier
+// The quick tier always uses the baseline JIT, the optimizing tier the selected backend, with -jit=baseline there is only the quick tier
+// Returns true when the function was compiled, the new code is used from the next call on
+bool jit_tier_up(VM* vm, function* func)
+{
+    if(!vm->jit || func == get_function_frame(vm, 0)->func){
+        return false; // main is only run once, so it never gets compiled
+    }
+
+    const jit_tiering &tiering = vm->tiering;
+    if(func->tier < 2 && vm->jit_backend != Jit_Backend::JIT_BACKEND_BASELINE &&
+       (jit_threshold_reached(func->times_called, tiering.optimizing_calls) ||
+        jit_threshold_reached(func->back_edges, tiering.optimizing_back_edges))){
+        jit_compile_function(vm, func);
+        func->tier = 2;
+        return true;
+    }
+    if(func->tier < 1 &&
+       (jit_threshold_reached(func->times_called, tiering.quick_calls) ||
+        jit_threshold_reached(func->back_edges, tiering.quick_back_edges))){
+        func->jit_index = jit_compile(vm, func, whole_function_region(func), Jit_Backend::JIT_BACKEND_BASELINE);
+        func->tier = 1;
+        return true;
+    }
+    return false;
 }
 
 
+// On stack replacement, called by the interpreter on the backward jump at index back_edge
+// Once the loop ran enough iterations it is compiled with the selected backend, and the frame continues in the compiled
+// loop from the top of the next iteration. Nothing has to be moved: the locals and the operand stack already live in the
+// frame and the VM, which the compiled code uses directly. When the loop exits the frame ip is at the instruction to continue from
+// Returns false when the loop isn't compiled and the interpreter keeps running it
+bool jit_osr(VM* vm, function* func, int back_edge)
+{
+    if(!vm->jit){
+        return false;
+    }
+
+    osr_loop &loop = func->osr_loops[back_edge];
+    if(!loop.compiled){
+        loop.back_edges++;
+        if(!jit_threshold_reached(loop.back_edges, vm->tiering.osr_back_edges)){
+            return false;
+        }
+        // the loop runs from the instruction after the jump target up to and including the backward jump
+        jit_region region = {func->code[back_edge + 1] + 1, back_edge + instruction_size(&func->code[back_edge]), true, back_edge};
+        loop.jit_index = jit_compile(vm, func, region, vm->jit_backend);
+        loop.compiled = true;
+    }
+    if(loop.jit_index == -1){
+        return false;
+    }
+
+    jit_run_function(vm, loop.jit_index);
+    return true;
+}
+
 #endif // JIT_HPP
\ No newline at end of file
@@ -0,0 +1,179 @@
+#ifndef JIT_BATCH_HPP
+#define JIT_BATCH_HPP
+
+// Batch compilation with the clang backend, selected with -jit -jit-batch=<file>
+// The file lists the hot functions of a program with the type and call feedback the interpreter collected for them.
+// A run without the file profiles the program and writes it at exit, later runs read it and compile all the listed
+// functions together into one shared library before main starts (clang_jit_compile_batch), so they start out optimized
+// The file can also be written by hand as an ahead of time hint, one line per entry:
+//     program <path of the .cl_exe>
+//     function <constant index> <bytecode count>
+//     types <constant index> <instruction index> <bit 1 << Value_Type for every operand type seen>
+//     call <constant index> <instruction index> <constant index of the called function, -1 when it called several>
+// Functions are named by the index of their constant, so a file written for another program or an older version of it is ignored
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "VM.hpp"
+#include "Value.hpp"
+#include "virtual_machine.hpp"
+#include "jit.hpp"
+
+// Index of the function constant of every function of the program
+std::map<function*, int> jit_batch_constants(VM* vm)
+{
+    std::map<function*, int> constants;
+    for (int i = 0; i < (int)vm->constants.size(); i++)
+    {
+        if (vm->constants[i].type == Value_Type::FUNCTION)
+        {
+            constants[VALUE_AS_CLOSURE(vm->constants[i])->func] = i;
+        }
+    }
+    return constants;
+}
+
+// Returns the function of the constant, nullptr when the constant isn't a function
+function* jit_batch_function(VM* vm, int constant)
+{
+    if (constant < 0 || constant >= (int)vm->constants.size() || vm->constants[constant].type != Value_Type::FUNCTION)
+    {
+        return nullptr;
+    }
+    return VALUE_AS_CLOSURE(vm->constants[constant])->func;
+}
+
+// Reads the file, restores the feedback of the listed functions and compiles them together
+// Does nothing when the file doesn't exist or doesn't belong to the program
+void jit_batch_load(VM* vm, const std::string &path, const std::string &program)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        return;
+    }
+
+    std::vector<function*> funcs;
+    std::vector<std::tuple<function*, int, int>> types; // function, instruction, operand types
+    std::vector<std::tuple<function*, int, int>> calls; // function, instruction, target constant
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream entry(line);
+        std::string kind;
+        entry >> kind;
+        if (kind == "program")
+        {
+            std::string name;
+            std::getline(entry >> std::ws, name);
+            if (name != program)
+            {
+                return;
+            }
+            continue;
+        }
+
+        int constant = -1, a = -1, b = -1;
+        entry >> constant >> a;
+        function* func = jit_batch_function(vm, constant);
+        if (func == nullptr || entry.fail())
+        {
+            return;
+        }
+        if (kind == "function")
+        {
+            if (a != func->count)
+            {
+                return; // the function changed since the file was written
+            }
+            funcs.push_back(func);
+            continue;
+        }
+
+        entry >> b;
+        if (entry.fail() || a < 0 || a >= func->count)
+        {
+            return;
+        }
+        if (kind == "types")
+        {
+            types.push_back({func, a, b});
+        }
+        else if (kind == "call")
+        {
+            calls.push_back({func, a, b});
+        }
+    }
+
+    for (const std::tuple<function*, int, int> &site : types)
+    {
+        function* func = std::get<0>(site);
+        func->type_feedback.resize(func->count, 0);
+        func->type_feedback[std::get<1>(site)] = std::get<2>(site);
+    }
+    for (const std::tuple<function*, int, int> &site : calls)
+    {
+        function* func = std::get<0>(site);
+        func->calls.resize(func->count);
+        call_feedback &feedback = func->calls[std::get<1>(site)];
+        feedback.target = jit_batch_function(vm, std::get<2>(site));
+        feedback.polymorphic = feedback.target == nullptr;
+    }
+
+    clang_jit_compile_batch(vm, funcs);
+}
+
+// Writes the functions that reached the optimizing tier, with their feedback
+void jit_batch_save(VM* vm, const std::string &path, const std::string &program)
+{
+    std::map<function*, int> constants = jit_batch_constants(vm);
+
+    // written next to the file and renamed over it, so processes sharing the file never read half of one
+    std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream file(temporary);
+    if (!file.is_open())
+    {
+        std::cout << "Unable to write the JIT batch file " << path << std::endl;
+        return;
+    }
+    file << "program " << program << "\n";
+    for (int constant = 0; constant < (int)vm->constants.size(); constant++)
+    {
+        function* func = jit_batch_function(vm, constant);
+        if (func == nullptr || func->tier != 2)
+        {
+            continue;
+        }
+        file << "function " << constant << " " << func->count << "\n";
+        for (int i = 0; i < (int)func->type_feedback.size(); i++)
+        {
+            if (func->type_feedback[i] != 0)
+            {
+                file << "types " << constant << " " << i << " " << (int)func->type_feedback[i] << "\n";
+            }
+        }
+        for (int i = 0; i < (int)func->calls.size(); i++)
+        {
+            const call_feedback &feedback = func->calls[i];
+            if (feedback.target == nullptr && !feedback.polymorphic)
+            {
+                continue;
+            }
+            int target = feedback.polymorphic || !constants.count(feedback.target) ? -1 : constants[feedback.target];
+            file << "call " << constant << " " << i << " " << target << "\n";
+        }
+    }
+    file.close();
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::cout << "Unable to write the JIT batch file " << path << std::endl;
+        remove(temporary.c_str());
+    }
+}
+
+#endif // JIT_BATCH_HPP
@@ -0,0 +1,158 @@
+#ifndef JIT_RUNTIME_HPP
+#define JIT_RUNTIME_HPP
+
+// Functions called by the machine code of the in process JIT backends (llvm_jit.hpp and baseline_jit.hpp)
+// They have C linkage so the compiled code can call them by address, and run the instructions with the same helpers as the interpreter
+
+#include "VM.hpp"
+#include "Value.hpp"
+#include "virtual_machine.hpp"
+
+// Runtime functions ------------------------------------------------
+
+// Runs a single instruction with the interpreter, used for every instruction that doesn't change the control flow
+// and doesn't have its own runtime function
+extern "C" void lii_rt_execute(VM* vm, CODE_SIZE* ip)
+{
+    get_current_function_frame(vm)->ip = ip;
+    vm_loop(vm, false);
+}
+
+extern "C" void lii_rt_load_constant(VM* vm, int index)
+{
+    push(vm, get_vm_constant(vm, index));
+}
+
+extern "C" void lii_rt_load_var(VM* vm, int slot)
+{
+    push(vm, get_local(vm, slot));
+}
+
+extern "C" void lii_rt_store_var(VM* vm, int slot)
+{
+    set_local(vm, slot, pop(vm));
+}
+
+extern "C" void lii_rt_load_global(VM* vm, int index)
+{
+    push(vm, get_global(vm, index));
+}
+
+extern "C" void lii_rt_store_global(VM* vm, int index)
+{
+    set_global(vm, index, pop(vm));
+}
+
+extern "C" void lii_rt_load_upvalue(VM* vm, int index)
+{
+    push(vm, get_upvalue(vm, index));
+}
+
+extern "C" void lii_rt_update_upvalue(VM* vm, int index)
+{
+    update_upvalue(vm, index, pop(vm));
+}
+
+extern "C" void lii_rt_append_var(VM* vm, int slot)
+{
+    append_local(vm, slot, pop(vm));
+}
+
+extern "C" void lii_rt_append_global(VM* vm, int index)
+{
+    append_global(vm, index, pop(vm));
+}
+
+extern "C" void lii_rt_dec_scope(VM* vm, int first_slot)
+{
+    dec_scope(vm, first_slot);
+}
+
+extern "C" bool lii_rt_pop_condition(VM* vm)
+{
+    return VALUE_AS_BOOL(pop(vm));
+}
+
+extern "C" void lii_rt_call(VM* vm)
+{
+    std::shared_ptr<closure> func_closure = VALUE_AS_CLOSURE(pop(vm));
+    function* func = func_closure->func;
+
+    vm->function_frames.push_back(create_function_frame(func, func_closure));
+    func->times_called++;
+    jit_tier_up(vm, func);
+    if (func->jit_index != -1)
+    {
+        jit_run_function(vm, func->jit_index);
+    }
+    else
+    {
+        run_function(vm);
+    }
+}
+
+// Called before every backward jump, the loop keeps running in the current code
+extern "C" void lii_rt_back_edge(VM* vm, function* func)
+{
+    func->back_edges++;
+    jit_tier_up(vm, func);
+}
+
+// lii_rt_call for the quick tier, which also records the function called at the call instruction
+extern "C" void lii_rt_call_site(VM* vm, int index)
+{
+    record_call_feedback(vm, index, VALUE_AS_FUNCTION(top(vm)));
+    lii_rt_call(vm);
+}
+
+extern "C" void lii_rt_return(VM* vm)
+{
+    pop_function_frame(vm); // return value is already on the stack
+}
+
+// Leaves a loop compiled for on stack replacement, the interpreter continues the frame at the instruction
+extern "C" void lii_rt_osr_exit(VM* vm, int index)
+{
+    get_current_function_frame(vm)->ip = &get_current_function_frame(vm)->func->code[index] - 1; // the interpreter increases the ip
+}
+
+// A type guard of the compiled function failed, the interpreter runs the rest of the frame starting at the instruction
+extern "C" void lii_rt_deopt(VM* vm, int index)
+{
+    function_frame* frame = get_current_function_frame(vm);
+    jit_invalidate_function(frame->func);
+    frame->ip = &frame->func->code[index];
+    run_frame(vm);
+}
+
+// A type guard of a loop compiled for OSR failed, the loop is compiled again once it has run enough iterations
+extern "C" void lii_rt_osr_deopt(VM* vm, int index, int back_edge)
+{
+    function* func = get_current_function_frame(vm)->func;
+    func->deopts++;
+    func->osr_loops[back_edge] = osr_loop();
+    lii_rt_osr_exit(vm, index);
+}
+
+// A type guard in a function inlined by the JIT failed, the frame of the callee is created with its locals and
+// the interpreter runs the rest of it, the result is left on the stack for the compiled caller
+extern "C" void lii_rt_inline_deopt(VM* vm, function* callee, Value* locals, int index)
+{
+    callee->deopts++;
+    function_frame* frame = create_function_frame(callee);
+    for (int slot = 0; slot < callee->local_count; slot++)
+    {
+        frame->locals[slot] = std::move(locals[slot]);
+    }
+    frame->ip = &callee->code[index];
+    vm->function_frames.push_back(frame);
+    run_frame(vm);
+}
+
+extern "C" void lii_rt_end_of_function(VM* vm)
+{
+    vm_error("End of function reached without return");
+}
+// -------------------------------------------------------------------
+
+#endif // JIT_RUNTIME_HPP
@@ -0,0 +1,308 @@
+#ifndef LLVM_JIT_HPP
+#define LLVM_JIT_HPP
+
+// In process JIT backend, lowers the bytecode of a function straight to LLVM IR and compiles it with ORC LLJIT
+// Only built with make build_bytecode_llvm, selected at runtime with -jit=llvm
+// Unlike jit_compile_function nothing is written to disk and no compiler is started, the compiled code calls
+// back into the runtime functions in jit_runtime.hpp, which live in the running VM
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "VM.hpp"
+#include "Value.hpp"
+#include "opcodes.hpp"
+#include "virtual_machine.hpp"
+#include "jit.hpp"
+#include "jit_runtime.hpp"
+
+// With -jit-perf, adds the functions of every object the JIT loads to the perf map (jit_perf_map_add)
+struct llvm_perf_listener : public llvm::JITEventListener
+{
+    VM* vm = nullptr;
+    std::map<std::string, std::string> code_names; // name in profilers of every generated function
+
+    void notifyObjectLoaded(ObjectKey key, const llvm::object::ObjectFile &object, const llvm::RuntimeDyld::LoadedObjectInfo &info) override
+    {
+        // the object for debugging has the addresses the sections were loaded at
+        llvm::object::OwningBinary<llvm::object::ObjectFile> loaded = info.getObjectForDebug(object);
+        if (loaded.getBinary() == nullptr)
+        {
+            return;
+        }
+        for (const std::pair<llvm::object::SymbolRef, uint64_t> &symbol : llvm::object::computeSymbolSizes(*loaded.getBinary()))
+        {
+            llvm::Expected<llvm::object::SymbolRef::Type> type = symbol.first.getType();
+            llvm::Expected<llvm::StringRef> name = symbol.first.getName();
+            llvm::Expected<uint64_t> address = symbol.first.getAddress();
+            if (!type || !name || !address)
+            {
+                llvm::consumeError(type.takeError());
+                llvm::consumeError(name.takeError());
+                llvm::consumeError(address.takeError());
+                continue;
+            }
+            if (*type == llvm::object::SymbolRef::ST_Function && code_names.count(name->str()))
+            {
+                jit_perf_map_add(vm, (void*)*address, symbol.second, code_names[name->str()]);
+            }
+        }
+    }
+};
+
+// Compiler state, created the first time a function is compiled
+std::unique_ptr<llvm::orc::LLJIT> llvm_jit;
+llvm_perf_listener llvm_perf;
+
+void llvm_jit_error(llvm::Error error)
+{
+    std::string message;
+    llvm::raw_string_ostream stream(message);
+    stream << error;
+    vm_error("LLVM JIT: " + stream.str());
+}
+
+void llvm_jit_init(VM* vm)
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    llvm::orc::LLJITBuilder builder;
+    if (vm->jit_perf)
+    {
+        // only the RuntimeDyld linking layer reports the objects it loads to event listeners
+        llvm_perf.vm = vm;
+        builder.setObjectLinkingLayerCreator([](llvm::orc::ExecutionSession &session, const llvm::Triple &)
+        {
+            auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(session, []()
+            {
+                return std::make_unique<llvm::SectionMemoryManager>();
+            });
+            layer->registerJITEventListener(llvm_perf);
+            return llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>>(std::move(layer));
+        });
+    }
+    auto jit = builder.create();
+    if (!jit)
+    {
+        llvm_jit_error(jit.takeError());
+    }
+    llvm_jit = std::move(*jit);
+
+    // The compiled code links against the runtime functions of this process
+    llvm::orc::MangleAndInterner mangle(llvm_jit->getExecutionSession(), llvm_jit->getDataLayout());
+    llvm::orc::SymbolMap symbols;
+    auto add_symbol = [&](const char* name, void* address)
+    {
+        symbols[mangle(name)] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(address), llvm::JITSymbolFlags::Exported);
+    };
+    add_symbol("lii_rt_execute", (void*)&lii_rt_execute);
+    add_symbol("lii_rt_load_constant", (void*)&lii_rt_load_constant);
+    add_symbol("lii_rt_load_var", (void*)&lii_rt_load_var);
+    add_symbol("lii_rt_store_var", (void*)&lii_rt_store_var);
+    add_symbol("lii_rt_load_global", (void*)&lii_rt_load_global);
+    add_symbol("lii_rt_store_global", (void*)&lii_rt_store_global);
+    add_symbol("lii_rt_load_upvalue", (void*)&lii_rt_load_upvalue);
+    add_symbol("lii_rt_update_upvalue", (void*)&lii_rt_update_upvalue);
+    add_symbol("lii_rt_append_var", (void*)&lii_rt_append_var);
+    add_symbol("lii_rt_append_global", (void*)&lii_rt_append_global);
+    add_symbol("lii_rt_dec_scope", (void*)&lii_rt_dec_scope);
+    add_symbol("lii_rt_pop_condition", (void*)&lii_rt_pop_condition);
+    add_symbol("lii_rt_call", (void*)&lii_rt_call);
+    add_symbol("lii_rt_osr_exit", (void*)&lii_rt_osr_exit);
+    add_symbol("lii_rt_return", (void*)&lii_rt_return);
+    add_symbol("lii_rt_end_of_function", (void*)&lii_rt_end_of_function);
+
+    if (llvm::Error error = llvm_jit->getMainJITDylib().define(llvm::orc::absoluteSymbols(symbols)))
+    {
+        llvm_jit_error(std::move(error));
+    }
+}
+
+int llvm_jit_compile(VM* vm, function* func, const jit_region &region)
+{
+    if (!llvm_jit)
+    {
+        llvm_jit_init(vm);
+    }
+
+    std::string jit_name = "jit_" + std::to_string(vm->jit_functions.size());
+
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto module = std::make_unique<llvm::Module>(jit_name, *context);
+    module->setDataLayout(llvm_jit->getDataLayout());
+    llvm::IRBuilder<> builder(*context);
+
+    llvm::Type* void_type = builder.getVoidTy();
+    llvm::Type* vm_type = builder.getInt8PtrTy();
+    llvm::Type* ip_type = llvm::PointerType::getUnqual(builder.getInt16Ty());
+    llvm::Type* int_type = builder.getInt32Ty();
+
+    auto declare = [&](const char* name, llvm::Type* return_type, std::vector<llvm::Type*> args)
+    {
+        return module->getOrInsertFunction(name, llvm::FunctionType::get(return_type, args, false));
+    };
+    llvm::FunctionCallee rt_execute = declare("lii_rt_execute", void_type, {vm_type, ip_type});
+    llvm::FunctionCallee rt_pop_condition = declare("lii_rt_pop_condition", builder.getInt1Ty(), {vm_type});
+    llvm::FunctionCallee rt_call = declare("lii_rt_call", void_type, {vm_type});
+    llvm::FunctionCallee rt_return = declare("lii_rt_return", void_type, {vm_type});
+    llvm::FunctionCallee rt_end_of_function = declare("lii_rt_end_of_function", void_type, {vm_type});
+    llvm::FunctionCallee rt_osr_exit = declare("lii_rt_osr_exit", void_type, {vm_type, int_type});
+
+    // instructions with one operand that have their own runtime function
+    std::map<CODE_SIZE, llvm::FunctionCallee> operand_functions = {
+        {OpCode::OP_LOAD, declare("lii_rt_load_constant", void_type, {vm_type, int_type})},
+        {OpCode::OP_LOAD_VAR, declare("lii_rt_load_var", void_type, {vm_type, int_type})},
+        {OpCode::OP_STORE_VAR, declare("lii_rt_store_var", void_type, {vm_type, int_type})},
+        {OpCode::OP_LOAD_GLOBAL, declare("lii_rt_load_global", void_type, {vm_type, int_type})},
+        {OpCode::OP_STORE_GLOBAL, declare("lii_rt_store_global", void_type, {vm_type, int_type})},
+        {OpCode::OP_LOAD_UPVALUE, declare("lii_rt_load_upvalue", void_type, {vm_type, int_type})},
+        {OpCode::OP_UPDATE_UPVALUE, declare("lii_rt_update_upvalue", void_type, {vm_type, int_type})},
+        {OpCode::OP_APPEND_VAR, declare("lii_rt_append_var", void_type, {vm_type, int_type})},
+        {OpCode::OP_APPEND_GLOBAL, declare("lii_rt_append_global", void_type, {vm_type, int_type})},
+        {OpCode::OP_DEC_SCOPE, declare("lii_rt_dec_scope", void_type, {vm_type, int_type})},
+    };
+
+    llvm::Function* llvm_func = llvm::Function::Create(llvm::FunctionType::get(void_type, {vm_type}, false),
+                                                       llvm::Function::ExternalLinkage, jit_name, module.get());
+    llvm::Value* vm_arg = llvm_func->getArg(0);
+
+    // The entry block can't be a jump target, so it only branches to the first instruction
+    llvm::BasicBlock* entry = llvm::BasicBlock::Create(*context, "entry", llvm_func);
+
+    // One block for every instruction, jumps branch straight to the block of their target
+    std::vector<llvm::BasicBlock*> blocks(func->count + 1, nullptr);
+    for (int i = region.start; i < region.end; i += instruction_size(&func->code[i]))
+    {
+        blocks[i] = llvm::BasicBlock::Create(*context, "label_" + std::to_string(i), llvm_func);
+    }
+
+    // returns a block that hands the frame back to the interpreter at the instruction, for jumps out of an OSR region
+    auto exit_block = [&](int index)
+    {
+        llvm::BasicBlock* block = llvm::BasicBlock::Create(*context, "exit_" + std::to_string(index), llvm_func);
+        llvm::IRBuilder<> exit_builder(block);
+        exit_builder.CreateCall(rt_osr_exit, {vm_arg, exit_builder.getInt32(index)});
+        exit_builder.CreateRetVoid();
+        return block;
+    };
+    if (region.osr)
+    {
+        blocks[region.end] = exit_block(region.end);
+    }
+    else
+    {
+        blocks[func->count] = llvm::BasicBlock::Create(*context, "end_of_function", llvm_func);
+    }
+
+    // returns the block of the instruction after the one at i
+    auto next_block = [&](int i)
+    {
+        return blocks[i + instruction_size(&func->code[i])];
+    };
+    // jump targets are stored as the index before the target, because the interpreter increases the ip after the jump
+    auto jump_block = [&](int i)
+    {
+        int target = func->code[i + 1] + 1;
+        if (region.osr && target >= 0 && target <= func->count && blocks[target] == nullptr && !jit_region_contains(region, target))
+        {
+            blocks[target] = exit_block(target);
+        }
+        if (target < 0 || target > func->count || blocks[target] == nullptr)
+        {
+            vm_error("Invalid jump index " + std::to_string(func->code[i + 1]));
+        }
+        return blocks[target];
+    };
+
+    builder.SetInsertPoint(entry);
+    builder.CreateBr(blocks[region.start]);
+
+    for (int i = region.start; i < region.end; i += instruction_size(&func->code[i]))
+    {
+        builder.SetInsertPoint(blocks[i]);
+        CODE_SIZE op = func->code[i];
+        switch (op)
+        {
+        case OpCode::OP_JUMP:
+            builder.CreateBr(jump_block(i));
+            break;
+        case OpCode::OP_JUMP_IF_FALSE:
+        {
+            llvm::Value* condition = builder.CreateCall(rt_pop_condition, {vm_arg});
+            builder.CreateCondBr(condition, next_block(i), jump_block(i));
+            break;
+        }
+        case OpCode::OP_RETURN:
+            if (region.osr)
+            {
+                builder.CreateCall(rt_osr_exit, {vm_arg, builder.getInt32(i)}); // the interpreter returns from the function
+                builder.CreateRetVoid();
+                break;
+            }
+            builder.CreateCall(rt_return, {vm_arg});
+            builder.CreateRetVoid();
+            break;
+        case OpCode::OP_FUNCTION_CALL:
+            builder.CreateCall(rt_call, {vm_arg});
+            builder.CreateBr(next_block(i));
+            break;
+        default:
+            if (operand_functions.count(op))
+            {
+                builder.CreateCall(operand_functions[op], {vm_arg, builder.getInt32(func->code[i + 1])});
+            }
+            else
+            {
+                llvm::Value* ip = builder.CreateIntToPtr(builder.getInt64((uint64_t)&func->code[i]), ip_type);
+                builder.CreateCall(rt_execute, {vm_arg, ip});
+            }
+            builder.CreateBr(next_block(i));
+            break;
+        }
+    }
+
+    if (!region.osr)
+    {
+        builder.SetInsertPoint(blocks[func->count]);
+        builder.CreateCall(rt_end_of_function, {vm_arg});
+        builder.CreateRetVoid();
+    }
+
+    std::string verify_errors;
+    llvm::raw_string_ostream verify_stream(verify_errors);
+    if (llvm::verifyFunction(*llvm_func, &verify_stream))
+    {
+        vm_error("LLVM JIT: invalid IR for function " + func->name + ": " + verify_stream.str());
+    }
+
+    if (llvm::Error error = llvm_jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(context))))
+    {
+        llvm_jit_error(std::move(error));
+    }
+
+    llvm_perf.code_names[jit_name] = jit_code_name(func, region);
+    auto symbol = llvm_jit->lookup(jit_name);
+    if (!symbol)
+    {
+        llvm_jit_error(symbol.takeError());
+    }
+
+    jit_add_function(vm, (JIT_FUNCTION)symbol->getAddress());
+    return vm->jit_functions.size() - 1;
+}
+
+#endif // LLVM_JIT_HPP
@@ -1,4 +1,5 @@
 #include <chrono>
+#include <climits>
 #include <iostream>
 #include <map>
 #include <vector>
@@ -11,6 +12,26 @@
 #include "bytecode_generator.hpp"
 #include "virtual_machine.hpp"
 #include "cl_exe_file.hpp"
+#include "aot.hpp"
+
+// Returns true when arg is "name=value" and stores the value
+bool flag_value(const std::string &arg, const std::string &name, std::string &value) {
+    if(arg.rfind(name + "=", 0) != 0) {
+        return false;
+    }
+    value = arg.substr(name.size() + 1);
+    return true;
+}
+
+// Parses the value of a JIT threshold flag, exits when it isn't a non negative number that fits in an int
+int threshold_value(const std::string &name, const std::string &value) {
+    int number;
+    if(value.empty() || value.find_first_not_of("0123456789") != std::string::npos || !parse_int(value, number)) {
+        std::cout << name << " expects a non negative number up to " << INT_MAX << ", got '" << value << "'" << std::endl;
+        exit(1);
+    }
+    return number;
+}
 
 // TODO: MAKE NULL BE ABLE TO BE COMPARABLE (==, !=)
 // TODO: ADD 
@@ -20,7 +41,8 @@
 int main(int argc, char *argv[]) {
     // Check if the user has provided the input file and verbosity flag
     if(argc < 2) {
-        std::cout << "Usage: " << argv[0] << " <input_file.cl> -d -v [-vT -vP -vB -vV] -jit" << std::endl;
+        std::cout << "Usage: " << argv[0] << " <input_file.cl> -d -v [-vT -vP -vB -vV] -jit[=clang|=llvm|=baseline]"
+                  << " [-jit-quick-calls=N -jit-quick-loops=N -jit-opt-calls=N -jit-opt-loops=N -jit-osr-loops=N -jit-opt-level=-ON -jit-batch=FILE -jit-perf] [-aot=OUTPUT] [-profile] [-sample[=HZ]] [-stats[=dynamic]] [-mem]" << std::endl;
         return 1;
     }
     std::string input_file = argv[1];
@@ -40,6 +62,17 @@ int main(int argc, char *argv[]) {
     bool time = false;
 
     bool jit = false;
+    Jit_Backend jit_backend = Jit_Backend::JIT_BACKEND_CLANG;
+    jit_tiering tiering;
+    std::string jit_batch_file;
+    bool jit_perf = false;
+    bool profile = false;
+    int sample_hz = 0;
+    bool stats = false;
+    bool dynamic_stats = false;
+    bool mem = false;
+    std::string aot_output;
+    std::string value;
 
     // Check for flags
     for(int i = 2; i < argc; i++) {
@@ -60,10 +93,70 @@ int main(int argc, char *argv[]) {
             debug = true;
         } else if(std::string(argv[i]) == "-t"){
             time = true;
-        } else if(std::string(argv[i]) == "-jit"){
+        } else if(std::string(argv[i]) == "-jit" || std::string(argv[i]) == "-jit=clang"){
             jit = true;
+        } else if(std::string(argv[i]) == "-jit=baseline"){
+            jit = true;
+            jit_backend = Jit_Backend::JIT_BACKEND_BASELINE;
+        } else if(std::string(argv[i]) == "-jit=llvm"){
+#ifdef LII_LLVM_JIT
+            jit = true;
+            jit_backend = Jit_Backend::JIT_BACKEND_LLVM;
+#else
+            std::cout << "The LLVM JIT backend isn't part of this build, build with 'make build_bytecode_llvm'" << std::endl;
+            return 1;
+#endif
+        } else if(flag_value(argv[i], "-jit-quick-calls", value)){
+            tiering.quick_calls = threshold_value("-jit-quick-calls", value);
+        } else if(flag_value(argv[i], "-jit-quick-loops", value)){
+            tiering.quick_back_edges = threshold_value("-jit-quick-loops", value);
+        } else if(flag_value(argv[i], "-jit-opt-calls", value)){
+            tiering.optimizing_calls = threshold_value("-jit-opt-calls", value);
+        } else if(flag_value(argv[i], "-jit-opt-loops", value)){
+            tiering.optimizing_back_edges = threshold_value("-jit-opt-loops", value);
+        } else if(flag_value(argv[i], "-jit-osr-loops", value)){
+            tiering.osr_back_edges = threshold_value("-jit-osr-loops", value);
+        } else if(flag_value(argv[i], "-jit-opt-level", value)){
+            // passed to the shell with the clang command, so only accept an optimization flag
+            if(value.rfind("-O", 0) != 0 || value.find_first_of(" ;&|$`'\"") != std::string::npos){
+                std::cout << "-jit-opt-level expects an optimization flag like -O2, got '" << value << "'" << std::endl;
+                return 1;
+            }
+            tiering.optimization_level = value;
+        } else if(std::string(argv[i]) == "-profile"){
+            profile = true;
+        } else if(std::string(argv[i]) == "-sample"){
+            sample_hz = SAMPLER_HZ;
+        } else if(flag_value(argv[i], "-sample", value)){
+            sample_hz = threshold_value("-sample", value);
+            if(sample_hz == 0 || sample_hz > 1000000){
+                std::cout << "-sample expects between 1 and 1000000 samples per second, got '" << value << "'" << std::endl;
+                return 1;
+            }
+        } else if(std::string(argv[i]) == "-stats" || std::string(argv[i]) == "-stats=static"){
+            stats = true;
+        } else if(std::string(argv[i]) == "-stats=dynamic"){
+            stats = true;
+            dynamic_stats = true;
+        } else if(std::string(argv[i]) == "-mem"){
+            mem = true;
+        } else if(std::string(argv[i]) == "-jit-perf"){
+            jit_perf = true;
+        } else if(flag_value(argv[i], "-jit-batch", value)){
+            jit_batch_file = value;
+        } else if(flag_value(argv[i], "-aot", value)){
+            // passed to the shell with the clang command
+            if(value.empty() || value.find_first_of(" ;&|$`'\"") != std::string::npos){
+                std::cout << "-aot expects the path of the output file, got '" << value << "'" << std::endl;
+                return 1;
+            }
+            aot_output = value;
         }
     }
+    if(!jit_batch_file.empty() && (!jit || jit_backend != Jit_Backend::JIT_BACKEND_CLANG)){
+        std::cout << "-jit-batch compiles with the clang backend, use it with -jit" << std::endl;
+        return 1;
+    }
 
     // set the directory path for the files.hpp functions and tokenize the input when there are include statements
     input_file = "./" + input_file;
@@ -113,6 +206,10 @@ int main(int argc, char *argv[]) {
         display_variables();
         std::cout << std::endl;
 
+        std::cout << "Globals:" << std::endl;
+        display_globals();
+        std::cout << std::endl;
+
         std::cout << "Bytecode:" << std::endl;
         std::cout << "Main Function: " << std::endl;
         display_bytecode(func);
@@ -122,10 +219,34 @@ int main(int argc, char *argv[]) {
     // Free the memory
     delete ast;
 
+    input_file = input_file.substr(0, input_file.find_last_of(".")) + ".cl_exe";
+
+    // Statistics of the generated bytecode
+    if(stats) {
+        std::string stats_file = stats_path(input_file, ".stats.json");
+        stats_write(stats_static(func, constants, call_arguments), constants, input_file, stats_file, false);
+        std::cout << "Bytecode statistics written to " << stats_file << std::endl;
+    }
+
+    // Compile the whole program to native code instead of running it
+    if(!aot_output.empty()) {
+        start = std::chrono::high_resolution_clock::now();
+        if(!aot_compile("./" + input_file, aot_output, tiering)) {
+            std::cout << "Ahead of time compilation of " << input_file << " failed" << std::endl;
+            return 1;
+        }
+        end = std::chrono::high_resolution_clock::now();
+        if (time) {
+            std::cout << "Ahead of time compilation took "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+                      << " milliseconds." << std::endl;
+        }
+        return 0;
+    }
+
     // Interpret the bytecode
     start = std::chrono::high_resolution_clock::now();
-    input_file = input_file.substr(0, input_file.find_last_of(".")) + ".cl_exe";
-    interpret_bytecode("./" + input_file, verboseV, debug, jit);
+    interpret_bytecode("./" + input_file, verboseV, debug, jit, jit_backend, tiering, jit_batch_file, jit_perf, profile, sample_hz, dynamic_stats, mem);
     end = std::chrono::high_resolution_clock::now();
     if (verboseV || time) {
         std::cout << "Interpretation took "
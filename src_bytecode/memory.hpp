@@ -0,0 +1,164 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+// Memory use of the VM, printed when the program ends with -mem and returned by $vm_stats() as a struct:
+//     string_allocations, string_bytes      strings made or copied that needed a buffer, and the bytes of those buffers
+//     vector_allocations, vector_bytes      the same for vectors, elements included in their own counts
+//     struct_allocations, struct_bytes      the same for the fields of structs
+//     frames, frame_bytes                   function frames created, with their local variables
+//     stack_peak, stack_capacity            most values the stack held, and the values it has room for
+//     constants, constant_bytes             values in the constant pool, and the bytes they and the code of the functions hold
+//     gc_collections                        runs of the cycle collector (gc.hpp)
+//     gc_freed_closures, gc_freed_upvalues  closures and upvalues it freed
+//     gc_pause_total_us, gc_pause_max_us    time the program was stopped by it, in all and by the longest collection
+// The counters (value_memory in Value.hpp) are only kept with -mem or when the program calls $vm_stats(), other programs
+// only pay a branch per value copied
+
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Value.hpp"
+#include "VM.hpp"
+#include "opcodes.hpp"
+#include "./std_lib/std_lib.hpp"
+
+// Starts counting, before the VM is initialized
+void memory_start()
+{
+    static memory_counters counters;
+    counters = memory_counters();
+    value_memory = &counters;
+}
+
+// True when the code of the program calls the std lib function, looked for before the program runs
+bool program_calls_std_lib(cl_exe* exe, const std::string &name)
+{
+    int index = -1;
+    for (int i = 0; i < (int)STD_LIB_FUNCTIONS_DEFINITIONS.size(); i++)
+    {
+        if (STD_LIB_FUNCTIONS_DEFINITIONS[i].name == name)
+        {
+            index = i;
+        }
+    }
+
+    std::vector<function*> functions = {exe->main};
+    for (const Value &constant : exe->constants)
+    {
+        if (constant.type == Value_Type::FUNCTION)
+        {
+            functions.push_back(std::get<std::shared_ptr<closure>>(constant.data)->func);
+        }
+    }
+    for (function* func : functions)
+    {
+        for (int i = 0; i < func->count; i += instruction_size(&func->code[i]))
+        {
+            if (func->code[i] == OpCode::OP_STD_LIB_CALL && func->code[i + 1] == index)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Bytes held by the value outside of itself, what it points to included
+uint64_t value_heap_bytes(const Value &value)
+{
+    uint64_t bytes = 0;
+    if (const std::string* str = std::get_if<std::string>(&value.data))
+    {
+        bytes += str->capacity() > SHORT_STRING_CAPACITY ? str->capacity() + 1 : 0;
+    }
+    else if (const std::vector<Value>* vec = std::get_if<std::vector<Value>>(&value.data))
+    {
+        bytes += vec->capacity() * sizeof(Value);
+        for (const Value &element : *vec)
+        {
+            bytes += value_heap_bytes(element);
+        }
+    }
+    else if (const struct_object* obj = std::get_if<struct_object>(&value.data))
+    {
+        bytes += obj->fields.capacity() * sizeof(Value);
+        for (const Value &field : obj->fields)
+        {
+            bytes += value_heap_bytes(field);
+        }
+    }
+    return bytes;
+}
+
+// Bytes of the constant pool, the bytecode and line table of the function constants included
+uint64_t constant_bytes(VM* vm)
+{
+    uint64_t bytes = vm->constants.capacity() * sizeof(Value);
+    for (const Value &constant : vm->constants)
+    {
+        bytes += value_heap_bytes(constant);
+        if (constant.type == Value_Type::FUNCTION)
+        {
+            function* func = VALUE_AS_CLOSURE(constant)->func;
+            bytes += sizeof(function) + func->capacity * sizeof(CODE_SIZE) + func->lines.capacity() * sizeof(int);
+        }
+    }
+    return bytes;
+}
+
+// The counters by name, in the order they are reported
+std::vector<std::pair<std::string, uint64_t>> memory_counters_of(VM* vm)
+{
+    const memory_counters &counters = value_memory != nullptr ? *value_memory : memory_counters();
+    return {
+        {"string_allocations", counters.allocations[MEMORY_STRING]},
+        {"string_bytes", counters.bytes[MEMORY_STRING]},
+        {"vector_allocations", counters.allocations[MEMORY_VECTOR]},
+        {"vector_bytes", counters.bytes[MEMORY_VECTOR]},
+        {"struct_allocations", counters.allocations[MEMORY_STRUCT]},
+        {"struct_bytes", counters.bytes[MEMORY_STRUCT]},
+        {"frames", counters.frames},
+        {"frame_bytes", counters.frame_bytes},
+        {"stack_peak", (uint64_t)vm->stack_peak},
+        {"stack_capacity", (uint64_t)vm->stack_capacity},
+        {"constants", vm->constants.size()},
+        {"constant_bytes", constant_bytes(vm)},
+        {"gc_collections", vm->gc.collections},
+        {"gc_freed_closures", vm->gc.freed_closures},
+        {"gc_freed_upvalues", vm->gc.freed_upvalues},
+        {"gc_pause_total_us", vm->gc.pause_total_ns / 1000},
+        {"gc_pause_max_us", vm->gc.pause_max_ns / 1000},
+    };
+}
+
+// $vm_stats(), the counters as a struct with a number field for each
+Value vm_stats()
+{
+    std::vector<std::pair<std::string, uint64_t>> counters = memory_counters_of(&vm);
+    struct_object obj{vm.empty_shape, {}};
+    for (const std::pair<std::string, uint64_t> &counter : counters)
+    {
+        obj.layout = shape_add_field(obj.layout, counter.first);
+        obj.fields.push_back(Value(Value_Type::NUMBER, (double)counter.second));
+    }
+    return Value(Value_Type::STRUCT, obj);
+}
+
+// Prints the counters, for -mem
+void memory_report(VM* vm)
+{
+    std::cout << "Memory:" << std::endl;
+    for (const std::pair<std::string, uint64_t> &counter : memory_counters_of(vm))
+    {
+        std::cout << "    " << std::left << std::setw(20) << counter.first << counter.second << std::endl;
+    }
+    if (vm->gc.collections != 0)
+    {
+        std::cout << "    " << std::left << std::setw(20) << "gc_pause_mean_us"
+                  << vm->gc.pause_total_ns / vm->gc.collections / 1000.0 << std::endl;
+    }
+}
+
+#endif // MEMORY_HPP
@@ -0,0 +1,96 @@
+#ifndef NUMBERS_HPP
+#define NUMBERS_HPP
+
+// Conversions between numbers and text, with std::to_chars and std::from_chars
+// They don't allocate, don't depend on the locale and don't throw
+// Numbers are shown with at most 6 decimals and no trailing zeros: 0.5, 3, 0.333333, 100000000000000000000
+// Number constants are stored in .cl_exe files in the shortest form that reads back as the same double
+
+#include <cctype>
+#include <charconv>
+#include <string>
+#include <string_view>
+
+#define NUMBER_TEXT_SIZE 330 // longest number written, 309 digits of the largest double, the sign and 7 decimals
+
+// Writes the number to text, which has room for NUMBER_TEXT_SIZE characters, and returns its length
+// std::to_chars rounds exactly like the %f of std::to_string, the decimals that are 0 are then dropped
+int format_number(double number, char* text)
+{
+    char* end = std::to_chars(text, text + NUMBER_TEXT_SIZE, number, std::chars_format::fixed, 6).ptr;
+    int length = end - text;
+    for (int i = 0; i < length; i++)
+    {
+        if (text[i] == '.')
+        {
+            while (text[length - 1] == '0')
+            {
+                length--;
+            }
+            if (text[length - 1] == '.')
+            {
+                length--;
+            }
+            break;
+        }
+    }
+    return length;
+}
+
+std::string number_to_string(double number)
+{
+    char text[NUMBER_TEXT_SIZE];
+    return std::string(text, format_number(number, text));
+}
+
+// Appends the number as format_number writes it, "x = " + n builds the string in place
+void append_number(std::string &str, double number)
+{
+    char text[NUMBER_TEXT_SIZE];
+    str.append(text, format_number(number, text));
+}
+
+void append_int(std::string &str, int number)
+{
+    char text[16];
+    str.append(text, std::to_chars(text, text + sizeof(text), number).ptr - text);
+}
+
+// Shortest text that parses back to exactly the same number, 0.1 stays 0.1 and 1e-7 isn't rounded to 0
+std::string number_to_exact_string(double number)
+{
+    char text[NUMBER_TEXT_SIZE];
+    return std::string(text, std::to_chars(text, text + NUMBER_TEXT_SIZE, number).ptr - text);
+}
+
+// Leading whitespace and a '+' are skipped like std::stod does
+const char* skip_number_prefix(const char* begin, const char* end)
+{
+    while (begin != end && std::isspace((unsigned char)*begin))
+    {
+        begin++;
+    }
+    if (begin != end && *begin == '+' && begin + 1 != end && begin[1] != '-')
+    {
+        begin++;
+    }
+    return begin;
+}
+
+// Parses the number at the start of text, what follows it is ignored
+// Returns false when the text doesn't start with a number or the number is out of range
+bool parse_number(std::string_view text, double &number)
+{
+    const char* begin = skip_number_prefix(text.data(), text.data() + text.size());
+    std::from_chars_result result = std::from_chars(begin, text.data() + text.size(), number);
+    return result.ec == std::errc();
+}
+
+bool parse_int(std::string_view text, int &number)
+{
+    const char* begin = skip_number_prefix(text.data(), text.data() + text.size());
+    std::from_chars_result result = std::from_chars(begin, text.data() + text.size(), number);
+    return result.ec == std::errc();
+}
+
+#endif // NUMBERS_HPP
@@ -100,29 +100,44 @@ enum OpCode{
     */
     OP_LOAD,
     /*
-    * OP_STORE_VAR: Store a value from the stack to the variables map
-                Index of the variable name in the variable names array is the next byte
+    * OP_STORE_VAR: Store a value from the stack in a local variable of the current function frame, used for declaring and updating locals
+                Slot of the variable in the function frame is the next byte
     */
     OP_STORE_VAR, 
     /*
-    * OP_UPDATE_VAR: Update a value in the variables map with a value from the stack
-                Index of the variable name in the variable names array is the next byte
-                var type is the next byte -> 
-                    0: normal variable (number, bool, string, function, null)
-                    1: vector
-                    2: struct
+    * OP_LOAD_VAR: Push a local variable of the current function frame to the stack
+                Slot of the variable in the function frame is the next byte
     */
-    OP_UPDATE_VAR, 
+    OP_LOAD_VAR,
     /*
-    * OP_LOAD_VAR: Push a value from the variables map to the stack
-                Index of the variable name in the variable names array is the next byte
+    * OP_LOAD_GLOBAL: Push a global (top level variable of the main function) to the stack
+                Index of the global in the globals table is the next byte
     */
-    OP_LOAD_VAR, // push a value from the variables map to the stack
+    OP_LOAD_GLOBAL,
     /*
-    * OP_LOAD_FUNCTION_VAR: Looks up the function frames to find the function variable
-                Index of the variable name in the variable names array is the next byte
+    * OP_STORE_GLOBAL: Store a value from the stack in a global, used for declaring and updating globals
+                Index of the global in the globals table is the next byte
     */
-    OP_LOAD_FUNCTION_VAR, 
+    OP_STORE_GLOBAL,
+    /*
+    * OP_LOAD_UPVALUE: Push a variable captured by the current closure to the stack
+                Index of the upvalue in the closure is the next byte
+    */
+    OP_LOAD_UPVALUE,
+    /*
+    * OP_UPDATE_UPVALUE: Update a variable captured by the current closure with a value from the stack
+                Index of the upvalue in the closure is the next byte
+    */
+    OP_UPDATE_UPVALUE,
+    /*
+    * OP_CLOSURE: Create a closure from a function constant and push it onto the stack
+                Index of the function in the constants array is the next byte
+                Number of captured variables is the byte after that
+                Then for every captured variable, two bytes -> 
+                    capture kind (check Capture_Kind)
+                    index of the upvalue in the current closure, or slot of the variable in the current function frame
+    */
+    OP_CLOSURE,
 
     // Arrays
 
@@ -138,13 +153,13 @@ enum OpCode{
     OP_VECTOR_PUSH, 
     /*
     * OP_LOAD_VECTOR_ELEMENT: Load a value from the vector
-                Index of the vector in the variable names array is the next byte
+                Slot of the vector in the function frame is the next byte
                 The index of the value in the vector is on the stack
     */
     OP_LOAD_VECTOR_ELEMENT,
     /*
     * OP_UPDATE_VECTOR_ELEMENT: Update a value in the vector
-                Index of the vector in the variable names array is the next byte
+                Slot of the vector in the function frame is the next byte
                 The index of the value in the vector is on the stack
                 The value to update is on the stack
     */
@@ -157,16 +172,18 @@ enum OpCode{
     */
     OP_CREATE_STRUCT, 
     /*
-    * OP_LOAD_STRUCT_ELEMENT: Load a value from the struct and push it onto the stack
-                Index of the struct in the variable names array is the next byte
-                Name of the element in the struct is the next byte
+    * OP_LOAD_STRUCT_ELEMENT: Load a field from the struct on top of the stack and push it onto the stack
+                Used for obj["name"], where the name of the field is a string literal
+                Index of the name of the field in the constants array is the next byte
+                Index of the inline cache of the site is the byte after that
     */
     OP_LOAD_STRUCT_ELEMENT, 
     /*
-    * OP_UPDATE_STRUCT_ELEMENT: Update a value in the struct
-                Index of the struct in the variable names array is the next byte
-                Name of the element in the struct is the next byte
-                The value to update is on the stack
+    * OP_UPDATE_STRUCT_ELEMENT: Set a value in the struct and push the struct back onto the stack, adds the field if the struct doesn't have it
+                Index of the name of the element in the variable names array is the next byte
+                Index of the inline cache of the site is the byte after that
+                The value to set is the top value on the stack
+                The struct is below the value on the stack
     */
     OP_UPDATE_STRUCT_ELEMENT, 
 
@@ -174,12 +191,14 @@ enum OpCode{
     * OP_ACCESS: Access a value in a struct or vector
                 Index is the top value on the stack
                 The struct or vector is below the index on the stack
+                Index of the inline cache of the site is the next byte
     */
     OP_ACCESS,
     /*
     * OP_ACCESS_FOR_UPDATE: Access a value in a struct or vector, then push the original value back onto the stack, then the index, then the value to update
                             Index is the top value on the stack
                             The struct or vector is below the index on the stack
+                            Index of the inline cache of the site is the next byte
     */
     OP_ACCESS_FOR_UPDATE,
     /*
@@ -187,6 +206,7 @@ enum OpCode{
                                 Value is the top value on the stack
                                 Index is the next value on the stack
                                 element to update is below the index on the stack
+                                Index of the inline cache of the site is the next byte
     */
     OP_UPDATE_STACK_ELEMENT,
 
@@ -217,11 +237,9 @@ enum OpCode{
     //Scope
 
     /*
-    * OP_INC_SCOPE: Increase the scope level by 1
-    */ 
-    OP_INC_SCOPE,
-    /*
-    * OP_DEC_SCOPE: Decrease the scope level by 1
+    * OP_DEC_SCOPE: Leave a block whose variables were captured by a closure, closes the upvalues pointing into the block
+                First slot of the block in the function frame is the next byte
+                Blocks are a compile time concept, so nothing is written when no variable of the block was captured
     */
     OP_DEC_SCOPE,
 
@@ -239,7 +257,27 @@ enum OpCode{
                 Index of the function in the standard library functions array is the next byte
                 The args are on the stack
     */
-    OP_STD_LIB_CALL
+    OP_STD_LIB_CALL,
+
+    // Strings
+
+    /*
+    * OP_APPEND_VAR: Add the top value on the stack to a local variable, local = local + value
+                Slot of the variable in the function frame is the next byte
+                A string variable has the value appended in place, instead of being copied into a new string
+    */
+    OP_APPEND_VAR,
+    /*
+    * OP_APPEND_GLOBAL: OP_APPEND_VAR for a global
+                Index of the global in the globals table is the next byte
+    */
+    OP_APPEND_GLOBAL
+};
+
+// Where OP_CLOSURE finds a captured variable
+enum Capture_Kind{
+    CAPTURE_UPVALUE,      // an upvalue of the closure that is creating the new closure
+    CAPTURE_LOCAL,        // a local variable of the current function frame
 };
 
 std::string opcode_to_string(CODE_SIZE op){
@@ -278,12 +316,18 @@ std::string opcode_to_string(CODE_SIZE op){
             return "OP_LOAD";
         case OpCode::OP_STORE_VAR:
             return "OP_STORE_VAR";
-        case OpCode::OP_UPDATE_VAR:
-            return "OP_UPDATE_VAR";
         case OpCode::OP_LOAD_VAR:
             return "OP_LOAD_VAR";
-        case OpCode::OP_LOAD_FUNCTION_VAR:
-            return "OP_LOAD_FUNCTION_VAR";
+        case OpCode::OP_LOAD_GLOBAL:
+            return "OP_LOAD_GLOBAL";
+        case OpCode::OP_STORE_GLOBAL:
+            return "OP_STORE_GLOBAL";
+        case OpCode::OP_LOAD_UPVALUE:
+            return "OP_LOAD_UPVALUE";
+        case OpCode::OP_UPDATE_UPVALUE:
+            return "OP_UPDATE_UPVALUE";
+        case OpCode::OP_CLOSURE:
+            return "OP_CLOSURE";
         case OpCode::OP_CREATE_VECTOR:
             return "OP_CREATE_VECTOR";
         case OpCode::OP_VECTOR_PUSH:
@@ -312,17 +356,51 @@ std::string opcode_to_string(CODE_SIZE op){
             return "OP_JUMP_IF_FALSE";
         case OpCode::OP_FUNCTION_CALL:
             return "OP_FUNCTION_CALL";
-        case OpCode::OP_INC_SCOPE:
-            return "OP_INC_SCOPE";
         case OpCode::OP_DEC_SCOPE:
             return "OP_DEC_SCOPE";
         case OpCode::OP_PRINT:
             return "OP_PRINT";
         case OpCode::OP_STD_LIB_CALL:
             return "OP_STD_LIB_CALL";
+        case OpCode::OP_APPEND_VAR:
+            return "OP_APPEND_VAR";
+        case OpCode::OP_APPEND_GLOBAL:
+            return "OP_APPEND_GLOBAL";
         default:
             return "INVALID OPCODE";    
     }
 }
 
+// Number of bytes the instruction at ip takes up, the opcode and its operands
+int instruction_size(const CODE_SIZE *ip){
+    switch(ip[0]){
+        case OpCode::OP_LOAD:
+        case OpCode::OP_STORE_VAR:
+        case OpCode::OP_LOAD_VAR:
+        case OpCode::OP_LOAD_GLOBAL:
+        case OpCode::OP_STORE_GLOBAL:
+        case OpCode::OP_LOAD_UPVALUE:
+        case OpCode::OP_UPDATE_UPVALUE:
+        case OpCode::OP_LOAD_VECTOR_ELEMENT:
+        case OpCode::OP_UPDATE_VECTOR_ELEMENT:
+        case OpCode::OP_ACCESS:
+        case OpCode::OP_ACCESS_FOR_UPDATE:
+        case OpCode::OP_UPDATE_STACK_ELEMENT:
+        case OpCode::OP_JUMP:
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_DEC_SCOPE:
+        case OpCode::OP_STD_LIB_CALL:
+        case OpCode::OP_APPEND_VAR:
+        case OpCode::OP_APPEND_GLOBAL:
+            return 2;
+        case OpCode::OP_LOAD_STRUCT_ELEMENT:
+        case OpCode::OP_UPDATE_STRUCT_ELEMENT:
+            return 3;
+        case OpCode::OP_CLOSURE:
+            return 3 + ip[2] * 2;
+        default:
+            return 1;
+    }
+}
+
 #endif // OPCODES_HPP
\ No newline at end of file
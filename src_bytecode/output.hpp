@@ -0,0 +1,104 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+// Output of print
+// print writes to stdout without flushing it, so printing a line is a copy into the stdout buffer instead of a write
+// When stdout isn't a terminal the buffer is OUTPUT_BUFFER_SIZE bytes, a terminal still gets every line as it is printed
+// The buffer is flushed when it is full, by $flush(), when the program exits or fails with vm_error, and when it is
+// stopped by SIGINT or SIGTERM, so a run killed by a timeout keeps its output. stdio can't be used in a signal handler,
+// so the handler only notes the signal and the VM flushes and stops at its next loop iteration or call. Code that
+// doesn't get there, like a loop compiled by the JIT, is stopped by the signal a second later without the flush
+// Crash signals keep their default action, the output still in the buffer is lost with the process
+// Everything else written with std::cout goes through the same buffer, so the order is kept
+
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+
+#include "numbers.hpp"
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+void output_write(const char* text, size_t length)
+{
+    fwrite(text, 1, length, stdout);
+}
+
+void output_write(const std::string &text)
+{
+    fwrite(text.data(), 1, text.size(), stdout);
+}
+
+void output_number(double number)
+{
+    char text[NUMBER_TEXT_SIZE];
+    fwrite(text, 1, format_number(number, text), stdout);
+}
+
+void output_flush()
+{
+    fflush(stdout);
+}
+
+// $flush()
+void flush()
+{
+    output_flush();
+}
+
+volatile sig_atomic_t output_stop_signal = 0; // SIGINT or SIGTERM once one of them arrived, 0 before
+
+void output_stop_requested(int signal_number)
+{
+    output_stop_signal = signal_number;
+    alarm(1);
+}
+
+// The VM didn't reach output_check_stop in time, the handler was reset so the signal now stops the process
+void output_stop_timeout(int)
+{
+    raise(output_stop_signal);
+}
+
+// Called by the VM at backward jumps and calls, flushes and stops the process after SIGINT or SIGTERM
+void output_check_stop()
+{
+    if (output_stop_signal != 0)
+    {
+        output_flush();
+        raise(output_stop_signal); // the handler was reset, the signal now does what it would have done
+    }
+}
+
+// Called when the VM starts, only the first call does anything
+void output_init()
+{
+    static bool initialized = false;
+    if (initialized)
+    {
+        return;
+    }
+    initialized = true;
+
+    if (!isatty(STDOUT_FILENO))
+    {
+        static char buffer[OUTPUT_BUFFER_SIZE];
+        fflush(stdout);
+        setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+    }
+
+    // a second SIGINT or SIGTERM stops the process right away
+    struct sigaction action = {};
+    action.sa_handler = output_stop_requested;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    for (int signal_number : {SIGINT, SIGTERM})
+    {
+        sigaction(signal_number, &action, nullptr);
+    }
+    action.sa_handler = output_stop_timeout;
+    sigaction(SIGALRM, &action, nullptr);
+}
+
+#endif // OUTPUT_HPP
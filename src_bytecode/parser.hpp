@@ -109,8 +109,11 @@ std::string node_type_to_string(NodeType type){
     return "UNKNOWN";
 }
 
+int parse_line = 0; // line of the token the parser looked at last, every node remembers it
+
 Token peek(std::vector<Token> tokens){
     if(tokens.size() > 0){
+        parse_line = tokens[0].get_line_number();
         return tokens[0];
     } else {
         return Token(TokenType::EOF_TOKEN, "EOF", -1);
@@ -120,6 +123,7 @@ Token peek(std::vector<Token> tokens){
 Token pop(std::vector<Token>& tokens){
     if(tokens.size() > 0){
         Token token = tokens[0];
+        parse_line = token.get_line_number();
         tokens.erase(tokens.begin());
         return token;
     } else {
@@ -204,14 +208,17 @@ class Node {
     NodeType type;
     std::vector<std::string> values;
     std::vector<Node*> children;
+    int line; // source line the node was parsed at
 public:
     Node(NodeType type, std::vector<std::string> values){
         this->type = type;
         this->values = values;
+        this->line = parse_line;
     }
     Node(NodeType type, std::string value){
         this->type = type;
         this->values.push_back(value);
+        this->line = parse_line;
     }
     ~Node(){
         for(int i = 0; i < int(this->children.size()); i++){
@@ -234,6 +241,9 @@ public:
     NodeType get_type(){
         return this->type;
     }
+    int get_line(){
+        return this->line;
+    }
     std::string get_value(int index = 0){
         return this->values[index];
     }
@@ -0,0 +1,250 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+// Execution profiler of the interpreter, selected with -profile
+// run_vm times every instruction it runs and charges it to its opcode, its source line and the call stack it ran in
+// At exit two files are written next to the program:
+//     <program>.profile  the report, opcodes, functions and lines sorted by the time spent in them
+//     <program>.folded   one line per call stack, "main;outer;inner <cycles>", the input of flame graph tools
+// Time is counted in CPU cycles (the time stamp counter on x86-64, nanoseconds elsewhere)
+// Code compiled by the JIT isn't profiled by instruction, its time is charged to the instruction that called it
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+#include "VM.hpp"
+#include "opcodes.hpp"
+#include "virtual_machine.hpp"
+
+uint64_t profile_clock()
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct profile_counter
+{
+    uint64_t count = 0;
+    uint64_t cycles = 0;
+};
+
+struct vm_profile
+{
+    std::map<CODE_SIZE, profile_counter> opcodes;
+
+    // every call stack seen is numbered, the instructions are charged to the number of the stack they ran in
+    std::map<std::vector<function*>, int> stack_ids;
+    std::vector<std::vector<function*>> stacks;
+    std::vector<uint64_t> stack_cycles;
+
+    std::map<function*, std::vector<profile_counter>> instructions; // by function and instruction index
+
+    // call stack the last instruction ran in
+    int stack_id = -1;
+    size_t stack_depth = 0;
+    function_frame* top_frame = nullptr;
+    std::vector<profile_counter>* top_instructions = nullptr;
+};
+
+std::string profile_function_name(function* func)
+{
+    return func->name.empty() ? "main" : func->name;
+}
+
+// Numbers the current call stack when it changed since the last instruction
+void profile_update_stack(VM* vm, vm_profile* profile)
+{
+    if (profile->stack_depth == vm->function_frames.size() && profile->top_frame == vm->function_frames.back())
+    {
+        return;
+    }
+    profile->stack_depth = vm->function_frames.size();
+    profile->top_frame = vm->function_frames.back();
+
+    std::vector<function*> stack;
+    for (function_frame* frame : vm->function_frames)
+    {
+        stack.push_back(frame->func);
+    }
+    auto found = profile->stack_ids.find(stack);
+    if (found == profile->stack_ids.end())
+    {
+        found = profile->stack_ids.insert({stack, (int)profile->stacks.size()}).first;
+        profile->stacks.push_back(stack);
+        profile->stack_cycles.push_back(0);
+    }
+    profile->stack_id = found->second;
+
+    std::vector<profile_counter> &instructions = profile->instructions[profile->top_frame->func];
+    instructions.resize(profile->top_frame->func->count);
+    profile->top_instructions = &instructions;
+}
+
+// run_vm with every instruction timed
+void run_vm_profiled(VM* vm, bool verbose)
+{
+    vm_profile* profile = vm->profile;
+    while (true)
+    {
+        profile_update_stack(vm, profile);
+        function_frame* frame = get_current_function_frame(vm);
+        int index = frame->ip - frame->func->code;
+        CODE_SIZE op = *frame->ip;
+
+        uint64_t start = profile_clock();
+        vm_loop(vm, verbose);
+        uint64_t cycles = profile_clock() - start;
+
+        profile_counter &opcode = profile->opcodes[op];
+        opcode.count++;
+        opcode.cycles += cycles;
+        profile->stack_cycles[profile->stack_id] += cycles;
+        profile_counter &instruction = (*profile->top_instructions)[index];
+        instruction.count++;
+        instruction.cycles += cycles;
+
+        if (!increase_ip(vm, 1))
+        {
+            break;
+        }
+    }
+}
+
+// Percentage of the total, as text
+std::string profile_percent(uint64_t part, uint64_t total)
+{
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(2) << (total == 0 ? 0.0 : 100.0 * part / total) << "%";
+    return text.str();
+}
+
+// Writes the report and the folded stacks for the program at exe_path
+void profile_write(VM* vm, const std::string &exe_path)
+{
+    vm_profile* profile = vm->profile;
+    std::string base = exe_path.substr(0, exe_path.find_last_of("."));
+
+    uint64_t total_count = 0;
+    uint64_t total_cycles = 0;
+    for (const auto &entry : profile->opcodes)
+    {
+        total_count += entry.second.count;
+        total_cycles += entry.second.cycles;
+    }
+
+    // a function's inclusive time is the time of every stack it is on, counted once when it is on a stack more than once
+    std::map<function*, profile_counter> inclusive;
+    std::map<function*, uint64_t> exclusive;
+    for (int i = 0; i < (int)profile->stacks.size(); i++)
+    {
+        const std::vector<function*> &stack = profile->stacks[i];
+        std::vector<function*> seen;
+        for (function* func : stack)
+        {
+            if (std::find(seen.begin(), seen.end(), func) == seen.end())
+            {
+                seen.push_back(func);
+                inclusive[func].cycles += profile->stack_cycles[i];
+            }
+        }
+        exclusive[stack.back()] += profile->stack_cycles[i];
+    }
+
+    // lines of all functions, a line can have instructions of more than one function
+    std::map<int, profile_counter> lines;
+    for (const auto &entry : profile->instructions)
+    {
+        function* func = entry.first;
+        for (int i = 0; i < (int)entry.second.size() && i < (int)func->lines.size(); i++)
+        {
+            lines[func->lines[i]].count += entry.second[i].count;
+            lines[func->lines[i]].cycles += entry.second[i].cycles;
+        }
+    }
+
+    std::ofstream report(base + ".profile");
+    report << "Profile of " << exe_path << "\n";
+    report << total_count << " instructions, " << total_cycles << " cycles\n";
+
+    std::vector<std::pair<CODE_SIZE, profile_counter>> opcodes(profile->opcodes.begin(), profile->opcodes.end());
+    std::sort(opcodes.begin(), opcodes.end(), [](const auto &a, const auto &b) { return a.second.cycles > b.second.cycles; });
+    report << "\nOpcodes by cycles\n";
+    report << std::left << std::setw(28) << "opcode" << std::setw(14) << "count" << std::setw(16) << "cycles"
+           << std::setw(10) << "time" << "cycles/op\n";
+    for (const auto &entry : opcodes)
+    {
+        report << std::setw(28) << opcode_to_string(entry.first) << std::setw(14) << entry.second.count
+               << std::setw(16) << entry.second.cycles << std::setw(10) << profile_percent(entry.second.cycles, total_cycles)
+               << entry.second.cycles / entry.second.count << "\n";
+    }
+
+    std::vector<std::pair<function*, profile_counter>> functions(inclusive.begin(), inclusive.end());
+    std::sort(functions.begin(), functions.end(), [](const auto &a, const auto &b) { return a.second.cycles > b.second.cycles; });
+    report << "\nFunctions by inclusive cycles\n";
+    report << std::setw(24) << "function" << std::setw(10) << "calls" << std::setw(16) << "inclusive" << std::setw(10) << "time"
+           << std::setw(16) << "exclusive" << "time\n";
+    for (const auto &entry : functions)
+    {
+        function* func = entry.first;
+        int calls = func == get_function_frame(vm, 0)->func ? 1 : func->times_called;
+        report << std::setw(24) << profile_function_name(func) << std::setw(10) << calls << std::setw(16) << entry.second.cycles
+               << std::setw(10) << profile_percent(entry.second.cycles, total_cycles) << std::setw(16) << exclusive[func]
+               << profile_percent(exclusive[func], total_cycles) << "\n";
+    }
+
+    std::vector<std::pair<int, profile_counter>> sorted_lines(lines.begin(), lines.end());
+    std::sort(sorted_lines.begin(), sorted_lines.end(), [](const auto &a, const auto &b) { return a.second.cycles > b.second.cycles; });
+    report << "\nSource lines by cycles\n";
+    report << std::setw(10) << "line" << std::setw(14) << "hits" << std::setw(16) << "cycles" << "time\n";
+    for (const auto &entry : sorted_lines)
+    {
+        report << std::setw(10) << entry.first << std::setw(14) << entry.second.count << std::setw(16) << entry.second.cycles
+               << profile_percent(entry.second.cycles, total_cycles) << "\n";
+    }
+
+    std::ofstream folded(base + ".folded");
+    for (int i = 0; i < (int)profile->stacks.size(); i++)
+    {
+        if (profile->stack_cycles[i] == 0)
+        {
+            continue;
+        }
+        std::string names;
+        for (function* func : profile->stacks[i])
+        {
+            names += (names.empty() ? "" : ";") + profile_function_name(func);
+        }
+        folded << names << " " << profile->stack_cycles[i] << "\n";
+    }
+}
+
+void profile_start(VM* vm)
+{
+    vm->profile = new vm_profile();
+}
+
+// Writes the report and the folded stacks, and stops profiling
+void profile_stop(VM* vm, const std::string &exe_path)
+{
+    profile_write(vm, exe_path);
+    std::string base = exe_path.substr(0, exe_path.find_last_of("."));
+    std::cout << "Profile written to " << base << ".profile and " << base << ".folded" << std::endl;
+    delete vm->profile;
+    vm->profile = nullptr;
+}
+
+#endif // PROFILER_HPP
@@ -0,0 +1,380 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+// Sampling profiler, selected with -sample or -sample=<samples per second>
+// A SIGPROF timer interrupts the program at the given rate of CPU time, or the kernel's tick when that is slower
+// The interpreter publishes the function and instruction of every frame to a preallocated array after each instruction,
+// and the signal handler copies the stack from that array and counts it in a fixed size table, so the handler never
+// reads frames the interpreter may be freeing and nothing is allocated while the program runs, cheap enough to leave on
+// for long runs. Stacks deeper than SAMPLER_MAX_FRAMES aren't published, their samples are counted as dropped
+// The counts are written to <program>.samples when the program ends, and whenever the process gets SIGUSR1:
+//     main@12;outer@30;inner@4 37
+// one line per stack from the outermost frame, every frame is <function>@<instruction index>, followed by its sample count
+// The lines can be given to flame graph tools as is, or with the @<index> removed to merge the samples by function
+// Code compiled by the JIT doesn't publish its frames, its samples are counted at the instruction that entered it
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "VM.hpp"
+
+#define SAMPLER_HZ 1000      // default samples per second
+#define SAMPLER_DEPTH 32     // innermost frames kept of deeper stacks
+#define SAMPLER_SLOTS 16384  // different stacks counted, later new stacks are dropped
+#define SAMPLER_MAX_FRAMES 4096 // deepest stack published, deeper stacks aren't sampled
+
+struct sample_frame
+{
+    function* func;
+    CODE_SIZE* ip;
+};
+
+struct sample_slot
+{
+    uint64_t count = 0; // 0 while the slot is free
+    uint64_t hash = 0;
+    int depth = 0;
+    sample_frame frames[SAMPLER_DEPTH];
+};
+
+struct vm_sampler
+{
+    VM* vm;
+    std::vector<sample_slot> slots;
+    std::vector<function*> functions; // every function of the program, sorted, the only ones a sample may name
+    std::string path;
+    std::string temporary_path;
+
+    // written only by the interpreter, between instructions: the entries below depth are complete, an entry is written
+    // before depth grows over it and depth shrinks before an entry is rewritten, -1 while the stack is too deep
+    std::vector<sample_frame> published;
+    std::atomic<int> depth{0};
+
+    volatile uint64_t samples = 0;
+    volatile uint64_t dropped = 0;
+    volatile uint64_t too_deep = 0; // samples of stacks that weren't published
+};
+
+// Signal handlers take no argument, so the sampler of the running VM is global
+vm_sampler* sampler = nullptr;
+
+// Runs in the SIGPROF handler, so only reads the VM and writes the preallocated table
+void sampler_tick(int)
+{
+    int saved_errno = errno;
+    vm_sampler* s = sampler;
+    if (s == nullptr)
+    {
+        return;
+    }
+
+    // only the published array is read, never the frames themselves
+    int count = s->depth.load(std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_acquire);
+    if (count <= 0)
+    {
+        s->samples = s->samples + 1;
+        s->too_deep = s->too_deep + 1;
+        errno = saved_errno;
+        return;
+    }
+    int depth = count < SAMPLER_DEPTH ? count : SAMPLER_DEPTH;
+    sample_frame stack[SAMPLER_DEPTH];
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < depth; i++)
+    {
+        stack[i] = s->published[count - depth + i];
+        hash = (hash ^ (uint64_t)(uintptr_t)stack[i].func) * 1099511628211ull;
+        hash = (hash ^ (uint64_t)(uintptr_t)stack[i].ip) * 1099511628211ull;
+    }
+
+    s->samples = s->samples + 1;
+    size_t size = s->slots.size();
+    for (size_t probe = 0; probe < size; probe++)
+    {
+        sample_slot &slot = s->slots[(hash + probe) & (size - 1)];
+        if (slot.count == 0)
+        {
+            slot.hash = hash;
+            slot.depth = depth;
+            std::copy(stack, stack + depth, slot.frames);
+            slot.count = 1;
+            errno = saved_errno;
+            return;
+        }
+        if (slot.hash == hash && slot.depth == depth && std::equal(stack, stack + depth, slot.frames,
+            [](const sample_frame &a, const sample_frame &b) { return a.func == b.func && a.ip == b.ip; }))
+        {
+            slot.count++;
+            errno = saved_errno;
+            return;
+        }
+    }
+    s->dropped = s->dropped + 1;
+    errno = saved_errno;
+}
+
+// Output buffer of sampler_write, only uses write so it can run in the SIGUSR1 handler
+struct sample_writer
+{
+    int fd;
+    char buffer[4096];
+    int used = 0;
+
+    void flush()
+    {
+        int done = 0;
+        while (done < used)
+        {
+            ssize_t written = write(fd, buffer + done, used - done);
+            if (written <= 0 && errno != EINTR)
+            {
+                break;
+            }
+            done += written > 0 ? written : 0;
+        }
+        used = 0;
+    }
+
+    void add(const char* text, size_t length)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            if (used == (int)sizeof(buffer))
+            {
+                flush();
+            }
+            buffer[used++] = text[i];
+        }
+    }
+
+    void add(uint64_t number)
+    {
+        char digits[20];
+        int count = 0;
+        do
+        {
+            digits[count++] = '0' + number % 10;
+            number /= 10;
+        } while (number != 0);
+        while (count > 0)
+        {
+            add(&digits[--count], 1);
+        }
+    }
+};
+
+bool sampler_known_function(vm_sampler* s, function* func)
+{
+    return std::binary_search(s->functions.begin(), s->functions.end(), func);
+}
+
+// Writes the counted stacks to the .samples file, next to it and renamed over it so a reader never sees half of it
+// Runs in the SIGUSR1 handler with SIGPROF blocked, and when the program ends
+void sampler_write(vm_sampler* s)
+{
+    sample_writer out;
+    out.fd = open(s->temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out.fd < 0)
+    {
+        return;
+    }
+    for (const sample_slot &slot : s->slots)
+    {
+        if (slot.count == 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < slot.depth; i++)
+        {
+            if (i != 0)
+            {
+                out.add(";", 1);
+            }
+            function* func = slot.frames[i].func;
+            if (!sampler_known_function(s, func))
+            {
+                out.add("?", 1);
+                continue;
+            }
+            if (func->name.empty())
+            {
+                out.add("main", 4);
+            }
+            else
+            {
+                out.add(func->name.data(), func->name.size());
+            }
+            out.add("@", 1);
+            CODE_SIZE* ip = slot.frames[i].ip;
+            if (ip >= func->code && ip < func->code + func->count)
+            {
+                out.add(ip - func->code);
+            }
+            else
+            {
+                out.add("?", 1);
+            }
+        }
+        out.add(" ", 1);
+        out.add(slot.count);
+        out.add("\n", 1);
+    }
+    out.flush();
+    close(out.fd);
+    rename(s->temporary_path.c_str(), s->path.c_str());
+}
+
+void sampler_dump(int)
+{
+    int saved_errno = errno;
+    if (sampler != nullptr)
+    {
+        sampler_write(sampler);
+    }
+    errno = saved_errno;
+}
+
+void sampler_set_timer(int hz)
+{
+    itimerval timer = {};
+    if (hz > 0)
+    {
+        timer.it_interval.tv_sec = hz == 1 ? 1 : 0;
+        timer.it_interval.tv_usec = hz == 1 ? 0 : 1000000 / hz;
+        timer.it_value = timer.it_interval;
+    }
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+// Writes the samples when the program exits early, after a runtime error
+void sampler_exit()
+{
+    if (sampler != nullptr)
+    {
+        sampler_set_timer(0);
+        sampler_write(sampler);
+    }
+}
+
+// Publishes the frames for sampler_tick, before every instruction of a sampled run
+// Usually only the instruction of the top frame changed, a call or a return also changes the depth
+void sampler_publish(vm_sampler* s, VM* vm)
+{
+    int count = vm->function_frames.size();
+    if (count > SAMPLER_MAX_FRAMES)
+    {
+        s->depth.store(-1, std::memory_order_relaxed);
+        return;
+    }
+    function_frame* top = vm->function_frames.back();
+    int depth = s->depth.load(std::memory_order_relaxed);
+    if (depth == count && s->published[count - 1].func == top->func)
+    {
+        s->published[count - 1].ip = top->ip;
+        return;
+    }
+
+    // the entries below the top that are still right stay published while the others are rewritten
+    int valid = depth < count ? depth : count;
+    valid = valid > 0 ? valid - 1 : 0; // the top one of them is at another instruction now
+    s->depth.store(valid, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_release);
+    for (int i = valid; i < count; i++)
+    {
+        s->published[i] = {vm->function_frames[i]->func, vm->function_frames[i]->ip};
+    }
+    std::atomic_signal_fence(std::memory_order_release);
+    s->depth.store(count, std::memory_order_relaxed);
+}
+
+// run_vm of a sampled run
+void run_vm_sampled(VM* vm, bool verbose)
+{
+    vm_sampler* s = vm->sampler;
+    while (true)
+    {
+        sampler_publish(s, vm);
+        vm_loop(vm, verbose);
+        if (!increase_ip(vm, 1))
+        {
+            break;
+        }
+    }
+}
+
+void sampler_start(VM* vm, const std::string &exe_path, int hz)
+{
+    vm_sampler* s = new vm_sampler();
+    s->vm = vm;
+    s->slots.resize(SAMPLER_SLOTS);
+    s->published.resize(SAMPLER_MAX_FRAMES);
+    s->path = exe_path.substr(0, exe_path.find_last_of(".")) + ".samples";
+    s->temporary_path = s->path + "." + std::to_string(getpid()) + ".tmp";
+    for (Value &constant : vm->constants)
+    {
+        if (constant.type == Value_Type::FUNCTION)
+        {
+            s->functions.push_back(VALUE_AS_CLOSURE(constant)->func);
+        }
+    }
+    s->functions.push_back(get_function_frame(vm, 0)->func);
+    std::sort(s->functions.begin(), s->functions.end());
+    sampler_publish(s, vm);
+    vm->sampler = s;
+    sampler = s;
+
+    // each handler blocks the other, so a stack is never written while it is being counted
+    struct sigaction action = {};
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaddset(&action.sa_mask, SIGUSR1);
+    action.sa_handler = sampler_tick;
+    sigaction(SIGPROF, &action, nullptr);
+    sigemptyset(&action.sa_mask);
+    sigaddset(&action.sa_mask, SIGPROF);
+    action.sa_handler = sampler_dump;
+    sigaction(SIGUSR1, &action, nullptr);
+
+    static bool registered = false;
+    if (!registered)
+    {
+        atexit(sampler_exit);
+        registered = true;
+    }
+    sampler_set_timer(hz);
+}
+
+// Stops the timer and writes the samples
+void sampler_stop(VM* vm)
+{
+    sampler_set_timer(0);
+    signal(SIGPROF, SIG_IGN);
+    signal(SIGUSR1, SIG_DFL);
+    vm_sampler* s = sampler;
+    sampler = nullptr;
+    vm->sampler = nullptr;
+    sampler_write(s);
+    std::cout << "Samples written to " << s->path << " (" << s->samples << " samples";
+    if (s->dropped != 0)
+    {
+        std::cout << ", " << s->dropped << " of new stacks dropped";
+    }
+    if (s->too_deep != 0)
+    {
+        std::cout << ", " << s->too_deep << " of stacks deeper than " << SAMPLER_MAX_FRAMES << " frames not sampled";
+    }
+    std::cout << ")" << std::endl;
+    delete s;
+}
+
+#endif // SAMPLER_HPP
@@ -0,0 +1,494 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+// Bytecode statistics, selected with -stats or -stats=dynamic
+// -stats writes <program>.stats.json with the statistics of the code the generator emitted:
+//     opcodes    instructions of every opcode
+//     pairs      two opcodes that follow each other in a function, trigrams three
+//     constants  size of the constant pool by type, and the values that are in it more than once
+//     functions  length of every function, and the deepest the value stack gets in it, found by walking every path
+//                through the function. balanced is false when two paths reach an instruction with a different depth,
+//                which happens when a statement leaves a value on the stack
+// -stats=dynamic also runs the program and writes <program>.run_stats.json with the same counted over the instructions
+// that ran, pairs and trigrams in the order they ran across calls, with the calls of every function and the loads of
+// every constant. Code compiled by the JIT isn't counted, so it is meant to run without -jit
+// Both files have the same layout, so a release can be compared with the one before it
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "Function.hpp"
+#include "Value.hpp"
+#include "VM.hpp"
+#include "opcodes.hpp"
+#include "./std_lib/std_lib.hpp"
+
+struct function_stats
+{
+    std::string name;
+    int instructions = 0; // static: in the function, dynamic: executed in it
+    int code_units = 0;
+    int max_stack_depth = 0;
+    bool balanced = true;
+    uint64_t calls = 0; // dynamic only
+};
+
+struct bytecode_stats
+{
+    std::map<CODE_SIZE, uint64_t> opcodes;
+    std::map<std::pair<CODE_SIZE, CODE_SIZE>, uint64_t> pairs;
+    std::map<std::tuple<CODE_SIZE, CODE_SIZE, CODE_SIZE>, uint64_t> trigrams;
+    std::map<int, uint64_t> constant_loads; // by constant index, dynamic only
+
+    std::vector<function*> order; // functions in the order of their constants, main last
+    std::map<function*, function_stats> functions;
+
+    // dynamic: the last two opcodes that ran, and where the stack of every frame starts
+    int previous[2] = {-1, -1};
+    std::vector<int> stack_bases;
+};
+
+// Functions of the program in the order of their constants, main last
+std::vector<function*> stats_functions(const std::vector<Value> &constants, function* main)
+{
+    std::vector<function*> funcs;
+    for (const Value &constant : constants)
+    {
+        if (constant.type == Value_Type::FUNCTION)
+        {
+            funcs.push_back(VALUE_AS_CLOSURE(constant)->func);
+        }
+    }
+    funcs.push_back(main);
+    return funcs;
+}
+
+// The arguments are on the stack when a function starts, the generator stores each of them with an OP_STORE_VAR
+int stats_arity(function* func)
+{
+    int arity = 0;
+    for (int i = 0; i < func->count && func->code[i] == OpCode::OP_STORE_VAR; i += 2)
+    {
+        arity++;
+    }
+    return arity;
+}
+
+// Values the instruction at ip pops and pushes, arguments is the number of arguments of a function call
+std::pair<int, int> stats_stack_effect(const CODE_SIZE* ip, int arguments)
+{
+    switch (ip[0])
+    {
+    case OpCode::OP_U_SUB:
+    case OpCode::OP_NOT:
+    case OpCode::OP_LOAD_VECTOR_ELEMENT:
+    case OpCode::OP_LOAD_STRUCT_ELEMENT:
+        return {1, 1};
+    case OpCode::OP_LOAD:
+    case OpCode::OP_LOAD_VAR:
+    case OpCode::OP_LOAD_GLOBAL:
+    case OpCode::OP_LOAD_UPVALUE:
+    case OpCode::OP_CLOSURE:
+    case OpCode::OP_CREATE_VECTOR:
+    case OpCode::OP_CREATE_STRUCT:
+        return {0, 1};
+    case OpCode::OP_STORE_VAR:
+    case OpCode::OP_STORE_GLOBAL:
+    case OpCode::OP_UPDATE_UPVALUE:
+    case OpCode::OP_APPEND_VAR:
+    case OpCode::OP_APPEND_GLOBAL:
+    case OpCode::OP_RETURN:
+    case OpCode::OP_JUMP_IF_FALSE:
+    case OpCode::OP_PRINT:
+        return {1, 0};
+    case OpCode::OP_UPDATE_VECTOR_ELEMENT:
+        return {2, 0};
+    case OpCode::OP_ACCESS_FOR_UPDATE:
+        return {2, 3};
+    case OpCode::OP_UPDATE_STACK_ELEMENT:
+        return {3, 1};
+    case OpCode::OP_JUMP:
+    case OpCode::OP_DEC_SCOPE:
+        return {0, 0};
+    case OpCode::OP_FUNCTION_CALL:
+        return {1 + arguments, 1};
+    case OpCode::OP_STD_LIB_CALL:
+    {
+        const STD_LIB_FUNCTION_INFO &info = STD_LIB_FUNCTIONS_DEFINITIONS[ip[1]];
+        return {(int)info.arg_types.size(), info.return_type == "void" ? 0 : 1};
+    }
+    default: // binary operators, OP_VECTOR_PUSH, OP_UPDATE_STRUCT_ELEMENT and OP_ACCESS
+        return {2, 1};
+    }
+}
+
+// Deepest the value stack of the function gets, walking every path from its start
+// call_arguments has the number of arguments of every call site by instruction index, a call missing from it takes none
+int stats_max_stack_depth(function* func, const std::map<int, int> &call_arguments, bool &balanced)
+{
+    std::vector<int> depths(func->count, -1); // depth before every instruction, -1 until a path reaches it
+    std::vector<int> work = {0};
+    depths[0] = stats_arity(func);
+    int max_depth = depths[0];
+    balanced = true;
+    while (!work.empty())
+    {
+        int i = work.back();
+        work.pop_back();
+        auto call = call_arguments.find(i);
+        std::pair<int, int> effect = stats_stack_effect(&func->code[i], call == call_arguments.end() ? 0 : call->second);
+        int depth = std::max(0, depths[i] - effect.first) + effect.second;
+        max_depth = std::max(max_depth, depth);
+
+        // jump targets are stored as the index before the target
+        std::vector<int> next;
+        CODE_SIZE op = func->code[i];
+        if (op == OpCode::OP_JUMP || op == OpCode::OP_JUMP_IF_FALSE)
+        {
+            next.push_back(func->code[i + 1] + 1);
+        }
+        if (op != OpCode::OP_JUMP && op != OpCode::OP_RETURN)
+        {
+            next.push_back(i + instruction_size(&func->code[i]));
+        }
+        for (int target : next)
+        {
+            if (target < 0 || target >= func->count)
+            {
+                continue; // the end of the function
+            }
+            if (depths[target] == -1)
+            {
+                depths[target] = depth;
+                work.push_back(target);
+            }
+            else if (depths[target] != depth)
+            {
+                balanced = false;
+            }
+        }
+    }
+    return max_depth;
+}
+
+void stats_count(bytecode_stats* stats, CODE_SIZE op)
+{
+    stats->opcodes[op]++;
+    if (stats->previous[1] != -1)
+    {
+        stats->pairs[{stats->previous[1], op}]++;
+        if (stats->previous[0] != -1)
+        {
+            stats->trigrams[{stats->previous[0], stats->previous[1], op}]++;
+        }
+    }
+    stats->previous[0] = stats->previous[1];
+    stats->previous[1] = op;
+}
+
+// Statistics of the code the generator emitted, call_arguments has the argument count of every call site
+bytecode_stats stats_static(function* main, const std::vector<Value> &constants,
+                            const std::map<std::pair<function*, int>, int> &call_arguments)
+{
+    bytecode_stats stats;
+    stats.order = stats_functions(constants, main);
+    for (function* func : stats.order)
+    {
+        function_stats &entry = stats.functions[func];
+        entry.name = func->name.empty() ? "main" : func->name;
+        entry.code_units = func->count;
+
+        std::map<int, int> arguments;
+        stats.previous[0] = stats.previous[1] = -1; // pairs don't cross functions
+        for (int i = 0; i < func->count; i += instruction_size(&func->code[i]))
+        {
+            stats_count(&stats, func->code[i]);
+            entry.instructions++;
+            auto call = call_arguments.find({func, i});
+            if (call != call_arguments.end())
+            {
+                arguments[i] = call->second;
+            }
+        }
+        if (func->count > 0)
+        {
+            entry.max_stack_depth = stats_max_stack_depth(func, arguments, entry.balanced);
+        }
+    }
+    return stats;
+}
+
+// Counts the instruction the current frame is at, before it runs
+void stats_record(VM* vm, bytecode_stats* stats)
+{
+    // frames that returned since the last instruction, then frames that were called
+    while (stats->stack_bases.size() > vm->function_frames.size())
+    {
+        stats->stack_bases.pop_back();
+    }
+    while (stats->stack_bases.size() < vm->function_frames.size())
+    {
+        function* func = vm->function_frames[stats->stack_bases.size()]->func;
+        stats->stack_bases.push_back(vm->stack_count - stats_arity(func));
+        stats->functions[func].calls++;
+    }
+
+    function_frame* frame = get_current_function_frame(vm);
+    function_stats &entry = stats->functions[frame->func];
+    entry.instructions++;
+    entry.max_stack_depth = std::max(entry.max_stack_depth, vm->stack_count - stats->stack_bases.back());
+
+    CODE_SIZE op = *frame->ip;
+    stats_count(stats, op);
+    if (op == OpCode::OP_LOAD)
+    {
+        stats->constant_loads[frame->ip[1]]++;
+    }
+}
+
+// run_vm with every instruction counted
+void run_vm_stats(VM* vm, bool verbose)
+{
+    while (true)
+    {
+        stats_record(vm, vm->stats);
+        vm_loop(vm, verbose);
+        if (!increase_ip(vm, 1))
+        {
+            break;
+        }
+    }
+}
+
+std::string stats_json_string(const std::string &text)
+{
+    std::string escaped = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (c == '\n')
+        {
+            escaped += "\\n";
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+    return escaped + "\"";
+}
+
+// Opcode counts as a JSON array, most frequent first
+template <typename Key>
+void stats_write_counts(std::ostream &out, const std::map<Key, uint64_t> &counts, std::string (*names)(const Key &))
+{
+    std::vector<std::pair<Key, uint64_t>> sorted(counts.begin(), counts.end());
+    std::stable_sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+    out << "[";
+    for (int i = 0; i < (int)sorted.size(); i++)
+    {
+        out << (i == 0 ? "\n" : ",\n") << "    {\"ops\": [" << names(sorted[i].first) << "], \"count\": " << sorted[i].second << "}";
+    }
+    out << (sorted.empty() ? "]" : "\n  ]");
+}
+
+std::string stats_opcode_name(const CODE_SIZE &op)
+{
+    return stats_json_string(opcode_to_string(op));
+}
+
+std::string stats_pair_names(const std::pair<CODE_SIZE, CODE_SIZE> &pair)
+{
+    return stats_opcode_name(pair.first) + ", " + stats_opcode_name(pair.second);
+}
+
+std::string stats_trigram_names(const std::tuple<CODE_SIZE, CODE_SIZE, CODE_SIZE> &trigram)
+{
+    return stats_pair_names({std::get<0>(trigram), std::get<1>(trigram)}) + ", " + stats_opcode_name(std::get<2>(trigram));
+}
+
+std::string stats_type_name(Value_Type type)
+{
+    switch (type)
+    {
+    case Value_Type::NUMBER:
+        return "number";
+    case Value_Type::BOOL:
+        return "bool";
+    case Value_Type::STRING:
+        return "string";
+    case Value_Type::FUNCTION:
+        return "function";
+    case Value_Type::NULL_VALUE:
+        return "null";
+    default:
+        return "other";
+    }
+}
+
+// Text of a number, bool, string or null constant, the same for equal constants
+std::string stats_constant_text(const Value &constant)
+{
+    std::ostringstream text;
+    switch (constant.type)
+    {
+    case Value_Type::NUMBER:
+        text << std::get<double>(constant.data);
+        break;
+    case Value_Type::BOOL:
+        text << (std::get<bool>(constant.data) ? "true" : "false");
+        break;
+    case Value_Type::STRING:
+        text << std::get<std::string>(constant.data);
+        break;
+    default:
+        text << "null";
+        break;
+    }
+    return text.str();
+}
+
+// Writes the statistics as JSON, dynamic adds the counts only a run has
+void stats_write(const bytecode_stats &stats, const std::vector<Value> &constants, const std::string &program,
+                 const std::string &path, bool dynamic)
+{
+    std::ofstream out(path);
+    uint64_t total = 0;
+    for (const auto &entry : stats.opcodes)
+    {
+        total += entry.second;
+    }
+
+    out << "{\n  \"program\": " << stats_json_string(program) << ",\n";
+    out << "  \"mode\": \"" << (dynamic ? "dynamic" : "static") << "\",\n";
+    out << "  \"instructions\": " << total << ",\n";
+    out << "  \"opcodes\": ";
+    stats_write_counts(out, stats.opcodes, stats_opcode_name);
+    out << ",\n  \"pairs\": ";
+    stats_write_counts(out, stats.pairs, stats_pair_names);
+    out << ",\n  \"trigrams\": ";
+    stats_write_counts(out, stats.trigrams, stats_trigram_names);
+
+    std::map<std::string, int> types;
+    std::map<std::pair<Value_Type, std::string>, std::vector<int>> values; // indices of every constant value
+    for (int i = 0; i < (int)constants.size(); i++)
+    {
+        types[stats_type_name(constants[i].type)]++;
+        std::string type = stats_type_name(constants[i].type);
+        if (type != "function" && type != "other") // functions are never the same constant
+        {
+            values[{constants[i].type, stats_constant_text(constants[i])}].push_back(i);
+        }
+    }
+    out << ",\n  \"constants\": {\n    \"count\": " << constants.size() << ",\n    \"by_type\": {";
+    bool first = true;
+    for (const auto &type : types)
+    {
+        out << (first ? "" : ", ") << stats_json_string(type.first) << ": " << type.second;
+        first = false;
+    }
+    out << "},\n    \"duplicates\": [";
+    first = true;
+    for (const auto &value : values)
+    {
+        if (value.second.size() < 2)
+        {
+            continue;
+        }
+        out << (first ? "\n" : ",\n") << "      {\"type\": " << stats_json_string(stats_type_name(value.first.first))
+            << ", \"value\": " << stats_json_string(value.first.second) << ", \"count\": " << value.second.size() << "}";
+        first = false;
+    }
+    out << (first ? "]" : "\n    ]");
+    if (dynamic)
+    {
+        out << ",\n    \"loads\": [";
+        first = true;
+        for (const auto &load : stats.constant_loads)
+        {
+            out << (first ? "\n" : ",\n") << "      {\"index\": " << load.first << ", \"count\": " << load.second << "}";
+            first = false;
+        }
+        out << (first ? "]" : "\n    ]");
+    }
+    out << "\n  },\n";
+
+    // static: instructions per function, dynamic: instructions run per call
+    double length = 0;
+    int counted = 0;
+    for (function* func : stats.order)
+    {
+        const function_stats &entry = stats.functions.at(func);
+        if (!dynamic || entry.calls > 0)
+        {
+            length += dynamic ? (double)entry.instructions / entry.calls : entry.instructions;
+            counted++;
+        }
+    }
+    out << "  \"average_function_length\": " << (counted == 0 ? 0 : length / counted) << ",\n";
+
+    out << "  \"functions\": [";
+    for (int i = 0; i < (int)stats.order.size(); i++)
+    {
+        const function_stats &entry = stats.functions.at(stats.order[i]);
+        out << (i == 0 ? "\n" : ",\n") << "    {\"name\": " << stats_json_string(entry.name)
+            << ", \"instructions\": " << entry.instructions << ", \"code_units\": " << entry.code_units;
+        if (dynamic)
+        {
+            out << ", \"calls\": " << entry.calls;
+        }
+        out << ", \"max_stack_depth\": " << entry.max_stack_depth;
+        if (!dynamic)
+        {
+            out << ", \"balanced\": " << (entry.balanced ? "true" : "false");
+        }
+        out << "}";
+    }
+    out << (stats.order.empty() ? "]" : "\n  ]") << "\n}\n";
+}
+
+// Path of a statistics file next to the program
+std::string stats_path(const std::string &exe_path, const std::string &suffix)
+{
+    return exe_path.substr(0, exe_path.find_last_of(".")) + suffix;
+}
+
+void stats_start(VM* vm)
+{
+    vm->stats = new bytecode_stats();
+    vm->stats->order = stats_functions(vm->constants, get_function_frame(vm, 0)->func);
+    for (function* func : vm->stats->order)
+    {
+        function_stats &entry = vm->stats->functions[func];
+        entry.name = func->name.empty() ? "main" : func->name;
+        entry.code_units = func->count;
+    }
+}
+
+// Writes the statistics of the run, and stops counting
+void stats_stop(VM* vm, const std::string &exe_path)
+{
+    std::string path = stats_path(exe_path, ".run_stats.json");
+    stats_write(*vm->stats, vm->constants, exe_path, path, true);
+    std::cout << "Run statistics written to " << path << std::endl;
+    delete vm->stats;
+    vm->stats = nullptr;
+}
+
+#endif // STATS_HPP
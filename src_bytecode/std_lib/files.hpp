@@ -23,13 +23,21 @@ void file_write(std::string file_path, std::string content){
 
 std::string file_read(std::string file_path){
     std::cout << "Reading file: " << directory_path + file_path << std::endl;
-    std::ifstream file(directory_path + file_path);
-    std::string content(
-        (std::istreambuf_iterator<char>(file)), // This creates an input iterator that reads characters from the input stream file.
-                                                // file is assumed to be an object of type std::ifstream or any other input stream.
-        (std::istreambuf_iterator<char>())      // This creates a default-constructed std::istreambuf_iterator<char>, which acts as an end-of-stream iterator.
-
-    );
+    std::ifstream file(directory_path + file_path, std::ios::binary);
+    std::string content;
+    if(!file){
+        return content;
+    }
+
+    // read the whole file at once instead of a character at a time
+    file.seekg(0, std::ios::end);
+    std::streamoff size = file.tellg();
+    file.seekg(0, std::ios::beg);
+    if(size > 0){
+        content.resize(size);
+        file.read(&content[0], size);
+        content.resize(file.gcount());
+    }
     return content;
 }
 
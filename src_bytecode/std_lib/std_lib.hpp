@@ -24,7 +24,8 @@
 // string -> std::string
 // vector -> std::vector<Value>
 
-typedef std::function<std::any(std::vector<std::any>, std::vector<std::string>)> STD_LIB_FUNCTION;
+// the arguments are moved into the function's parameters, so strings and vectors are passed without copying them
+typedef std::function<std::any(std::vector<std::any>&, const std::vector<std::string>&)> STD_LIB_FUNCTION;
 
 // array of the function pointers
 struct STD_LIB_FUNCTION_INFO{
@@ -50,6 +51,17 @@ double inc(double a){
     return a + 1;
 }
 
+// vm functions, defined with the VM they report on
+Value vm_stats(); // memory.hpp
+
+// string builders, kept by the VM (string_builder.hpp)
+int string_builder_create();
+void string_builder_append(int builder, Value value);
+std::string string_builder_to_string(int builder);
+int string_builder_length(int builder);
+void string_builder_clear(int builder);
+void string_builder_free(int builder);
+
 const std::vector<STD_LIB_FUNCTION_INFO> STD_LIB_FUNCTIONS_DEFINITIONS = {
     // test functions
     {"do_nothing", make_std_lib_function(do_nothing), "void", {}}, 
@@ -94,6 +106,20 @@ const std::vector<STD_LIB_FUNCTION_INFO> STD_LIB_FUNCTIONS_DEFINITIONS = {
 
     // random functions
     {"random_number", make_std_lib_function(random_number), "int", {"int", "int"}},
+
+    // vm functions
+    {"vm_stats", make_std_lib_function(vm_stats), "Value", {}},
+
+    // output functions
+    {"flush", make_std_lib_function(flush), "void", {}},
+
+    // string builder functions
+    {"string_builder_create", make_std_lib_function(string_builder_create), "int", {}},
+    {"string_builder_append", make_std_lib_function(string_builder_append), "void", {"int", "Value"}},
+    {"string_builder_to_string", make_std_lib_function(string_builder_to_string), "std::string", {"int"}},
+    {"string_builder_length", make_std_lib_function(string_builder_length), "int", {"int"}},
+    {"string_builder_clear", make_std_lib_function(string_builder_clear), "void", {"int"}},
+    {"string_builder_free", make_std_lib_function(string_builder_free), "void", {"int"}},
     
 };  
 
@@ -177,11 +203,11 @@ std::any cast_LII_type_to_cpp_type(Value value, std::string type){
     }else if(type == "bool"){
         return VALUE_AS_BOOL(value);
     }else if(type == "std::string"){
-        return VALUE_AS_STRING(value);
+        return std::move(std::get<std::string>(value.data)); // the type was checked by LII_type_matches_cpp_type
     }else if(type == "std::vector<Value>"){
-        return VALUE_AS_VECTOR(value);
+        return std::move(std::get<std::vector<Value>>(value.data));
     }else if(type == "Value"){
-        return std::any(value);
+        return std::any(std::move(value));
     }
     else{
         std_lib_error("cast_LII_type_to_cpp_type", "invalid type [" + type + "]");
@@ -205,14 +231,14 @@ bool is_correct_number_of_parameters(std::string std_lib_name, int num_params){
 
 // Helper to cast std::any to the correct type and call the function
 template<typename Function, typename Tuple, std::size_t... I>
-decltype(auto) callWithCastedArgs(Function func, const std::vector<std::any>& args, Tuple&& tuple, std::index_sequence<I...>) {
-    return func(std::any_cast<std::tuple_element_t<I, std::decay_t<Tuple>>>(args[I])...);
+decltype(auto) callWithCastedArgs(Function func, std::vector<std::any>& args, Tuple&& tuple, std::index_sequence<I...>) {
+    return func(std::any_cast<std::tuple_element_t<I, std::decay_t<Tuple>>>(std::move(args[I]))...);
 }
 
 // Main function to convert std::vector<std::any> to a tuple of args and call the function
 template<typename Return, typename... Args>
 STD_LIB_FUNCTION make_std_lib_function(Return (*function)(Args...)) {
-    return [function](std::vector<std::any> args, std::vector<std::string> arg_types) -> std::any {
+    return [function](std::vector<std::any>& args, const std::vector<std::string>& arg_types) -> std::any {
         if(args.size() != sizeof...(Args)) {
             std_lib_error("make_std_lib_function", "invalid number of arguments");
             return std::any();
@@ -222,7 +248,7 @@ STD_LIB_FUNCTION make_std_lib_function(Return (*function)(Args...)) {
         try {
             if constexpr(!std::is_same_v<Return, void>) {
                 auto result = callWithCastedArgs(function, args, std::tuple<Args...>{}, std::index_sequence_for<Args...>{});
-                return std::any(result);
+                return std::any(std::move(result));
             }
             else {
                 callWithCastedArgs(function, args, std::tuple<Args...>{}, std::index_sequence_for<Args...>{});
@@ -2,6 +2,7 @@
 #define STRINGS_HPP
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <iostream>
 
@@ -42,6 +43,10 @@ std::string string_concat(std::string a, std::string b){
 // start is 0-based, 
 // if start + length is greater than the length of the string, it will return the substring from start to the end of the string
 std::string string_substr(std::string a, int start, int length){ 
+    if(start < 0 || (unsigned)start > a.length()){
+        std_lib_error("string_substr", "start [" + std::to_string(start) + "] out of bounds");
+    }
+
     return a.substr(start, length);
 }
 
@@ -73,22 +78,28 @@ std::string replace_char(std::string a, int index, std::string c){
 
 std::vector<Value> string_to_vector(std::string a){
     std::vector<Value> v;
+    v.reserve(a.length());
     for(int i = 0; i < (int)a.length(); i++){
-        v.push_back({Value_Type::STRING, std::string(1, a[i])});
+        v.emplace_back(Value_Type::STRING, std::string(1, a[i]));
     }
     return v;
 }
 
+// one pass over the string, every token is copied once out of it
 std::vector<Value> string_split(std::string a, std::string delimiter){
+    if(delimiter.empty()){
+        std_lib_error("string_split", "empty delimiter");
+    }
+
+    std::string_view text = a;
     std::vector<Value> v;
-    size_t pos = 0;
-    std::string token;
-    while ((pos = a.find(delimiter)) != std::string::npos) {
-        token = a.substr(0, pos);
-        v.push_back({Value_Type::STRING, token});
-        a.erase(0, pos + delimiter.length());
+    size_t start = 0;
+    size_t pos;
+    while ((pos = text.find(delimiter, start)) != std::string_view::npos) {
+        v.emplace_back(Value_Type::STRING, std::string(text.substr(start, pos - start)));
+        start = pos + delimiter.length();
     }
-    v.push_back({Value_Type::STRING, a});
+    v.emplace_back(Value_Type::STRING, std::string(text.substr(start)));
     return v;
 }
 
@@ -0,0 +1,72 @@
+#ifndef STRING_BUILDER_HPP
+#define STRING_BUILDER_HPP
+
+// String builders, strings that are appended to in place
+// Strings are values, so s = $string_concat(s, x) copies s every time and building a string piece by piece is quadratic
+// A builder is a number that names a string kept by the VM, appending to it only copies what is appended:
+//     let b = $string_builder_create();
+//     $string_builder_append(b, "line ");      any value, shown like print shows it
+//     $string_builder_append(b, 12);
+//     let s = $string_builder_to_string(b);   "line 12"
+//     $string_builder_free(b);                its number is reused by the next builder created
+// s = s + "..." + x already appends in place (OP_APPEND_VAR), builders are for strings built across functions
+
+#include <string>
+#include <vector>
+
+#include "Value.hpp"
+#include "VM.hpp"
+#include "std_lib/helpers.hpp"
+
+std::string &string_builder_get(const std::string &function, int builder)
+{
+    if (builder < 0 || builder >= (int)vm.string_builders.size() || !vm.string_builder_live[builder])
+    {
+        std_lib_error(function, "no string builder [" + std::to_string(builder) + "]");
+    }
+    return vm.string_builders[builder];
+}
+
+int string_builder_create()
+{
+    if (!vm.free_string_builders.empty())
+    {
+        int builder = vm.free_string_builders.back();
+        vm.free_string_builders.pop_back();
+        vm.string_builder_live[builder] = true;
+        return builder;
+    }
+    vm.string_builders.push_back("");
+    vm.string_builder_live.push_back(true);
+    return vm.string_builders.size() - 1;
+}
+
+void string_builder_append(int builder, Value value)
+{
+    append_value_as_string(string_builder_get("string_builder_append", builder), value);
+}
+
+std::string string_builder_to_string(int builder)
+{
+    return string_builder_get("string_builder_to_string", builder);
+}
+
+int string_builder_length(int builder)
+{
+    return string_builder_get("string_builder_length", builder).size();
+}
+
+void string_builder_clear(int builder)
+{
+    string_builder_get("string_builder_clear", builder).clear();
+}
+
+// The memory of the string is given back, the builder can't be used anymore
+void string_builder_free(int builder)
+{
+    std::string().swap(string_builder_get("string_builder_free", builder));
+    vm.string_builder_live[builder] = false;
+    vm.free_string_builders.push_back(builder);
+}
+
+#endif // STRING_BUILDER_HPP
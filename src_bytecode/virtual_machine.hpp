@@ -10,12 +10,90 @@
 #include "VM.hpp"
 #include "jit.hpp"
 
+// Std lib calls ------------------------------------------------------
+// Calls a std lib function with its arguments on the stack, and pushes what it returns
+// Code compiled by the clang backend calls it through vm->call_std_lib, so the functions that keep state (the string
+// builders, $vm_stats) use the executable's copies of the globals instead of their own
+void call_std_lib_function(VM* vm, int function_index)
+{
+    const STD_LIB_FUNCTION_INFO &func = STD_LIB_FUNCTIONS_DEFINITIONS[function_index];
+
+    // Get the arguments
+    std::vector<std::any> args;
+    for (int i = 0; i < (int)func.arg_types.size(); i++)
+    {
+        // check if the argument is the correct type
+        int index = (int)func.arg_types.size() - i - 1;
+        if (!LII_type_matches_cpp_type(top(vm), func.arg_types[index]))
+        {
+            vm_error("Invalid argument type. Expected: " + func.arg_types[index] + ", Got: " + get_value_type_string(top(vm)));
+        }
+        // cast the argument to the c++ type
+        args.push_back(cast_LII_type_to_cpp_type(pop(vm), func.arg_types[index]));
+    }
+
+    // reverse the arguments
+    std::reverse(args.begin(), args.end());
+
+    // Call the function
+    auto result = func.function(args, func.arg_types);
+
+    // Return value
+    if (func.return_type != "void")
+    {
+        // check if the return value is the correct type
+        if (!any_type_check(result, func.return_type))
+        {
+            vm_error("Invalid return type");
+        }
+
+        // cast the any type to the LII type
+        if (func.return_type == "int")
+        {
+            push(vm, {Value_Type::NUMBER, (double)std::any_cast<int>(result)});
+        }
+        else if (func.return_type == "double")
+        {
+            push(vm, {Value_Type::NUMBER, std::any_cast<double>(result)});
+        }
+        else if (func.return_type == "bool")
+        {
+            push(vm, {Value_Type::BOOL, std::any_cast<bool>(result)});
+        }
+        else if (func.return_type == "std::string")
+        {
+            push(vm, {Value_Type::STRING, std::move(*std::any_cast<std::string>(&result))});
+        }
+        else if (func.return_type == "std::vector<Value>")
+        {
+            push(vm, {Value_Type::VECTOR, std::move(*std::any_cast<std::vector<Value>>(&result))});
+        }
+        else if (func.return_type == "Value")
+        {
+            push(vm, std::move(*std::any_cast<Value>(&result)));
+        }
+    }
+}
+
+// -------------------------------------------------------------------
+
 // Initializes the virtual machine ----------------------------------
-void init_vm(cl_exe* exe, bool jit, int stack_capacity = 256)
+void init_vm(cl_exe* exe, bool jit, Jit_Backend jit_backend = Jit_Backend::JIT_BACKEND_CLANG, jit_tiering tiering = jit_tiering(), int stack_capacity = 256)
 {
     vm.stack = new Value[stack_capacity];
     vm.stack_count = 0;
     vm.stack_capacity = stack_capacity;
+    vm.stack_peak = 0;
+    if (value_memory != nullptr)
+    {
+        *value_memory = memory_counters(); // the memory of the program, not of reading it
+    }
+    vm.gc = gc_heap();
+    output_init();
+    vm.call_std_lib = call_std_lib_function;
+    vm.string_builders.clear();
+    vm.string_builder_live.clear();
+    vm.free_string_builders.clear();
 
     vm.function_frames.clear();
     vm.function_frames.push_back(create_function_frame(exe->main));
@@ -23,29 +101,39 @@ void init_vm(cl_exe* exe, bool jit, int stack_capacity = 256)
     vm.constants = exe->constants;
     vm.variable_names = exe->variable_names;
 
+    vm.global_names = exe->global_names;
+    vm.globals = std::vector<Value>(exe->global_names.size(), Value(Value_Type::NULL_VALUE, nullptr));
+    vm.globals_defined = std::vector<bool>(exe->global_names.size(), false);
+
+    vm.empty_shape = new shape();
+    vm.inline_caches = std::vector<inline_cache>(exe->inline_cache_count);
+
     vm.jit = jit;
+    vm.jit_backend = jit_backend;
+    vm.tiering = tiering;
 }
 
 // -------------------------------------------------------------------
 
 // Runs the virtual machine ------------------------------------------
-void vm_loop(bool verbose)
+void vm_loop(VM* vm, bool verbose)
 {
     // Meat of the VM
-    switch (*get_ip(&vm))
+    switch (*get_ip(vm))
     {
     // Arithmetic operations
     case OpCode::OP_ADD:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if (a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER)
         {
-            push(&vm, {Value_Type::NUMBER, std::get<double>(a.data) + std::get<double>(b.data)});
+            push(vm, {Value_Type::NUMBER, std::get<double>(a.data) + std::get<double>(b.data)});
         }
         else if (a.type == Value_Type::STRING || b.type == Value_Type::STRING)
         {
-            push(&vm, {Value_Type::STRING, VALUE_AS_STRING(a) + VALUE_AS_STRING(b)});
+            push(vm, {Value_Type::STRING, concat_values(std::move(a), b)});
         }
         else
         {
@@ -55,11 +143,12 @@ void vm_loop(bool verbose)
     }
     case OpCode::OP_SUB:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if (a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER)
         {
-            push(&vm, {Value_Type::NUMBER, std::get<double>(a.data) - std::get<double>(b.data)});
+            push(vm, {Value_Type::NUMBER, std::get<double>(a.data) - std::get<double>(b.data)});
         }
         else
         {
@@ -69,10 +158,10 @@ void vm_loop(bool verbose)
     }
     case OpCode::OP_U_SUB:
     {
-        Value a = pop(&vm);
+        Value a = pop(vm);
         if (a.type == Value_Type::NUMBER)
         {
-            push(&vm, {Value_Type::NUMBER, -std::get<double>(a.data)});
+            push(vm, {Value_Type::NUMBER, -std::get<double>(a.data)});
         }
         else
         {
@@ -82,11 +171,12 @@ void vm_loop(bool verbose)
     }
     case OpCode::OP_MUL:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if (a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER)
         {
-            push(&vm, {Value_Type::NUMBER, std::get<double>(a.data) * std::get<double>(b.data)});
+            push(vm, {Value_Type::NUMBER, std::get<double>(a.data) * std::get<double>(b.data)});
         }
         else
         {
@@ -96,15 +186,16 @@ void vm_loop(bool verbose)
     }
     case OpCode::OP_DIV:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if (a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER)
         {
             if (std::get<double>(b.data) == 0)
             {
                 vm_error("Division by zero");
             }
-            push(&vm, {Value_Type::NUMBER, std::get<double>(a.data) / std::get<double>(b.data)});
+            push(vm, {Value_Type::NUMBER, std::get<double>(a.data) / std::get<double>(b.data)});
         }
         else
         {
@@ -114,15 +205,16 @@ void vm_loop(bool verbose)
     }
     case OpCode::OP_MOD:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if (a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER)
         {
             if (std::get<double>(b.data) == 0)
             {
                 vm_error("Modulus by zero");
             }
-            push(&vm, {Value_Type::NUMBER, std::fmod(std::get<double>(a.data), std::get<double>(b.data))});
+            push(vm, {Value_Type::NUMBER, std::fmod(std::get<double>(a.data), std::get<double>(b.data))});
         }
         else
         {
@@ -135,22 +227,22 @@ void vm_loop(bool verbose)
     // uses type coercion, check VALUE_AS_BOOL for more info
     case OpCode::OP_AND:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
-        push(&vm, {Value_Type::BOOL, VALUE_AS_BOOL(a) && VALUE_AS_BOOL(b)});
+        Value a = pop(vm);
+        Value b = pop(vm);
+        push(vm, {Value_Type::BOOL, VALUE_AS_BOOL(a) && VALUE_AS_BOOL(b)});
         break;
     }
     case OpCode::OP_OR:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
-        push(&vm, {Value_Type::BOOL, VALUE_AS_BOOL(a) || VALUE_AS_BOOL(b)});
+        Value a = pop(vm);
+        Value b = pop(vm);
+        push(vm, {Value_Type::BOOL, VALUE_AS_BOOL(a) || VALUE_AS_BOOL(b)});
         break;
     }
     case OpCode::OP_NOT:
     {
-        Value a = pop(&vm);
-        push(&vm, {Value_Type::BOOL, !VALUE_AS_BOOL(a)});
+        Value a = pop(vm);
+        push(vm, {Value_Type::BOOL, !VALUE_AS_BOOL(a)});
         break;
     }
 
@@ -160,16 +252,17 @@ void vm_loop(bool verbose)
     {
         // If both are strings, compare the strings
         // Else compare the bool values
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if(a.type == Value_Type::STRING && b.type == Value_Type::STRING){
-            push(&vm, {Value_Type::BOOL, VALUE_AS_STRING(a) == VALUE_AS_STRING(b)});
+            push(vm, {Value_Type::BOOL, VALUE_AS_STRING(a) == VALUE_AS_STRING(b)});
         }
         else if(a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER){
-            push(&vm, {Value_Type::BOOL, VALUE_AS_NUMBER(a) == VALUE_AS_NUMBER(b)});
+            push(vm, {Value_Type::BOOL, VALUE_AS_NUMBER(a) == VALUE_AS_NUMBER(b)});
         }
         else{
-            push(&vm, {Value_Type::BOOL, VALUE_AS_BOOL(a) == VALUE_AS_BOOL(b)});
+            push(vm, {Value_Type::BOOL, VALUE_AS_BOOL(a) == VALUE_AS_BOOL(b)});
         }
         break;
     }
@@ -177,26 +270,28 @@ void vm_loop(bool verbose)
     {
         // If both are strings, compare the strings
         // Else compare the bool values
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if(a.type == Value_Type::STRING && b.type == Value_Type::STRING){
-            push(&vm, {Value_Type::BOOL, VALUE_AS_STRING(a) != VALUE_AS_STRING(b)});
+            push(vm, {Value_Type::BOOL, VALUE_AS_STRING(a) != VALUE_AS_STRING(b)});
         }
         else if(a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER){
-            push(&vm, {Value_Type::BOOL, VALUE_AS_NUMBER(a) != VALUE_AS_NUMBER(b)});
+            push(vm, {Value_Type::BOOL, VALUE_AS_NUMBER(a) != VALUE_AS_NUMBER(b)});
         }
         else{
-            push(&vm, {Value_Type::BOOL, VALUE_AS_BOOL(a) != VALUE_AS_BOOL(b)});
+            push(vm, {Value_Type::BOOL, VALUE_AS_BOOL(a) != VALUE_AS_BOOL(b)});
         }
         break;
     }
     case OpCode::OP_GT:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if (a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER)
         {
-            push(&vm, {Value_Type::BOOL, std::get<double>(a.data) > std::get<double>(b.data)});
+            push(vm, {Value_Type::BOOL, std::get<double>(a.data) > std::get<double>(b.data)});
         }
         else
         {
@@ -206,11 +301,12 @@ void vm_loop(bool verbose)
     }
     case OpCode::OP_GTEQ:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if (a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER)
         {
-            push(&vm, {Value_Type::BOOL, std::get<double>(a.data) >= std::get<double>(b.data)});
+            push(vm, {Value_Type::BOOL, std::get<double>(a.data) >= std::get<double>(b.data)});
         }
         else
         {
@@ -220,11 +316,12 @@ void vm_loop(bool verbose)
     }
     case OpCode::OP_LT:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if (a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER)
         {
-            push(&vm, {Value_Type::BOOL, std::get<double>(a.data) < std::get<double>(b.data)});
+            push(vm, {Value_Type::BOOL, std::get<double>(a.data) < std::get<double>(b.data)});
         }
         else
         {
@@ -234,11 +331,12 @@ void vm_loop(bool verbose)
     }
     case OpCode::OP_LTEQ:
     {
-        Value a = pop(&vm);
-        Value b = pop(&vm);
+        Value a = pop(vm);
+        Value b = pop(vm);
+        record_type_feedback(vm, a, b);
         if (a.type == Value_Type::NUMBER && b.type == Value_Type::NUMBER)
         {
-            push(&vm, {Value_Type::BOOL, std::get<double>(a.data) <= std::get<double>(b.data)});
+            push(vm, {Value_Type::BOOL, std::get<double>(a.data) <= std::get<double>(b.data)});
         }
         else
         {
@@ -250,50 +348,73 @@ void vm_loop(bool verbose)
 
     // Memory operations
     case OpCode::OP_LOAD:
-        push(&vm, get_vm_constant(&vm, get_ip(&vm)[1]));
-        increase_ip(&vm, 1);
+        push(vm, get_vm_constant(vm, get_ip(vm)[1]));
+        increase_ip(vm, 1);
         break;
     case OpCode::OP_STORE_VAR:
-        set_variable(&vm, vm.variable_names[get_ip(&vm)[1]], pop(&vm));
-        increase_ip(&vm, 1);
-        break;
-    case OpCode::OP_UPDATE_VAR:
-        update_variable(&vm, vm.variable_names[get_ip(&vm)[1]], pop(&vm));
-        increase_ip(&vm, 1);
+        set_local(vm, get_ip(vm)[1], pop(vm));
+        increase_ip(vm, 1);
         break;
     case OpCode::OP_LOAD_VAR:
-        push(&vm, get_variable(&vm, vm.variable_names[get_ip(&vm)[1]]));
-        increase_ip(&vm, 1);
+        push(vm, get_local(vm, get_ip(vm)[1]));
+        increase_ip(vm, 1);
+        break;
+    case OpCode::OP_LOAD_GLOBAL:
+        push(vm, get_global(vm, get_ip(vm)[1]));
+        increase_ip(vm, 1);
+        break;
+    case OpCode::OP_STORE_GLOBAL:
+        set_global(vm, get_ip(vm)[1], pop(vm));
+        increase_ip(vm, 1);
         break;
-    case OpCode::OP_LOAD_FUNCTION_VAR:
-        push(&vm, get_function_variable(&vm, vm.variable_names[get_ip(&vm)[1]]));
-        increase_ip(&vm, 1);
+    case OpCode::OP_LOAD_UPVALUE:
+        push(vm, get_upvalue(vm, get_ip(vm)[1]));
+        increase_ip(vm, 1);
         break;
+    case OpCode::OP_UPDATE_UPVALUE:
+        update_upvalue(vm, get_ip(vm)[1], pop(vm));
+        increase_ip(vm, 1);
+        break;
+    case OpCode::OP_APPEND_VAR:
+        append_local(vm, get_ip(vm)[1], pop(vm));
+        increase_ip(vm, 1);
+        break;
+    case OpCode::OP_APPEND_GLOBAL:
+        append_global(vm, get_ip(vm)[1], pop(vm));
+        increase_ip(vm, 1);
+        break;
+    case OpCode::OP_CLOSURE:
+    {
+        function* func = VALUE_AS_FUNCTION(get_vm_constant(vm, get_ip(vm)[1]));
+        push(vm, create_closure(vm, func, &get_ip(vm)[2]));
+        increase_ip(vm, 2 + get_ip(vm)[2] * 2);
+        break;
+    }
 
     // Array operations
     case OpCode::OP_CREATE_VECTOR:
     {
-        push(&vm, {Value_Type::VECTOR, std::vector<Value>()});
+        push(vm, {Value_Type::VECTOR, std::vector<Value>()});
         break;
     }
     case OpCode::OP_VECTOR_PUSH:
     {
-        Value value = pop(&vm);
-        Value vector = pop(&vm);
+        Value value = pop(vm);
+        Value vector = pop(vm);
         if (vector.type != Value_Type::VECTOR)
         {
             vm_error("Invalid type for vector push");
         }
         std::vector<Value> vec = VALUE_AS_VECTOR(vector);
         vec.push_back(value);
-        push(&vm, {Value_Type::VECTOR, vec});
+        push(vm, {Value_Type::VECTOR, vec});
         break;
     }
     case OpCode::OP_UPDATE_VECTOR_ELEMENT:
     {
-        Value index = pop(&vm);
-        Value value = pop(&vm);
-        Value vector = get_variable(&vm, vm.variable_names[get_ip(&vm)[1]]);
+        Value index = pop(vm);
+        Value value = pop(vm);
+        Value vector = get_local(vm, get_ip(vm)[1]);
         if (vector.type != Value_Type::VECTOR || index.type != Value_Type::NUMBER)
         {
             vm_error("Invalid types for vector element update");
@@ -304,14 +425,14 @@ void vm_loop(bool verbose)
             vm_error("Index out of bounds");
         }
         vec[(int)VALUE_AS_NUMBER(index)] = value;
-        update_variable(&vm, vm.variable_names[get_ip(&vm)[1]], {Value_Type::VECTOR, vec});
-        increase_ip(&vm, 1);
+        set_local(vm, get_ip(vm)[1], {Value_Type::VECTOR, vec});
+        increase_ip(vm, 1);
         break;
     }
     case OpCode::OP_LOAD_VECTOR_ELEMENT:
     {
-        Value index = pop(&vm);
-        Value vector = get_variable(&vm, vm.variable_names[get_ip(&vm)[1]]);
+        Value index = pop(vm);
+        Value vector = get_local(vm, get_ip(vm)[1]);
         if (vector.type != Value_Type::VECTOR || index.type != Value_Type::NUMBER)
         {
             vm_error("Invalid types for vector element access");
@@ -321,160 +442,75 @@ void vm_loop(bool verbose)
             vm_error("Index out of bounds");
         }
         std::vector<Value> vec = VALUE_AS_VECTOR(vector);
-        push(&vm, vec[(int)VALUE_AS_NUMBER(index)]);
-        increase_ip(&vm, 1);
+        push(vm, vec[(int)VALUE_AS_NUMBER(index)]);
+        increase_ip(vm, 1);
         break;
     }
 
     // Struct operations
     case OpCode::OP_CREATE_STRUCT:
     {
-        push(&vm, {Value_Type::STRUCT, std::map<std::string, Value>()});
+        push(vm, create_struct(vm));
         break;
     }
     case OpCode::OP_UPDATE_STRUCT_ELEMENT:
     {
-        Value value = pop(&vm);
-        Value struct_ = get_variable(&vm, vm.variable_names[get_ip(&vm)[1]]);
+        Value value = pop(vm);
+        Value struct_ = pop(vm);
         if (struct_.type != Value_Type::STRUCT)
         {
             vm_error("Not a struct");
         }
-        std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(struct_);
-        struct_map[vm.variable_names[get_ip(&vm)[2]]] = value;
-        update_variable(&vm, vm.variable_names[get_ip(&vm)[1]], {Value_Type::STRUCT, struct_map});
-        increase_ip(&vm, 2);
+        set_struct_field(vm, std::get<struct_object>(struct_.data), vm->variable_names[get_ip(vm)[1]], value, get_ip(vm)[2]);
+        push(vm, struct_);
+        increase_ip(vm, 2);
         break;
     }
     case OpCode::OP_LOAD_STRUCT_ELEMENT:
     {
-        Value struct_ = get_variable(&vm, vm.variable_names[get_ip(&vm)[1]]);
-        if (struct_.type != Value_Type::STRUCT)
-        {
-            vm_error("Not a struct");
-        }
-        std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(struct_);
-        push(&vm, struct_map[vm.variable_names[get_ip(&vm)[2]]]);
-        increase_ip(&vm, 2);
+        load_struct_field(vm, get_ip(vm)[1], get_ip(vm)[2]);
+        increase_ip(vm, 2);
         break;
     }
     case OpCode::OP_ACCESS:
     {
-        Value index = pop(&vm);
-        Value obj = pop(&vm);
-        if (obj.type == Value_Type::STRUCT)
-        {
-            std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(obj);
-            //check if the key exists
-            if (struct_map.find(VALUE_AS_STRING(index)) == struct_map.end())
-            {
-                vm_error("Key does not exist in struct");
-            }
-            push(&vm, struct_map[VALUE_AS_STRING(index)]);
-        }
-        else if (obj.type == Value_Type::VECTOR)
-        {
-            std::vector<Value> vec = VALUE_AS_VECTOR(obj);
-            if (index.type != Value_Type::NUMBER)
-            {
-                vm_error("Invalid index type for vector access");
-            }
-            if (VALUE_AS_NUMBER(index) < 0 || VALUE_AS_NUMBER(index) >= vec.size())
-            {
-                vm_error("Index out of bounds");
-            }
-            push(&vm, vec[(int)VALUE_AS_NUMBER(index)]);
-        }
-        else
-        {
-            vm_error("Invalid type for access");
-        }
+        Value index = pop(vm);
+        Value obj = pop(vm);
+        push(vm, access_element(vm, obj, index, get_ip(vm)[1]));
+        increase_ip(vm, 1);
         break;
     }
     case OpCode::OP_ACCESS_FOR_UPDATE:
     {
-        Value index = pop(&vm);
-        Value obj = pop(&vm);
-        push(&vm, obj);
-        push(&vm, index);
-
-        if (obj.type == Value_Type::STRUCT)
-        {
-            std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(obj);
-            //check if the key exists
-            if (struct_map.find(VALUE_AS_STRING(index)) == struct_map.end())
-            {
-                vm_error("Key does not exist in struct");
-            }
-            push(&vm, struct_map[VALUE_AS_STRING(index)]);
-        }
-        else if (obj.type == Value_Type::VECTOR)
-        {
-            std::vector<Value> vec = VALUE_AS_VECTOR(obj);
-            if (index.type != Value_Type::NUMBER)
-            {
-                vm_error("Invalid index type for vector access");
-            }
-            if (VALUE_AS_NUMBER(index) < 0 || VALUE_AS_NUMBER(index) >= vec.size())
-            {
-                vm_error("Index out of bounds");
-            }
-            push(&vm, vec[(int)VALUE_AS_NUMBER(index)]);
-        }
-        else
-        {
-            vm_error("Invalid type for access");
-        }
+        Value index = pop(vm);
+        Value obj = pop(vm);
+        push(vm, obj);
+        push(vm, index);
+        push(vm, access_element(vm, obj, index, get_ip(vm)[1]));
+        increase_ip(vm, 1);
         break;
     }
     case OpCode::OP_UPDATE_STACK_ELEMENT:
     {
-        Value value = pop(&vm);
-        Value index = pop(&vm);
-        Value obj = pop(&vm);
-    
-        if (obj.type == Value_Type::STRUCT)
-        {
-            std::map<std::string, Value> struct_map = VALUE_AS_STRUCT(obj);
-            //check if the key exists
-            if (struct_map.find(VALUE_AS_STRING(index)) == struct_map.end())
-            {
-                vm_error("Key does not exist in struct");
-            }
-            struct_map[VALUE_AS_STRING(index)] = value;
-            push(&vm, {Value_Type::STRUCT, struct_map});
-        }
-        else if (obj.type == Value_Type::VECTOR)
-        {
-            std::vector<Value> vec = VALUE_AS_VECTOR(obj);
-            if (index.type != Value_Type::NUMBER)
-            {
-                vm_error("Invalid index type for vector access");
-            }
-            if (VALUE_AS_NUMBER(index) < 0 || VALUE_AS_NUMBER(index) >= vec.size())
-            {
-                vm_error("Index out of bounds");
-            }
-            vec[(int)VALUE_AS_NUMBER(index)] = value;
-            push(&vm, {Value_Type::VECTOR, vec});
-        }
-        else
-        {
-            vm_error("Invalid type for access");
-        }
+        Value value = pop(vm);
+        Value index = pop(vm);
+        Value obj = pop(vm);
+        update_element(vm, obj, index, value, get_ip(vm)[1]);
+        push(vm, obj);
+        increase_ip(vm, 1);
         break;
     }
 
     // Control flow operations
     case OpCode::OP_RETURN:
     {
-        if (vm.function_frames.size() == 1)
+        if (vm->function_frames.size() == 1)
         {
             // print the return value
             if (verbose)
             {
                 std::cout << "Exit Code: ";
-                print_value(pop(&vm));
+                print_value(pop(vm));
                 std::cout << std::endl;
             }
             return;
@@ -486,8 +522,7 @@ void vm_loop(bool verbose)
         }
 
         // remove the current function frame
-        delete get_current_function_frame(&vm);
-        vm.function_frames.pop_back();
+        pop_function_frame(vm);
 
         // set the ip to the next instruction
         //get_current_function_frame()->ip += 1;
@@ -496,25 +531,37 @@ void vm_loop(bool verbose)
     }
     case OpCode::OP_JUMP:
         {
-            if(!goto_ip(&vm, get_ip(&vm)[1]))
+            function_frame* frame = get_current_function_frame(vm);
+            int index = get_ip(vm) - frame->func->code;
+            if(get_ip(vm)[1] < index) // backward jump, one loop iteration
             {
-                vm_error("Invalid jump index " + std::to_string(get_ip(&vm)[1]));
+                output_check_stop();
+                frame->func->back_edges++;
+                jit_tier_up(vm, frame->func);
+                if(jit_osr(vm, frame->func, index))
+                {
+                    break; // the compiled loop ran until it exited and left the ip where the interpreter continues
+                }
+            }
+            if(!goto_ip(vm, get_ip(vm)[1]))
+            {
+                vm_error("Invalid jump index " + std::to_string(get_ip(vm)[1]));
             }
         }
         break;
     case OpCode::OP_JUMP_IF_FALSE:
     {
-        bool val = VALUE_AS_BOOL(pop(&vm));
+        bool val = VALUE_AS_BOOL(pop(vm));
         if (!val)
         {
-            if(!goto_ip(&vm, get_ip(&vm)[1]))
+            if(!goto_ip(vm, get_ip(vm)[1]))
             {
-                vm_error("Invalid jump index " + std::to_string(get_ip(&vm)[1]));
+                vm_error("Invalid jump index " + std::to_string(get_ip(vm)[1]));
             }
         }
         else
         {
-            increase_ip(&vm, 1);
+            increase_ip(vm, 1);
         }
         break;
     }
@@ -525,116 +572,51 @@ void vm_loop(bool verbose)
             std::cout << "Calling function: " << std::endl;
         }
 
-        function* func = VALUE_AS_FUNCTION(pop(&vm));
-
-        func->times_called++; // for jit compilation
+        output_check_stop();
+        std::shared_ptr<closure> func_closure = VALUE_AS_CLOSURE(pop(vm));
+        function* func = func_closure->func;
 
-        if(vm.jit && func->times_called == CALLS_TO_JIT){
-            if(verbose){
-                std::cout << "JIT compiling function: " << func->name << std::endl;
-            }        
-            jit_compile_function(&vm, func);
+        record_call_feedback(vm, get_ip(vm) - get_current_function_frame(vm)->func->code, func);
+        func->times_called++; // for jit tiering
+        if(jit_tier_up(vm, func) && verbose){
+            std::cout << "JIT compiled function: " << func->name << " (tier " << func->tier << ")" << std::endl;
         }
 
-        if(vm.jit && func->jit_index != -1){
+        if(vm->jit && func->jit_index != -1){
             if(verbose){
                 std::cout << "Calling JIT function: " << func->jit_index << std::endl;
             }
-            vm.function_frames.push_back(create_function_frame(func));
-            jit_run_function(&vm, func->jit_index);
+            vm->function_frames.push_back(create_function_frame(func, func_closure));
+            jit_run_function(vm, func->jit_index);
         }
         else{
-            vm.function_frames.push_back(create_function_frame(func));
+            vm->function_frames.push_back(create_function_frame(func, func_closure));
 
-            get_current_function_frame(&vm)->ip = func->code - 1; // -1 because the ip will be increased by 1
+            get_current_function_frame(vm)->ip = func->code - 1; // -1 because the ip will be increased by 1
         }
 
         break;
     }
 
     case OpCode::OP_STD_LIB_CALL:
-    {
-        increase_ip(&vm, 1);
-
-        STD_LIB_FUNCTION_INFO func = STD_LIB_FUNCTIONS_DEFINITIONS[*get_ip(&vm)];
-
-        // Get the arguments
-        std::vector<std::any> args;
-        for (int i = 0; i < (int)func.arg_types.size(); i++)
-        {
-            // check if the argument is the correct type
-            int index = (int)func.arg_types.size() - i - 1;
-            if (!LII_type_matches_cpp_type(top(&vm), func.arg_types[index]))
-            {
-                vm_error("Invalid argument type. Expected: " + func.arg_types[index] + ", Got: " + get_value_type_string(top(&vm)));
-            }
-            // cast the argument to the c++ type
-            args.push_back(cast_LII_type_to_cpp_type(pop(&vm), func.arg_types[index]));
-        }
-
-        // reverse the arguments
-        std::reverse(args.begin(), args.end());
-
-        // Call the function
-        auto result = func.function(args, func.arg_types);
-
-        // Return value
-        if (func.return_type != "void")
-        {
-            // check if the return value is the correct type
-            if (!any_type_check(result, func.return_type))
-            {
-                vm_error("Invalid return type");
-            }
-
-            // cast the any type to the LII type
-            if (func.return_type == "int")
-            {
-                push(&vm, {Value_Type::NUMBER, (double)std::any_cast<int>(result)});
-            }
-            else if (func.return_type == "double")
-            {
-                push(&vm, {Value_Type::NUMBER, std::any_cast<double>(result)});
-            }
-            else if (func.return_type == "bool")
-            {
-                push(&vm, {Value_Type::BOOL, std::any_cast<bool>(result)});
-            }
-            else if (func.return_type == "std::string")
-            {
-                push(&vm, {Value_Type::STRING, std::any_cast<std::string>(result)});
-            }
-            else if (func.return_type == "std::vector<Value>")
-            {
-                push(&vm, {Value_Type::VECTOR, std::any_cast<std::vector<Value>>(result)});
-            }
-            else if (func.return_type == "Value")
-            {
-                push(&vm, std::any_cast<Value>(result));
-            }
-        }
-
+        call_std_lib_function(vm, get_ip(vm)[1]);
+        increase_ip(vm, 1);
         break;
-    }
 
     // Scope operations
-    case OpCode::OP_INC_SCOPE:
-        get_current_function_frame(&vm)->current_scope++;
-        get_current_function_frame(&vm)->variables.push_back(std::map<std::string, Value>());
-        break;
     case OpCode::OP_DEC_SCOPE:
-        get_current_function_frame(&vm)->current_scope--;
-        get_current_function_frame(&vm)->variables.pop_back();
+        dec_scope(vm, get_ip(vm)[1]);
+        increase_ip(vm, 1);
         break;
 
     // Output operations
     case OpCode::OP_PRINT:
-        // pop(&vm);
+        // pop(vm);
         if(verbose){
             std::cout << "Output: ";
         }
-        print_value(pop(&vm));
-        std::cout << std::endl;
+        print_value(pop(vm));
+        output_write("\n", 1);
         break;
 
     default:
@@ -643,25 +625,44 @@ void vm_loop(bool verbose)
     }
 }
 
-void run_vm(bool verbose = false)
+void run_vm_profiled(VM* vm, bool verbose); // profiler.hpp
+void run_vm_stats(VM* vm, bool verbose); // stats.hpp
+void run_vm_sampled(VM* vm, bool verbose); // sampler.hpp
+
+void run_vm(VM* vm, bool verbose = false)
 {
     if (verbose)
     {
         std::cout << "Running VM" << std::endl;
     }
+    if (vm->profile != nullptr)
+    {
+        run_vm_profiled(vm, verbose);
+        return;
+    }
+    if (vm->stats != nullptr)
+    {
+        run_vm_stats(vm, verbose);
+        return;
+    }
+    if (vm->sampler != nullptr)
+    {
+        run_vm_sampled(vm, verbose);
+        return;
+    }
 
     while (true)
     {
         if (verbose)
         {
-            function_frame *frame = get_current_function_frame(&vm);
+            function_frame *frame = get_current_function_frame(vm);
             int instruction = frame->ip - frame->func->code; // no -1 because this is the instruction that will be executed
 
             std::cout << "IP: " << instruction << std::endl;
         }
 
-        vm_loop(verbose);
-        bool ok = increase_ip(&vm, 1);
+        vm_loop(vm, verbose);
+        bool ok = increase_ip(vm, 1);
         if (!ok)
         {
             break;
@@ -669,9 +670,33 @@ void run_vm(bool verbose = false)
     }
 }
 
-void display_debug_info()
+// Interprets the current frame from its ip until the function returns
+void run_frame(VM* vm, bool verbose = false)
+{
+    int depth = vm->function_frames.size();
+
+    while (true)
+    {
+        vm_loop(vm, verbose);
+        if ((int)vm->function_frames.size() < depth)
+        {
+            break;
+        }
+        increase_ip(vm, 1);
+    }
+}
+
+// Interprets the function in the current frame until it returns, used by compiled code to call a function that isn't compiled
+void run_function(VM* vm, bool verbose = false)
 {
-    function_frame* ff = get_current_function_frame(&vm);
+    function_frame *frame = get_current_function_frame(vm);
+    frame->ip = frame->func->code;
+    run_frame(vm, verbose);
+}
+
+void display_debug_info(VM* vm)
+{
+    function_frame* ff = get_current_function_frame(vm);
     int instruction = ff->ip - ff->func->code - 1; // -1 because this is the instruction that was just executed
 
     std::cout << "IP: " << instruction << std::endl;
@@ -679,23 +704,25 @@ void display_debug_info()
     
 
     std::cout << "\tCurrent Function: " << ff->func->name << std::endl;
-    std::cout << "\tFunction Variables (outermost to innermost scope): " << std::endl;
-    std::vector<std::map<std::string, Value>> variables = ff->variables;
-    for(int i = 0; i < (int)variables.size(); i++)
+    std::cout << "\tGlobals: " << std::endl;
+    for(int i = 0; i < (int)vm->globals.size(); i++)
     {
-        std::cout << "\t\tScope: " << i << std::endl;
-        std::map<std::string, Value> scope_variables = variables[i];
-        for(const auto& pair : scope_variables)
+        if(vm->globals_defined[i])
         {
-            std::cout << "\t\t\t" << pair.first << ": " << VALUE_AS_STRING(pair.second) << std::endl;
+            std::cout << "\t\t" << vm->global_names[i] << ": " << VALUE_AS_STRING(vm->globals[i]) << std::endl;
         }
     }
+    std::cout << "\tFunction Variables (by slot): " << std::endl;
+    for(int i = 0; i < (int)ff->locals.size(); i++)
+    {
+        std::cout << "\t\tSlot " << i << ": " << VALUE_AS_STRING(ff->locals[i]) << std::endl;
+    }
 
 
     std::cout << "Stack: \n";
-    for(int i = 0; i < vm.stack_count; i++)
+    for(int i = 0; i < vm->stack_count; i++)
     {
-        std::cout << VALUE_AS_STRING(vm.stack[i]) << std::endl;
+        std::cout << VALUE_AS_STRING(vm->stack[i]) << std::endl;
     }
 
     std::cout << "--------------------------------------------------------------------" << std::endl;
@@ -707,7 +734,7 @@ void wait_for_continue()
     std::cin.get();
 }
 
-void debug_vm(bool verbose = false)
+void debug_vm(VM* vm, bool verbose = false)
 {
     if (verbose)
     {
@@ -716,12 +743,12 @@ void debug_vm(bool verbose = false)
 
     while (true)
     {
-        vm_loop(verbose);
+        vm_loop(vm, verbose);
 
-        display_debug_info();
+        display_debug_info(vm);
         wait_for_continue();
 
-        bool ok = increase_ip(&vm, 1);
+        bool ok = increase_ip(vm, 1);
         if (!ok)
         {
             break;
@@ -732,16 +759,57 @@ void debug_vm(bool verbose = false)
 // -------------------------------------------------------------------
 
 // Starts the interpretation process ---------------------------------
-void interpret_bytecode(std::string path, bool verbose = false, bool debug = false, bool jit = false)
+void jit_batch_load(VM* vm, const std::string &path, const std::string &program); // jit_batch.hpp
+void jit_batch_save(VM* vm, const std::string &path, const std::string &program); // jit_batch.hpp
+void profile_start(VM* vm); // profiler.hpp
+void profile_stop(VM* vm, const std::string &exe_path); // profiler.hpp
+void sampler_start(VM* vm, const std::string &exe_path, int hz); // sampler.hpp
+void sampler_stop(VM* vm); // sampler.hpp
+void stats_start(VM* vm); // stats.hpp
+void stats_stop(VM* vm, const std::string &exe_path); // stats.hpp
+void memory_report(VM* vm); // memory.hpp
+bool program_calls_std_lib(cl_exe* exe, const std::string &name); // memory.hpp
+void memory_start(); // memory.hpp
+
+// jit_batch_file is the hot function file of -jit-batch, empty when functions are compiled one by one
+// jit_perf exports the compiled code to perf and gdb, profile writes the -profile report when the program ends
+// sample_hz is the rate of the -sample profiler, 0 when it is off, stats writes the -stats=dynamic counts
+// mem prints the memory counters when the program ends
+void interpret_bytecode(std::string path, bool verbose = false, bool debug = false, bool jit = false, Jit_Backend jit_backend = Jit_Backend::JIT_BACKEND_CLANG, jit_tiering tiering = jit_tiering(), std::string jit_batch_file = "", bool jit_perf = false, bool profile = false, int sample_hz = 0, bool stats = false, bool mem = false)
 {
     cl_exe* exe = read_cl_exe(path);
-    init_vm(exe, jit);
-    if(debug){debug_vm(verbose);}
-    else {run_vm(verbose);}
+    if(mem || program_calls_std_lib(exe, "vm_stats")){memory_start();}
+    init_vm(exe, jit, jit_backend, tiering);
+    vm.jit_perf = jit_perf;
+    vm.source_path = cl_source_path(path);
+    if(profile){profile_start(&vm);}
+    if(sample_hz > 0){sampler_start(&vm, path, sample_hz);}
+    if(stats){stats_start(&vm);}
+    if(jit && !jit_batch_file.empty()){jit_batch_load(&vm, jit_batch_file, path);}
+    if(debug){debug_vm(&vm, verbose);}
+    else {run_vm(&vm, verbose);}
+    if(jit && !jit_batch_file.empty()){jit_batch_save(&vm, jit_batch_file, path);}
+    if(stats){stats_stop(&vm, path);}
+    if(sample_hz > 0){sampler_stop(&vm);}
+    if(profile){profile_stop(&vm, path);}
+    if(mem){memory_report(&vm);}
 
     delete exe;
 }
 
 // -------------------------------------------------------------------
 
+#include "jit_runtime.hpp"
+#include "baseline_jit.hpp"
+#include "jit_batch.hpp"
+#include "profiler.hpp"
+#include "sampler.hpp"
+#include "stats.hpp"
+#include "gc.hpp"
+#include "memory.hpp"
+#include "string_builder.hpp"
+#ifdef LII_LLVM_JIT
+#include "llvm_jit.hpp"
+#endif
+
 #endif // VIRUTAL_MACHINE_HPP
\ No newline at end of file
@@ -0,0 +1,32 @@
+// loops that run long enough to be compiled and entered mid loop with -jit
+
+let sum = 0;
+for(let i = 0; i < 30000; i = i + 1){
+    if(i % 2 == 0){
+        continue;
+    }
+    sum = sum + i;
+    if(i == 25001){
+        break;
+    }
+}
+print sum;
+
+let count = 0;
+for(let i = 0; i < 200; i = i + 1){
+    for(let j = 0; j < 100; j = j + 1){
+        count = count + 1;
+    }
+}
+print count;
+
+let find = func(limit){
+    for(let i = 0; i < limit; i = i + 1){
+        if(i * i > 500000000){
+            return i;
+        }
+    }
+    return -1;
+};
+print find(100000);
+print find(10);
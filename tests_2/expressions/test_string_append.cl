@@ -0,0 +1,49 @@
+// s = s + ... appends to s in place, and still gives what + gives
+let report = "";
+for(let i = 0; i < 3; i = i + 1){
+    report = report + "row " + i + ";";
+}
+print report; // row 0;row 1;row 2;
+
+let build = func(n){
+    let text = "nums:";
+    for(let i = 0; i < n; i = i + 1){
+        text = text + i * 2 + ",";
+    }
+    text = text + "end";
+    return text;
+};
+print build(4); // nums:0,2,4,6,end
+
+// a number or a bool variable becomes a string
+let count = 5;
+count = count + " items";
+print count; // 5 items
+let flag = true;
+flag = flag + "!";
+print flag; // true!
+
+// the variable on the right reads its value before the update
+let twice = "ab";
+twice = twice + "-" + twice;
+print twice; // ab-ab
+
+// captured variables
+let make = func(){
+    let log = "";
+    let add = func(line){
+        log = log + line + "|";
+        return log;
+    };
+    return add;
+};
+let add = make();
+let first = add("a");
+print add("b"); // a|b|
+
+// numbers still add up
+let total = 0;
+for(let i = 1; i <= 4; i = i + 1){
+    total = total + i;
+}
+print total; // 10
@@ -0,0 +1,54 @@
+let f = func(){
+    let fs = [];
+    let h = null;
+    for(let i = 0; i < 3; i = i + 1){
+        if(i == 1){
+            let v = i * 10;
+            let g = func(){ return v; };
+            h = g;
+            break;
+        }
+    }
+    if(true){
+        let w = 99;
+        print w;
+    }
+    if(true){
+        let q = 5;
+        print q;
+    }
+    return h;
+};
+let h = f();
+print h();
+let x = 1;
+if(true){
+    let x = x + 1;
+    print x;
+    let x = 7;
+    print x;
+}
+print x;
+
+// continue closes the captured variables of the blocks it leaves
+let k = func(){
+    let a = null;
+    let b = null;
+    for(let i = 0; i < 2; i = i + 1){
+        if(true){
+            let x = i * 10;
+            let g = func(){ return x; };
+            if(i == 0){
+                a = g;
+            }
+            if(i == 1){
+                b = g;
+            }
+            continue;
+        }
+    }
+    print a(); // 0
+    print b(); // 10
+    return 0;
+};
+let r = k();
@@ -0,0 +1,14 @@
+let TAPE_LENGTH = 3;
+let total = 0;
+let add_to_total = func(n){
+    total = total + n * TAPE_LENGTH;
+    return total;
+};
+print add_to_total(1);
+print add_to_total(2);
+print total;
+let P = struct {
+    let a = TAPE_LENGTH;
+    let b = "x";
+};
+print P;
@@ -0,0 +1,30 @@
+// sites that only saw numbers are specialized by the JIT, other types must still work after that
+
+let add = func(a, b){
+    return a + b;
+};
+let same = func(a, b){
+    return a == b;
+};
+
+let total = 0;
+for(let i = 0; i < 10; i = i + 1){
+    total = add(total, i);
+    let equal = same(i, i);
+}
+print total;
+print add("a", "b");
+print add(1, 2);
+print add("x", 1);
+print same("a", "a");
+print same("a", "b");
+print same(2, 2);
+
+let s = 0;
+for(let i = 0; i < 40; i = i + 1){
+    if(i == 30){
+        s = "";
+    }
+    s = s + 1;
+}
+print s;
@@ -0,0 +1,9 @@
+// print is buffered, $flush() writes what was printed so far
+print "before";
+print 1.5;
+print 0.1 + 0.2; // 0.3
+print 1 / 3; // 0.333333
+print -2.50; // -2.5
+$flush();
+print "after";
+print 100000000000000000000;
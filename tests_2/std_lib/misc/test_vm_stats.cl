@@ -0,0 +1,12 @@
+// $vm_stats() returns the memory counters of the VM as a struct
+
+let before = $vm_stats();
+print before["frames"] >= 1; // true, the frame of main
+print before["constants"] > 0; // true
+print before["stack_peak"] <= before["stack_capacity"]; // true
+
+let words = ["a string long enough to need a buffer of its own", "and another one"];
+let after = $vm_stats();
+print after["vector_allocations"] > before["vector_allocations"]; // true
+print after["string_allocations"] > before["string_allocations"]; // true
+print after["string_bytes"] > before["string_bytes"]; // true
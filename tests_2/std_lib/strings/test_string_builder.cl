@@ -0,0 +1,28 @@
+// string builders collect text without copying it on every append
+let sb = $string_builder_create();
+for(let i = 0; i < 5; i = i + 1){
+    $string_builder_append(sb, "item ");
+    $string_builder_append(sb, i);
+    $string_builder_append(sb, ";");
+}
+print $string_builder_length(sb); // 35
+print $string_builder_to_string(sb); // item 0;item 1;item 2;item 3;item 4;
+
+// the builder keeps its text after it is read
+$string_builder_append(sb, true);
+print $string_builder_to_string(sb); // item 0;item 1;item 2;item 3;item 4;true
+
+$string_builder_clear(sb);
+print $string_builder_length(sb); // 0
+$string_builder_append(sb, 2.5);
+print $string_builder_to_string(sb); // 2.5
+
+// builders are independent, a freed one is reused
+let other = $string_builder_create();
+$string_builder_append(other, "other");
+print $string_builder_to_string(other); // other
+$string_builder_free(sb);
+let again = $string_builder_create();
+print again == sb; // true
+print $string_builder_length(again); // 0
+print $string_builder_to_string(other); // other
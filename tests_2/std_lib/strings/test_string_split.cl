@@ -0,0 +1,18 @@
+// $string_split goes over the string once, every delimiter found makes a new token
+print $string_split("a,b,c", ","); // [a, b, c]
+print $string_split("one::two::three", "::"); // [one, two, three]
+print $string_split(",a,,b,", ","); // [, a, , b, ]
+print $string_split("no delimiter", ";"); // [no delimiter]
+print $string_split("", ","); // []
+let parts = $string_split("k1=v1 k2=v2 k3=v3", " ");
+print $vector_len(parts); // 3
+print $string_split($vector_get(parts, 2), "="); // [k3, v3]
+
+// slices of a string
+let text = "Hello, World!";
+print $string_substr(text, 7, 5); // World
+print $string_substr(text, 7, 100); // World!
+print $string_substr(text, 13, 1); // (empty)
+print $char_at(text, 12); // !
+print $string_to_vector("abc"); // [a, b, c]
+print text; // the arguments are unchanged
@@ -0,0 +1,77 @@
+let make_counter = func(){
+    let count = 0;
+    let inc = func(){
+        count = count + 1;
+        return count;
+    };
+    return inc;
+};
+
+let c1 = make_counter();
+let c2 = make_counter();
+print c1();
+print c1();
+print c2();
+print c1();
+
+let outer = func(x){
+    let middle = func(y){
+        let inner = func(z){
+            return x + y + z;
+        };
+        return inner;
+    };
+    return middle;
+};
+let m = outer(1);
+let i = m(2);
+print i(3);
+
+let fib_maker = func(){
+    let fib = func(n){
+        if(n < 2){
+            return n;
+        }
+        return fib(n - 1) + fib(n - 2);
+    };
+    return fib;
+};
+let fib = fib_maker();
+print fib(10);
+
+let g = 5;
+let read_global = func(){
+    return g;
+};
+g = 7;
+print read_global();
+for(let k = 0; k < 2; k = k + 1){
+    let adder = func(n){
+        return n + k;
+    };
+    print adder(10);
+}
+
+// every iteration of a loop has its own body variables, the closures made in it keep them
+let per_iteration = func(){
+    let a = null;
+    let b = null;
+    let c = null;
+    for(let i = 0; i < 3; i = i + 1){
+        let j = i;
+        let g = func(){ return j; };
+        if(i == 0){
+            a = g;
+        }
+        if(i == 1){
+            b = g;
+            continue;
+        }
+        c = g;
+    }
+    print a(); // 0
+    print b(); // 1
+    print c(); // 2
+    return 0;
+};
+let done = per_iteration();
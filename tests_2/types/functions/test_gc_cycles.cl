@@ -0,0 +1,32 @@
+// Recursive local functions are cycles, the closure holds the variable holding the closure
+// The cycle collector frees the ones that are dropped and leaves the ones still in use working
+let make_countdown = func(start){
+    let countdown = func(n){
+        if(n == 0){
+            return start;
+        }
+        return countdown(n - 1) + 1;
+    };
+    return countdown;
+};
+
+let kept = make_countdown(100);
+let counters = [make_countdown(1000), make_countdown(2000)];
+
+let total = 0;
+for(let i = 0; i < 3000; i = i + 1){
+    let dropped = make_countdown(i);
+    total = total + dropped(10);
+}
+print total; // 4528500
+
+print kept(5); // 105
+let first = counters[0];
+let second = counters[1];
+print first(1); // 1001
+print second(2); // 2002
+
+let stats = $vm_stats();
+print stats["gc_collections"] > 0; // true
+print stats["gc_freed_closures"] >= 2000; // true
+print stats["gc_pause_max_us"] <= stats["gc_pause_total_us"]; // true
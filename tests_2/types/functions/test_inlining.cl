@@ -0,0 +1,54 @@
+// small functions called from hot code are inlined or called directly by the JIT
+
+let square = func(x){
+    return x * x;
+};
+let max = func(a, b){
+    if(a > b){
+        return a;
+    }
+    return b;
+};
+let fib = func(n){
+    if(n < 2){
+        return n;
+    }
+    return fib(n - 1) + fib(n - 2);
+};
+let twice = func(f, x){
+    return f(f(x));
+};
+
+let sum = 0;
+let biggest = 0;
+for(let i = 0; i < 50; i = i + 1){
+    sum = sum + square(i);
+    biggest = max(biggest, square(i) % 7);
+}
+print sum;
+print biggest;
+print fib(15);
+
+// the same site calling different functions
+let inc = func(x){
+    return x + 1;
+};
+let total = 0;
+for(let i = 0; i < 20; i = i + 1){
+    total = total + twice(inc, i) + twice(square, 2);
+}
+print total;
+
+// an inlined function called with other types
+let join = func(a, b){
+    return a + b;
+};
+let parts = 0;
+for(let i = 0; i < 30; i = i + 1){
+    let x = i;
+    if(i == 29){
+        x = "end";
+    }
+    parts = join(parts, x);
+}
+print parts;
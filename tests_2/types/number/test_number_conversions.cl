@@ -0,0 +1,9 @@
+// Number constants keep every digit, only printing rounds to 6 decimals
+print 0.0000001 * 10000000; // 1
+print 3.14159265358979 * 1000000000; // 3141592653.58979
+print 123456789.987654321; // 123456789.987654
+print 100000000000000000000; // 100000000000000000000
+
+// numbers in strings
+print "x = " + 1.5; // x = 1.5
+print 10 / 4 + " apples"; // 2.5 apples
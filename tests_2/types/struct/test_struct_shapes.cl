@@ -0,0 +1,31 @@
+let A = struct {
+    let b = 2;
+    let a = 1;
+    let c = 3;
+};
+let B = struct {
+    let c = 30;
+    let a = 10;
+};
+let get_a = func(s){
+    return s["a"];
+};
+let get_key = func(s, k){
+    return s[k];
+};
+print get_a(A);
+print get_a(B);
+print get_a(A);
+print get_key(A, "c");
+print get_key(B, "c");
+let copy = A;
+copy["a"] = 100;
+print A;
+print copy;
+let outer = struct {
+    let inner = A;
+};
+outer["inner"]["b"] = 20;
+print outer["inner"]["b"];
+print outer;
+print get_key(A, "zzz");